@@ -19,9 +19,15 @@
 
 @O ../src/api-client-motis.h -d
 @{
+#ifndef API_CLIENT_MOTIS_HEADER
+#define API_CLIENT_MOTIS_HEADER
+
 #include <string>
 #include <vector>
 
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
 namespace motis {
 
 struct Place {
@@ -43,7 +49,8 @@ struct Place {
 struct EncodedPolyline{
     std::string points;
     long int length;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(EncodedPolyline, points, length);
+    long int precision = 7;
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(EncodedPolyline, points, length, precision);
 };
 
 struct LevelEncodedPolyline {
@@ -124,4 +131,6 @@ struct planReply {
 };
 
 };
+
+#endif
 @}
@@ -0,0 +1,453 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{Benchmarks}
+
+The benchmarks for the hot parts of the program use google benchmark\footnote{\url{https://github.com/google/benchmark}}:
+
+\begin{lstlisting}
+apt-get install libbenchmark-dev
+\end{lstlisting}
+
+They are not built by default, enable them with
+
+\begin{lstlisting}
+cmake -DCO2CARPOOL_BENCHMARKS=ON ..
+make co2carpool_bench
+./co2carpool_bench --benchmark_out=bench.json --benchmark_out_format=json
+\end{lstlisting}
+
+The json output can be compared between two runs with \verb|compare.py| from google benchmark.
+
+No network is needed: the replies of graphhopper and motis are generated with a fixed seed in the shape of real replies. If the environment variable \verb|CO2CARPOOL_BENCH_FIXTURES| points to a directory with recorded replies in \verb|graphhopper.json| and \verb|motis.json| these are used instead.
+
+@O ../src/bench/fixtures.h -d
+@{
+#ifndef BENCH_FIXTURES_HEADER
+#define BENCH_FIXTURES_HEADER
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "participant.h"
+#include "route.h"
+
+namespace fixtures {
+
+@<Bench polyline encoder@>
+
+inline nlohmann::json recorded(const std::string& name){
+    const char* directory = std::getenv("CO2CARPOOL_BENCH_FIXTURES");
+    if(!directory) return nlohmann::json();
+    std::ifstream file(std::string(directory) + "/" + name);
+    if(!file) return nlohmann::json();
+    return nlohmann::json::parse(file);
+}
+
+inline std::vector<route::coordinate> path(unsigned int points, unsigned int seed = 1){
+    std::mt19937 generator(seed);
+    std::normal_distribution<double> step(0.0, 0.0005);
+    std::vector<route::coordinate> result;
+    route::coordinate current = {50.9427839, 6.9590705};
+    for(unsigned int i=0; i<points; i++){
+        // Drive roughly south east like from Cologne to Tuebingen
+        current.lat += -0.0004 + step(generator);
+        current.lon += 0.0002 + step(generator);
+        result.push_back(current);
+    }
+    return result;
+}
+
+inline std::string graphhopperReply(unsigned int points){
+    nlohmann::json reply = recorded("graphhopper.json");
+    if(!reply.is_null()) return reply.dump();
+    std::vector<route::coordinate> coordinates = path(points);
+    nlohmann::json j_coordinates = nlohmann::json::array();
+    for(const auto& coordinate: coordinates)
+        j_coordinates.push_back({coordinate.lon, coordinate.lat});
+    nlohmann::json instructions = nlohmann::json::array();
+    std::mt19937 generator(2);
+    std::uniform_real_distribution<double> speed(30, 130);
+    for(unsigned int i=0; i+10<points; i+=10){
+        double distance = 400 + i % 300;
+        instructions.push_back({{"distance", distance}, {"interval", {i, i+10}}, {"sign", (int)(i % 7) - 3},
+                {"street_name", "Street " + std::to_string(i)}, {"text", "Continue onto Street " + std::to_string(i)},
+                {"time", (unsigned int)(distance / speed(generator) * 3600.0)}, {"heading", 120.5}});
+    }
+    return nlohmann::json({{"hints", {{"visited_nodes.sum", 1000}}}, {"info", {{"copyrights", {"GraphHopper", "OpenStreetMap contributors"}}, {"took", 10}}},
+            {"paths", {{{"distance", 377000.0}, {"time", 14000000}, {"points_encoded", false},
+                {"points", {{"type", "LineString"}, {"coordinates", j_coordinates}}}, {"instructions", instructions}}}}}).dump();
+}
+
+inline nlohmann::json motisPlace(const std::string& name, const route::coordinate& coordinate){
+    return {{"name", name}, {"stopId", "de:08416:" + name}, {"lat", coordinate.lat}, {"lon", coordinate.lon}, {"level", 0},
+        {"arrival", 1700000000}, {"departure", 1700000060}, {"scheduledTrack", "1"}, {"track", "1"}, {"vertexType", "TRANSIT"}};
+}
+
+inline std::string motisReply(unsigned int itineraries, unsigned int legs, unsigned int stops){
+    nlohmann::json reply = recorded("motis.json");
+    if(!reply.is_null()) return reply.dump();
+    std::vector<route::coordinate> coordinates = path(legs * (stops + 1) + 1, 3);
+    nlohmann::json j_itineraries = nlohmann::json::array();
+    for(unsigned int i=0; i<itineraries; i++){
+        nlohmann::json j_legs = nlohmann::json::array();
+        for(unsigned int l=0; l<legs; l++){
+            unsigned int first = l * (stops + 1);
+            nlohmann::json intermediateStops = nlohmann::json::array();
+            for(unsigned int s=1; s<=stops; s++)
+                intermediateStops.push_back(motisPlace("Stop " + std::to_string(first + s), coordinates[first + s]));
+            std::vector<route::coordinate> geometry(coordinates.begin() + first, coordinates.begin() + first + stops + 2);
+            bool walk = l % 2 == 1;
+            j_legs.push_back({{"mode", walk ? "WALK" : "REGIONAL_RAIL"},
+                {"from", motisPlace("Stop " + std::to_string(first), coordinates[first])},
+                {"to", motisPlace("Stop " + std::to_string(first + stops + 1), coordinates[first + stops + 1])},
+                {"duration", 1800}, {"startTime", 1700000000}, {"endTime", 1700001800}, {"realTime", false},
+                {"distance", walk ? 300.0 : 0.0}, {"interlineWithPreviousLeg", false},
+                {"route", "RE 5"}, {"headsign", "Tuebingen Hbf"}, {"agencyName", "DB Regio AG"}, {"agencyUrl", "https://www.bahn.de"},
+                {"routeColor", "ff0000"}, {"routeTextColor", "ffffff"}, {"routeType", "2"}, {"routeId", "1"}, {"agencyId", "db"},
+                {"tripId", "20231101_1"}, {"serviceDate", "2023-11-01"}, {"routeShortName", "RE 5"}, {"source", "bench"},
+                {"intermediateStops", intermediateStops},
+                {"legGeometry", {{"points", encodePolyline(geometry, 7)}, {"length", geometry.size()}}},
+                {"legGeometryWithLevels", nlohmann::json::array()},
+                {"steps", nlohmann::json::array()}});
+        }
+        j_itineraries.push_back({{"duration", 1800 * legs}, {"startTime", 1700000000}, {"endTime", 1700000000 + 1800 * legs},
+            {"walkTime", 600}, {"transitTime", 1200 * legs}, {"waitingTime", 300}, {"walkDistance", 300},
+            {"transfers", legs / 2}, {"legs", j_legs}});
+    }
+    return nlohmann::json({{"requestParameters", {{"fromPlace", "50.94,6.96"}, {"toPlace", "48.54,9.06"}}},
+            {"debugOutput", {{"execution_time", 100}}},
+            {"from", motisPlace("Start", coordinates.front())}, {"to", motisPlace("Destination", coordinates.back())},
+            {"itineraries", j_itineraries}, {"previousPageCursor", "EARLIER|1700000000"}, {"nextPageCursor", "LATER|1700000000"}}).dump();
+}
+
+// Participants clustered around a few cities, every fifth one is a driver
+inline std::vector<participant> participants(unsigned int count){
+    const std::vector<route::coordinate> cities = {
+        {52.52, 13.40}, {53.55, 9.99}, {48.14, 11.58}, {50.94, 6.96}, {50.11, 8.68}, {48.78, 9.18}, {51.34, 12.37}, {47.37, 8.54}, {48.21, 16.37}
+    };
+    std::mt19937 generator(4);
+    std::uniform_int_distribution<unsigned int> city(0, cities.size() - 1);
+    std::normal_distribution<double> spread(0.0, 0.3);
+    std::vector<participant> result;
+    for(unsigned int i=0; i<count; i++){
+        const route::coordinate& center = cities[city(generator)];
+        bool driver = i % 5 == 0;
+        result.push_back({i + 1, "participant " + std::to_string(i + 1), driver, driver ? 1 + i % 4 : 0,
+                driver ? "HBEFA4/PC_petrol_Euro-4" : "", {center.lat + spread(generator), center.lon + spread(generator)}});
+    }
+    return result;
+}
+
+};
+
+#endif
+@}
+
+The fixtures need a polyline encoder, the reverse of the decoder in the geo helpers.
+
+@d Bench polyline encoder
+@{inline std::string encodePolyline(const std::vector<route::coordinate>& path, int precision){
+    std::string points;
+    const double factor = std::pow(10.0, precision);
+    long long int previousLat = 0, previousLon = 0;
+    auto encode = [&points](long long int value){
+        unsigned long long int zigzag = value < 0 ? ~((unsigned long long int)value << 1) : (unsigned long long int)value << 1;
+        while(zigzag >= 0x20){
+            points += (char)((0x20 | (zigzag & 0x1f)) + 63);
+            zigzag >>= 5;
+        }
+        points += (char)(zigzag + 63);
+    };
+    for(const auto& coordinate: path){
+        long long int lat = std::llround(coordinate.lat * factor);
+        long long int lon = std::llround(coordinate.lon * factor);
+        encode(lat - previousLat);
+        encode(lon - previousLon);
+        previousLat = lat;
+        previousLon = lon;
+    }
+    return points;
+}
+@}
+
+Each benchmark covers one stage. For the $CO_2$ calculation we compare looking up the emission class and calling \verb|compute| for every instruction (scalar) with one lookup and the loop over all instructions of a route (batch). There is no optimizer yet, so the prefilter on synthetic participant sets stands for the planning step.
+
+The spatial lookups of the planner need a PostgreSQL database with PostGIS, which is given by its conninfo in the environment variable \verb|CO2CARPOOL_BENCH_DATABASE|; without it the benchmark is skipped. The synthetic participants are written into that database. For every driver the nearest passengers are looked up, one query after the other on a connection of the pool (0) or all at once through the pipeline class (1).
+
+@O ../src/bench/bench.cpp -d
+@{
+#include <benchmark/benchmark.h>
+
+#include "bench/fixtures.h"
+#include "compactpath.h"
+#include "database.h"
+#include "ewkb.h"
+#include "geo.h"
+#include "isoemission.h"
+#include "logger.h"
+#include "pipeline.h"
+#include "prefilter.h"
+#include "ptemission.h"
+#include "route.h"
+#include "api-client-motis.h"
+#include "projection.h"
+#include "itineraries.h"
+#include "scheduler.h"
+#include "simplifier.h"
+#include "sumo/emissions/PollutantsInterface.h"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+
+static const bool quiet = (logger::instance().configure({{"level", "error"}}), true);
+
+static std::vector<route::instruction> instructions(void){
+    nlohmann::json reply = nlohmann::json::parse(fixtures::graphhopperReply(10000));
+    return reply["paths"][0]["instructions"].get<std::vector<route::instruction> >();
+}
+
+static void BM_getClassByName(benchmark::State& state){
+    for(auto _: state)
+        benchmark::DoNotOptimize(PollutantsInterface::getClassByName("HBEFA4/PC_petrol_Euro-4"));
+}
+BENCHMARK(BM_getClassByName);
+
+static void BM_computeScalar(benchmark::State& state){
+    std::vector<route::instruction> steps = instructions();
+    for(auto _: state){
+        double total_co2 = 0;
+        for(auto& step: steps){
+            if(step.time == 0) continue;
+            SUMOEmissionClass emissionClass = PollutantsInterface::getClassByName("HBEFA4/PC_petrol_Euro-4");
+            double speed = (step.distance / ((double)step.time / 1000.0)) * 3.6;
+            total_co2 += (PollutantsInterface::compute(emissionClass, PollutantsInterface::EmissionType::CO2, speed, 0, 0) / 1000.0) * ((double)step.time / 1000.0);
+        }
+        benchmark::DoNotOptimize(total_co2);
+    }
+    state.SetItemsProcessed(state.iterations() * steps.size());
+}
+BENCHMARK(BM_computeScalar);
+
+static void BM_computeBatch(benchmark::State& state){
+    std::vector<route::instruction> steps = instructions();
+    for(auto _: state){
+        SUMOEmissionClass emissionClass = PollutantsInterface::getClassByName("HBEFA4/PC_petrol_Euro-4");
+        benchmark::DoNotOptimize(route::co2(emissionClass, steps));
+    }
+    state.SetItemsProcessed(state.iterations() * steps.size());
+}
+BENCHMARK(BM_computeBatch);
+
+static void BM_parseGraphhopper(benchmark::State& state){
+    std::string reply = fixtures::graphhopperReply(state.range(0));
+    for(auto _: state){
+        nlohmann::json result = nlohmann::json::parse(reply);
+        std::vector<route::coordinate> routePath;
+        for(const auto& coordinate: result["paths"][0]["points"]["coordinates"])
+            routePath.push_back({coordinate[1], coordinate[0]});
+        std::vector<route::instruction> steps = result["paths"][0]["instructions"].get<std::vector<route::instruction> >();
+        benchmark::DoNotOptimize(routePath.data());
+        benchmark::DoNotOptimize(steps.data());
+    }
+    state.SetBytesProcessed(state.iterations() * reply.size());
+}
+BENCHMARK(BM_parseGraphhopper)->Arg(1000)->Arg(10000);
+
+static void BM_parseMotis(benchmark::State& state){
+    std::string reply = fixtures::motisReply(5, state.range(0), state.range(1));
+    for(auto _: state){
+        motis::planReply result = nlohmann::json::parse(reply).get<motis::planReply>();
+        benchmark::DoNotOptimize(result.itineraries.data());
+    }
+    state.SetBytesProcessed(state.iterations() * reply.size());
+}
+BENCHMARK(BM_parseMotis)->Args({3, 5})->Args({8, 30});
+
+static void BM_parseMotisProjected(benchmark::State& state){
+    std::string reply = fixtures::motisReply(5, state.range(0), state.range(1));
+    projection fields(ptemission::fields());
+    for(auto _: state){
+        motis::planReply result = fields.parse(reply).get<motis::planReply>();
+        benchmark::DoNotOptimize(result.itineraries.data());
+    }
+    state.SetBytesProcessed(state.iterations() * reply.size());
+}
+BENCHMARK(BM_parseMotisProjected)->Args({3, 5})->Args({8, 30});
+
+static void BM_compactMotis(benchmark::State& state){
+    std::string reply = fixtures::motisReply(5, state.range(0), state.range(1));
+    projection fields(ptemission::fields());
+    motis::arena memory;
+    for(auto _: state){
+        {
+            std::pmr::vector<motis::compactItinerary> result = motis::itineraries(fields.parse(reply), memory);
+            benchmark::DoNotOptimize(result.data());
+        }
+        if(memory.bytes() > 16 * 1024 * 1024)
+            memory.release();
+    }
+    state.SetBytesProcessed(state.iterations() * reply.size());
+}
+BENCHMARK(BM_compactMotis)->Args({3, 5})->Args({8, 30});
+
+static void BM_ptEmission(benchmark::State& state){
+    motis::planReply result = nlohmann::json::parse(fixtures::motisReply(5, 8, 30)).get<motis::planReply>();
+    ptemission table;
+    for(auto _: state)
+        for(const auto& itinerary: result.itineraries)
+            benchmark::DoNotOptimize(table.co2(itinerary));
+}
+BENCHMARK(BM_ptEmission);
+
+static void BM_isoemission(benchmark::State& state){
+    for(auto _: state){
+        double area = 0;
+        for(double d_doubledash = -100; d_doubledash < 500; d_doubledash += 1){
+            double width = isoemissionzone::dd1(d_doubledash, 4, 377, 160, 38);
+            if(!std::isnan(width)) area += width;
+        }
+        benchmark::DoNotOptimize(area);
+        benchmark::DoNotOptimize(isoemissionzone::ddd0(4, 377, 160, 38));
+        benchmark::DoNotOptimize(isoemissionzone::ddd1(4, 377, 160, 38));
+    }
+    state.SetItemsProcessed(state.iterations() * 600);
+}
+BENCHMARK(BM_isoemission);
+
+static void BM_decodePolyline(benchmark::State& state){
+    std::string points = fixtures::encodePolyline(fixtures::path(state.range(0)), 7);
+    for(auto _: state)
+        benchmark::DoNotOptimize(geo::decodePolyline(points, 7).data());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_decodePolyline)->Arg(100)->Arg(10000);
+
+static void BM_decodeEwkb(benchmark::State& state){
+    std::string geometry = ewkb::lineString(fixtures::path(state.range(0)));
+    std::vector<route::coordinate> path;
+    for(auto _: state){
+        ewkb::reader(geometry.data(), geometry.size()).lineString(path);
+        benchmark::DoNotOptimize(path.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * geometry.size());
+}
+BENCHMARK(BM_decodeEwkb)->Arg(100)->Arg(10000);
+
+static void BM_compactPath(benchmark::State& state){
+    std::vector<route::coordinate> points = fixtures::path(state.range(0));
+    for(auto _: state){
+        compactPath<route::coordinate> path(points);
+        double sum = 0;
+        for(const auto& position: path)
+            sum += position.lat;
+        benchmark::DoNotOptimize(sum);
+    }
+    compactPath<route::coordinate> path(points);
+    state.counters["bytes_per_point"] = static_cast<double>(path.bytes()) / points.size();
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_compactPath)->Arg(100)->Arg(10000);
+
+static void BM_simplify(benchmark::State& state){
+    std::vector<route::coordinate> path = fixtures::path(state.range(1));
+    simplifier pathSimplifier({{"tolerance_m", 5}, {"method", state.range(0) ? "visvalingam" : "douglas_peucker"}});
+    std::size_t kept = 0;
+    for(auto _: state){
+        kept = pathSimplifier.keep(path).size();
+        benchmark::DoNotOptimize(kept);
+    }
+    state.counters["kept"] = static_cast<double>(kept) / path.size();
+    state.SetItemsProcessed(state.iterations() * path.size());
+}
+BENCHMARK(BM_simplify)->Args({0, 10000})->Args({1, 10000});
+
+static void BM_prefilter(benchmark::State& state){
+    std::vector<participant> participants = fixtures::participants(state.range(0));
+    prefilter pairFilter(nlohmann::json::object());
+    const route::coordinate destination = {48.5425790, 9.0571074};
+    for(auto _: state)
+        benchmark::DoNotOptimize(pairFilter.candidates(participants, destination).data());
+    state.counters["pruned"] = pairFilter.pruned();
+    state.counters["kept"] = pairFilter.kept();
+}
+BENCHMARK(BM_prefilter)->Arg(200)->Arg(2000)->Arg(5000)->Unit(benchmark::kMillisecond);
+
+static void BM_nearestPassengers(benchmark::State& state){
+    const char* conninfo = std::getenv("CO2CARPOOL_BENCH_DATABASE");
+    if(!conninfo){
+        state.SkipWithError("CO2CARPOOL_BENCH_DATABASE not set");
+        return;
+    }
+    scheduler workers(nlohmann::json{{"workers", 2}});
+    // One connection for the queries one after the other, one for the pipeline
+    database db({{"conninfo", conninfo}, {"pool_size", 2}}, workers.workers());
+    std::vector<participant> participants = fixtures::participants(1000);
+    if(!db.connected() || !db.insertParticipants(participants)){
+        state.SkipWithError("database not available");
+        return;
+    }
+    std::vector<route::coordinate> drivers;
+    for(const auto& traveller: participants)
+        if(traveller.driver)
+            drivers.push_back(traveller.start);
+    const std::string count = "10";
+    if(state.range(0) == 0){
+        database::lease connection = db.checkout();
+        for(auto _: state)
+            for(const auto& start: drivers){
+                std::string lat = std::to_string(start.lat), lon = std::to_string(start.lon);
+                const char* values[3] = {lat.c_str(), lon.c_str(), count.c_str()};
+                PGresult* rows = PQexecPrepared(connection.get(), "participants_nearest", 3, values, NULL, NULL, 0);
+                benchmark::DoNotOptimize(PQntuples(rows));
+                PQclear(rows);
+            }
+    }
+    else{
+        pipeline lookups(db, workers);
+        if(!lookups.ready()){
+            state.SkipWithError("pipeline not available");
+            return;
+        }
+        for(auto _: state){
+            std::mutex doneMutex;
+            std::condition_variable done;
+            std::size_t remaining = drivers.size();
+            for(const auto& start: drivers)
+                lookups.nearestPassengers(start, std::stoul(count), [&](std::vector<unsigned int> passengers){
+                    benchmark::DoNotOptimize(passengers.data());
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    if(--remaining == 0)
+                        done.notify_all();
+                });
+            std::unique_lock<std::mutex> lock(doneMutex);
+            done.wait(lock, [&remaining]{ return remaining == 0; });
+        }
+    }
+    state.counters["lookups"] = benchmark::Counter(drivers.size(), benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_nearestPassengers)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+@}
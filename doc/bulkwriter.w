@@ -0,0 +1,316 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{bulkwriter class}
+
+Inserting the route segments and isoemission zones row by row costs one round trip per row. The bulkwriter collects the rows instead and sends them in batches with the binary \verb|COPY| of PostgreSQL. The geometries are encoded as EWKB straight from the coordinates of the route.
+
+Adding a row only appends it to a buffer. When a buffer has \verb|batch_rows| rows, or after \verb|flush_interval_ms|, it is handed to a background thread which writes it with a connection from the database pool. As \verb|COPY| can not update existing rows, a batch is copied into a temporary table first and then inserted or updated in one statement. \verb|flush| blocks until everything added so far is written. After each batch and at the end the rows per second are logged.
+
+\begin{lstlisting}
+"bulkwriter": { "batch_rows": 1000, "flush_interval_ms": 200 }
+\end{lstlisting}
+
+@O ../src/bulkwriter.h -d
+@{
+#ifndef BULKWRITER_CLASS
+#define BULKWRITER_CLASS
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "database.h"
+#include "route.h"
+
+class bulkwriter {
+public:
+    bulkwriter(database& db, const nlohmann::json& config = nlohmann::json::object());
+    ~bulkwriter(void);
+    // False if an id does not fit the smallint columns, the row is not added then
+    bool addRouteSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const std::vector<route::coordinate>& path);
+    bool addRouteSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const compactPath<route::coordinate>& path);
+    bool addIsoemission(unsigned int id, unsigned int driver_id, unsigned int capacity, const std::vector<route::coordinate>& zone);
+    // Blocks until all added rows are written
+    void flush(void);
+    unsigned long long int rows(void) const;
+private:
+    bool addSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const std::string& lineString);
+    enum target { routeSegments = 0, isoemissions = 1 };
+    struct batch {
+        target table;
+        std::string data;
+        unsigned int rows;
+    };
+    void add(target table, std::string& tuple);
+    void handOver(target table);
+    void writeLoop(void);
+    bool copy(const batch& rows);
+    struct cfg {
+        cfg() : batch_rows(1000), flush_interval_ms(200){};
+        unsigned int batch_rows;
+        unsigned int flush_interval_ms;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, batch_rows, flush_interval_ms);
+    } config;
+    database& db;
+    batch buffers[2];
+    std::deque<batch> batches;
+    bool writing;
+    bool stopping;
+    std::atomic<unsigned long long int> written;
+    double writeSeconds;
+    std::mutex bufferMutex;
+    std::condition_variable wakeUp;
+    std::condition_variable drained;
+    std::thread writer;
+};
+
+#endif
+@}
+
+Every tuple of the binary copy format starts with the number of fields as 16 bit integer, followed by each field as its length in bytes and the data, all in network byte order. Our ids and capacities are \verb|smallint|. A larger value would wrap around and, because existing rows are updated, overwrite an unrelated row, so such a row is rejected with an error.
+
+@O ../src/bulkwriter.cpp -d
+@{
+#include "bulkwriter.h"
+#include "ewkb.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <initializer_list>
+#include <limits>
+
+static void putInt16(std::string& buffer, int16_t value){
+    buffer.push_back(static_cast<char>((value >> 8) & 0xff));
+    buffer.push_back(static_cast<char>(value & 0xff));
+}
+
+static void putInt32(std::string& buffer, int32_t value){
+    for(int i=3; i>=0; i--)
+        buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+static void putSmallintField(std::string& buffer, unsigned int value){
+    putInt32(buffer, 2);
+    putInt16(buffer, static_cast<int16_t>(value));
+}
+
+static bool smallints(const char* table, std::initializer_list<unsigned int> values){
+    for(unsigned int value: values)
+        if(value > static_cast<unsigned int>(std::numeric_limits<int16_t>::max())){
+            LOG_ERROR("bulkwriter: value does not fit into smallint, row rejected", "table", table, "value", value);
+            return false;
+        }
+    return true;
+}
+
+static void putGeometryField(std::string& buffer, const std::string& geometry){
+    putInt32(buffer, geometry.size());
+    buffer += geometry;
+}
+
+struct copyTable {
+    const char* table;
+    const char* columns;
+    const char* update;
+};
+
+static const copyTable copyTables[2] = {
+    {"routesegment", "id, from_id, to_id, route",
+        "from_id = EXCLUDED.from_id, to_id = EXCLUDED.to_id, route = EXCLUDED.route"},
+    {"isoemission", "id, driver_id, capacity, isoemissionzone",
+        "driver_id = EXCLUDED.driver_id, capacity = EXCLUDED.capacity, isoemissionzone = EXCLUDED.isoemissionzone"}
+};
+
+bulkwriter::bulkwriter(database& l_db, const nlohmann::json& l_config):
+    config(l_config), db(l_db), writing(false), stopping(false), written(0), writeSeconds(0)
+{
+    buffers[routeSegments] = {routeSegments, "", 0};
+    buffers[isoemissions] = {isoemissions, "", 0};
+    writer = std::thread(&bulkwriter::writeLoop, this);
+}
+
+bulkwriter::~bulkwriter(void){
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    writer.join();
+    LOG_INFO("bulkwriter: done", "rows", written, "seconds", writeSeconds, "rows_per_second", writeSeconds > 0 ? written / writeSeconds : 0.0);
+}
+
+unsigned long long int bulkwriter::rows(void) const{
+    return written;
+}
+
+bool bulkwriter::addRouteSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const std::vector<route::coordinate>& path){
+    return addSegment(id, from_id, to_id, ewkb::lineString(path));
+}
+
+bool bulkwriter::addRouteSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const compactPath<route::coordinate>& path){
+    return addSegment(id, from_id, to_id, ewkb::lineString(path));
+}
+
+bool bulkwriter::addSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const std::string& lineString){
+    if(!smallints("routesegment", {id, from_id, to_id}))
+        return false;
+    std::string tuple;
+    putInt16(tuple, 4);
+    putSmallintField(tuple, id);
+    putSmallintField(tuple, from_id);
+    putSmallintField(tuple, to_id);
+    putGeometryField(tuple, lineString);
+    add(routeSegments, tuple);
+    return true;
+}
+
+bool bulkwriter::addIsoemission(unsigned int id, unsigned int driver_id, unsigned int capacity, const std::vector<route::coordinate>& zone){
+    if(!smallints("isoemission", {id, driver_id, capacity}))
+        return false;
+    std::string tuple;
+    putInt16(tuple, 4);
+    putSmallintField(tuple, id);
+    putSmallintField(tuple, driver_id);
+    putSmallintField(tuple, capacity);
+    putGeometryField(tuple, ewkb::polygon(zone));
+    add(isoemissions, tuple);
+    return true;
+}
+
+void bulkwriter::add(target table, std::string& tuple){
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    buffers[table].data += tuple;
+    if(++buffers[table].rows >= config.batch_rows)
+        handOver(table);
+}
+
+// Called with bufferMutex locked
+void bulkwriter::handOver(target table){
+    if(buffers[table].rows == 0)
+        return;
+    batches.push_back(std::move(buffers[table]));
+    buffers[table] = {table, "", 0};
+    wakeUp.notify_one();
+}
+
+void bulkwriter::flush(void){
+    std::unique_lock<std::mutex> lock(bufferMutex);
+    handOver(routeSegments);
+    handOver(isoemissions);
+    drained.wait(lock, [this]{ return batches.empty() && !writing; });
+}
+@}
+
+The background thread waits for full batches and otherwise hands over the buffers after the flush interval.
+
+@O ../src/bulkwriter.cpp -d
+@{
+void bulkwriter::writeLoop(void){
+    std::unique_lock<std::mutex> lock(bufferMutex);
+    for(;;){
+        if(!wakeUp.wait_for(lock, std::chrono::milliseconds(config.flush_interval_ms), [this]{ return stopping || !batches.empty(); })){
+            handOver(routeSegments);
+            handOver(isoemissions);
+        }
+        if(batches.empty()){
+            if(stopping)
+                return;
+            continue;
+        }
+        batch rows = std::move(batches.front());
+        batches.pop_front();
+        writing = true;
+        lock.unlock();
+        auto start = std::chrono::steady_clock::now();
+        bool ok = copy(rows);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        lock.lock();
+        writing = false;
+        if(ok){
+            written += rows.rows;
+            writeSeconds += seconds;
+            LOG_INFO("bulkwriter: copied rows", "table", copyTables[rows.table].table, "rows", rows.rows, "rows_per_second", seconds > 0 ? rows.rows / seconds : 0.0);
+        }
+        drained.notify_all();
+    }
+}
+
+bool bulkwriter::copy(const batch& rows){
+    const copyTable& table = copyTables[rows.table];
+    metrics& registry = metrics::instance();
+    metrics::scopedTimer timer(registry.getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", std::string("copy_") + table.table}}), "bulkwriter::copy", "database");
+    database::lease connection = db.checkout();
+    PGconn* conn = connection.get();
+    if(!conn)
+        return false;
+    std::string staging = std::string("pg_temp.") + table.table + "_staging";
+    std::vector<std::string> statements = {
+        "BEGIN",
+        "CREATE TEMP TABLE " + staging + " (LIKE public." + table.table + ") ON COMMIT DROP",
+        std::string("COPY ") + staging + " (" + table.columns + ") FROM STDIN (FORMAT binary)"
+    };
+    for(const auto& statement: statements){
+        PGresult* result = PQexec(conn, statement.c_str());
+        ExecStatusType status = PQresultStatus(result);
+        PQclear(result);
+        if(status != PGRES_COMMAND_OK && status != PGRES_COPY_IN){
+            LOG_ERROR("bulkwriter: statement failed", "statement", statement, "error", PQerrorMessage(conn));
+            PQclear(PQexec(conn, "ROLLBACK"));
+            return false;
+        }
+    }
+    static const char header[19] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0', 0, 0, 0, 0, 0, 0, 0, 0};
+    static const char trailer[2] = {'\377', '\377'};
+    bool ok = PQputCopyData(conn, header, sizeof(header)) == 1
+        && PQputCopyData(conn, rows.data.data(), rows.data.size()) == 1
+        && PQputCopyData(conn, trailer, sizeof(trailer)) == 1;
+    if(PQputCopyEnd(conn, ok ? NULL : "bulkwriter: sending data failed") != 1)
+        ok = false;
+    PGresult* result;
+    while((result = PQgetResult(conn)) != NULL){
+        if(PQresultStatus(result) != PGRES_COMMAND_OK)
+            ok = false;
+        PQclear(result);
+    }
+    if(ok){
+        std::string insert = std::string("INSERT INTO public.") + table.table + " (" + table.columns + ") SELECT " + table.columns + " FROM " + staging
+            + " ON CONFLICT (id) DO UPDATE SET " + table.update;
+        result = PQexec(conn, insert.c_str());
+        ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+        PQclear(result);
+    }
+    if(!ok){
+        LOG_ERROR("bulkwriter: copy failed", "table", table.table, "error", PQerrorMessage(conn));
+        PQclear(PQexec(conn, "ROLLBACK"));
+        return false;
+    }
+    result = PQexec(conn, "COMMIT");
+    ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+    registry.getCounter("co2carpool_database_rows_total", "Rows written to the database", {{"table", table.table}}).add(rows.rows);
+    return ok;
+}
+@}
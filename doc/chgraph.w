@@ -0,0 +1,808 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{chgraph class}
+
+A contraction hierarchy answers shortest path queries on a road network of a whole country in well under a millisecond, which is also what graphhopper does with \verb|profiles_ch|. The nodes are contracted one after the other in the order of their importance: a contracted node is removed from the graph and for every pair of its neighbours whose shortest path went through it a shortcut is added. A query then searches from the start only upwards to more important nodes and from the destination only upwards as well; both searches meet at the most important node of the path, which makes them tiny.
+
+The importance is the edge difference (shortcuts needed minus edges removed) plus the number of neighbours already contracted, so contraction is spread over the graph. It is updated lazily: the node with the smallest importance is taken, its importance computed again and if it is not the smallest any more it is put back. Whether a shortcut is needed is found by a witness search from the neighbour before, a Dijkstra search which avoids the node and is stopped after \verb|witness_settled| nodes; if it stops early a shortcut may be added that is not needed, which costs only some memory.
+
+The weight of the edges is the travel time in ms, the distance in m is carried along. A shortcut remembers the node it bypasses, so a path is unpacked by replacing every shortcut by its two halves until only roads are left.
+
+The graph is written into one file and mapped into memory, so starting the program costs nothing and several processes share the pages. The edges of each node are stored at the node with the lower rank: the edges to more important nodes in the forward list and the edges from more important nodes in the backward list, both as compressed sparse rows. For finding the node next to a coordinate the nodes are sorted into cells of 0.01 degrees.
+
+A road may stand for a chain of OSM nodes (see the chrouter class), whose points in between are only needed to draw the path. They are stored apart from the graph as the shape of the road, under its two nodes with the lower one first, and \verb|geometry| gives them in the direction asked for. The points of a shape are put into the cells as well and snap to the end of their road which is nearer along the road, so a position in the middle of a long road is not snapped to a node far away.
+
+@O ../src/chgraph.h -d
+@{
+#ifndef CHGRAPH_CLASS
+#define CHGRAPH_CLASS
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class scheduler;
+
+class chgraph {
+public:
+    static constexpr uint32_t none = 0xffffffff;
+    struct edge {
+        // Target of a forward edge, source of a backward edge
+        uint32_t other;
+        // Travel time in ms
+        uint32_t time;
+        float distance;
+        // Bypassed node of a shortcut or none for a road
+        uint32_t middle;
+    };
+    // Road from an OSM way between two nodes of the graph
+    struct road {
+        uint32_t from;
+        uint32_t to;
+        uint32_t time;
+        float distance;
+    };
+    // Points of a road between its two nodes in 1e-6 degrees, at most one shape for each pair of nodes
+    struct shape {
+        uint32_t from;
+        uint32_t to;
+        std::vector<int32_t> lat;
+        std::vector<int32_t> lon;
+    };
+    // Contracts the graph of roads and writes the graph file
+    static bool write(const std::string& file, const std::vector<int32_t>& lat, const std::vector<int32_t>& lon, const std::vector<road>& roads, const std::vector<shape>& shapes, unsigned int witnessSettled);
+    chgraph(const std::string& file);
+    ~chgraph(void);
+    chgraph(const chgraph&) = delete;
+    chgraph& operator=(const chgraph&) = delete;
+    bool good(void) const;
+    uint32_t nodes(void) const;
+    double lat(uint32_t node) const;
+    double lon(uint32_t node) const;
+    // Nearest node within maxDistance m, none if there is none
+    uint32_t nearest(double lat, double lon, double maxDistance) const;
+    // Roads of the fastest path, false if there is none
+    bool path(uint32_t from, uint32_t to, std::vector<road>& roads) const;
+    // Points (lat, lon) of the road between its two nodes, in this direction
+    void geometry(uint32_t from, uint32_t to, std::vector<std::pair<double, double> >& points) const;
+    // Travel time in ms and distance in m of the fastest path, false if there is none
+    bool fastest(uint32_t from, uint32_t to, uint32_t& time, double& distance) const;
+    // Travel times in ms and distances in m from every source to every target, row by row; none where there is no path. Split into parts run by the caller and the workers
+    void table(const std::vector<uint32_t>& sources, const std::vector<uint32_t>& targets, std::vector<uint32_t>& times, std::vector<float>& distances, scheduler* workers, unsigned int parts, std::size_t block) const;
+private:
+    struct settled {
+        uint32_t node;
+        uint32_t time;
+        float distance;
+    };
+    // Nodes settled and not stalled by a complete upward search
+    void upward(uint32_t from, bool forwards, std::vector<settled>& space) const;
+    struct header {
+        char magic[8];
+        uint64_t nodes;
+        uint64_t forwardEdges;
+        uint64_t backwardEdges;
+        uint64_t cells;
+        uint64_t shapes;
+        uint64_t shapePoints;
+    };
+    struct cell {
+        int32_t row;
+        int32_t column;
+        uint32_t first;
+    };
+    struct shapeKey {
+        uint32_t from;
+        uint32_t to;
+        uint32_t first;
+    };
+    static const double cellDegrees;
+    static cell key(double lat, double lon);
+    // Bidirectional upward search, the meeting node or none
+    uint32_t meet(uint32_t from, uint32_t to, uint32_t& time, double& distance) const;
+    const edge* arc(uint32_t from, uint32_t to) const;
+    void unpack(uint32_t from, uint32_t to, const edge& shortcut, std::vector<road>& roads) const;
+    void* mapping;
+    std::size_t mappedBytes;
+    const header* info;
+    const int32_t* latitudes;
+    const int32_t* longitudes;
+    const uint32_t* ranks;
+    const uint32_t* forwardFirst;
+    const edge* forward;
+    const uint32_t* backwardFirst;
+    const edge* backward;
+    const cell* cells;
+    // Nodes and, from the number of nodes on, points of shapes
+    const uint32_t* cellNodes;
+    // Sorted by from and to, with one more as end
+    const shapeKey* shapeKeys;
+    const int32_t* shapeLatitudes;
+    const int32_t* shapeLongitudes;
+    // Node a point of a shape snaps to
+    const uint32_t* shapeNodes;
+};
+
+#endif
+@}
+
+@O ../src/chgraph.cpp -d
+@{
+#include "chgraph.h"
+#include "geo.h"
+#include "logger.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const double chgraph::cellDegrees = 0.01;
+static const char graphMagic[8] = {'C', 'O', '2', 'C', 'H', 0, 0, 2};
+
+chgraph::cell chgraph::key(double lat, double lon){
+    return {static_cast<int32_t>(std::floor(lat / cellDegrees)), static_cast<int32_t>(std::floor(lon / cellDegrees)), 0};
+}
+@}
+
+\subsubsection{Contraction}
+
+While contracting every node has its lists of outgoing and incoming edges to the nodes not yet contracted. The witness search uses arrays for all nodes which are reset only where they were touched.
+
+@O ../src/chgraph.cpp -d
+@{
+namespace {
+class contraction {
+public:
+    contraction(std::size_t nodes, unsigned int l_witnessSettled) :
+        out(nodes), in(nodes), rank(nodes, chgraph::none), contracted(nodes, 0), time(nodes, std::numeric_limits<uint32_t>::max()),
+        upForward(nodes), upBackward(nodes), witnessSettled(l_witnessSettled), shortcuts(0){}
+    void add(std::vector<chgraph::edge>& list, const chgraph::edge& next){
+        for(auto& known: list)
+            if(known.other == next.other){
+                if(next.time < known.time)
+                    known = next;
+                return;
+            }
+        list.push_back(next);
+    }
+    void addEdge(uint32_t from, uint32_t to, uint32_t l_time, float distance, uint32_t middle){
+        if(from == to)
+            return;
+        add(out[from], {to, l_time, distance, middle});
+        add(in[to], {from, l_time, distance, middle});
+    }
+    // Shortcuts needed to contract node, added only if apply
+    int shortcutsFor(uint32_t node, bool apply){
+        int count = 0;
+        for(const auto& incoming: in[node]){
+            uint32_t maxTime = 0;
+            for(const auto& outgoing: out[node])
+                if(outgoing.other != incoming.other)
+                    maxTime = std::max(maxTime, incoming.time + outgoing.time);
+            if(maxTime == 0)
+                continue;
+            witness(incoming.other, node, maxTime);
+            for(const auto& outgoing: out[node]){
+                if(outgoing.other == incoming.other)
+                    continue;
+                uint32_t via = incoming.time + outgoing.time;
+                if(time[outgoing.other] <= via)
+                    continue;
+                count++;
+                if(apply)
+                    pending.push_back({incoming.other, outgoing.other, via, incoming.distance + outgoing.distance, node});
+            }
+            reset();
+        }
+        return count;
+    }
+    int priority(uint32_t node){
+        int added = shortcutsFor(node, false);
+        return 2 * added - static_cast<int>(in[node].size() + out[node].size()) + contracted[node];
+    }
+    void contract(uint32_t node, uint32_t order){
+        pending.clear();
+        shortcutsFor(node, true);
+        for(const auto& shortcut: pending)
+            addEdge(std::get<0>(shortcut), std::get<1>(shortcut), std::get<2>(shortcut), std::get<3>(shortcut), std::get<4>(shortcut));
+        shortcuts += pending.size();
+        rank[node] = order;
+        upForward[node] = std::move(out[node]);
+        upBackward[node] = std::move(in[node]);
+        for(const auto& outgoing: upForward[node]){
+            auto& list = in[outgoing.other];
+            list.erase(std::remove_if(list.begin(), list.end(), [node](const chgraph::edge& e){ return e.other == node; }), list.end());
+            contracted[outgoing.other]++;
+        }
+        for(const auto& incoming: upBackward[node]){
+            auto& list = out[incoming.other];
+            list.erase(std::remove_if(list.begin(), list.end(), [node](const chgraph::edge& e){ return e.other == node; }), list.end());
+            contracted[incoming.other]++;
+        }
+        out[node].clear();
+        in[node].clear();
+    }
+    std::vector<std::vector<chgraph::edge> > out;
+    std::vector<std::vector<chgraph::edge> > in;
+    std::vector<uint32_t> rank;
+    std::vector<int> contracted;
+    std::vector<uint32_t> time;
+    std::vector<std::vector<chgraph::edge> > upForward;
+    std::vector<std::vector<chgraph::edge> > upBackward;
+private:
+    // Dijkstra from source without the contracted node up to maxTime
+    void witness(uint32_t source, uint32_t avoided, uint32_t maxTime){
+        typedef std::pair<uint32_t, uint32_t> entry;
+        std::priority_queue<entry, std::vector<entry>, std::greater<entry> > heap;
+        time[source] = 0;
+        touched.push_back(source);
+        heap.push({0, source});
+        unsigned int settled = 0;
+        while(!heap.empty() && settled < witnessSettled){
+            auto [current, node] = heap.top();
+            heap.pop();
+            if(current > time[node])
+                continue;
+            if(current > maxTime)
+                break;
+            settled++;
+            for(const auto& outgoing: out[node]){
+                if(outgoing.other == avoided)
+                    continue;
+                uint32_t next = current + outgoing.time;
+                if(next < time[outgoing.other]){
+                    if(time[outgoing.other] == std::numeric_limits<uint32_t>::max())
+                        touched.push_back(outgoing.other);
+                    time[outgoing.other] = next;
+                    heap.push({next, outgoing.other});
+                }
+            }
+        }
+    }
+    void reset(void){
+        for(uint32_t node: touched)
+            time[node] = std::numeric_limits<uint32_t>::max();
+        touched.clear();
+    }
+    unsigned int witnessSettled;
+    std::vector<uint32_t> touched;
+    std::vector<std::tuple<uint32_t, uint32_t, uint32_t, float, uint32_t> > pending;
+public:
+    unsigned long long int shortcuts;
+};
+}
+@}
+
+The upward edges are written as they are after the contraction, each node keeps those of the time it was contracted, which all lead to nodes contracted later.
+
+@O ../src/chgraph.cpp -d
+@{
+bool chgraph::write(const std::string& file, const std::vector<int32_t>& lat, const std::vector<int32_t>& lon, const std::vector<road>& roads, const std::vector<shape>& shapes, unsigned int witnessSettled){
+    std::size_t nodes = lat.size();
+    contraction graph(nodes, witnessSettled);
+    for(const auto& next: roads)
+        graph.addEdge(next.from, next.to, next.time, next.distance, none);
+    typedef std::pair<int, uint32_t> entry;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > order;
+    for(uint32_t node=0; node<nodes; node++)
+        order.push({graph.priority(node), node});
+    uint32_t contracted = 0;
+    while(!order.empty()){
+        uint32_t node = order.top().second;
+        order.pop();
+        if(graph.rank[node] != none)
+            continue;
+        int priority = graph.priority(node);
+        if(!order.empty() && priority > order.top().first){
+            order.push({priority, node});
+            continue;
+        }
+        graph.contract(node, contracted++);
+        if(contracted % 1000000 == 0)
+            LOG_INFO("chgraph: contracting", "nodes", contracted, "of", nodes, "shortcuts", graph.shortcuts);
+    }
+    LOG_INFO("chgraph: contracted", "nodes", nodes, "roads", roads.size(), "shortcuts", graph.shortcuts);
+    std::vector<shapeKey> keyList;
+    std::vector<int32_t> shapeLat, shapeLon;
+    std::vector<uint32_t> shapeNodeList;
+    std::vector<std::size_t> byNodes(shapes.size());
+    for(std::size_t i=0; i<shapes.size(); i++)
+        byNodes[i] = i;
+    std::sort(byNodes.begin(), byNodes.end(), [&shapes](std::size_t a, std::size_t b){ return std::minmax(shapes[a].from, shapes[a].to) < std::minmax(shapes[b].from, shapes[b].to); });
+    for(std::size_t i: byNodes){
+        const shape& next = shapes[i];
+        bool reversed = next.from > next.to;
+        std::size_t count = next.lat.size();
+        keyList.push_back({std::min(next.from, next.to), std::max(next.from, next.to), static_cast<uint32_t>(shapeLat.size())});
+        // Distance along the road from its lower node to each point
+        std::vector<double> along(count + 2, 0);
+        route::coordinate last = {lat[keyList.back().from] / 1e6, lon[keyList.back().from] / 1e6};
+        for(std::size_t k=0; k<=count; k++){
+            std::size_t point = reversed ? count - 1 - k : k;
+            route::coordinate current = k < count ? route::coordinate{next.lat[point] / 1e6, next.lon[point] / 1e6} : route::coordinate{lat[keyList.back().to] / 1e6, lon[keyList.back().to] / 1e6};
+            along[k + 1] = along[k] + geo::haversine(last, current);
+            last = current;
+        }
+        for(std::size_t k=0; k<count; k++){
+            std::size_t point = reversed ? count - 1 - k : k;
+            shapeLat.push_back(next.lat[point]);
+            shapeLon.push_back(next.lon[point]);
+            shapeNodeList.push_back(along[k + 1] <= along[count + 1] - along[k + 1] ? keyList.back().from : keyList.back().to);
+        }
+    }
+    keyList.push_back({none, none, static_cast<uint32_t>(shapeLat.size())});
+    std::vector<std::pair<cell, uint32_t> > sorted;
+    for(uint32_t node=0; node<nodes; node++)
+        sorted.push_back({key(lat[node] / 1e6, lon[node] / 1e6), node});
+    for(uint32_t point=0; point<shapeLat.size(); point++)
+        sorted.push_back({key(shapeLat[point] / 1e6, shapeLon[point] / 1e6), static_cast<uint32_t>(nodes + point)});
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b){ return std::tie(a.first.row, a.first.column, a.second) < std::tie(b.first.row, b.first.column, b.second); });
+    std::vector<cell> cellList;
+    std::vector<uint32_t> cellNodeList;
+    for(const auto& entry: sorted){
+        if(cellList.empty() || cellList.back().row != entry.first.row || cellList.back().column != entry.first.column)
+            cellList.push_back({entry.first.row, entry.first.column, static_cast<uint32_t>(cellNodeList.size())});
+        cellNodeList.push_back(entry.second);
+    }
+    cellList.push_back({std::numeric_limits<int32_t>::max(), std::numeric_limits<int32_t>::max(), static_cast<uint32_t>(cellNodeList.size())});
+    std::ofstream output(file, std::ios::binary);
+    auto put = [&output](const void* data, std::size_t bytes){ output.write(static_cast<const char*>(data), bytes); };
+    auto putLists = [&put](const std::vector<std::vector<edge> >& lists){
+        std::vector<uint32_t> first = {0};
+        for(const auto& list: lists)
+            first.push_back(first.back() + list.size());
+        put(first.data(), first.size() * sizeof(uint32_t));
+        for(const auto& list: lists)
+            put(list.data(), list.size() * sizeof(edge));
+        return first.back();
+    };
+    header top;
+    std::memcpy(top.magic, graphMagic, sizeof(top.magic));
+    top.nodes = nodes;
+    top.forwardEdges = 0;
+    top.backwardEdges = 0;
+    for(std::size_t node=0; node<nodes; node++){
+        top.forwardEdges += graph.upForward[node].size();
+        top.backwardEdges += graph.upBackward[node].size();
+    }
+    top.cells = cellList.size();
+    top.shapes = keyList.size() - 1;
+    top.shapePoints = shapeLat.size();
+    put(&top, sizeof(top));
+    put(lat.data(), nodes * sizeof(int32_t));
+    put(lon.data(), nodes * sizeof(int32_t));
+    put(graph.rank.data(), nodes * sizeof(uint32_t));
+    putLists(graph.upForward);
+    putLists(graph.upBackward);
+    put(cellList.data(), cellList.size() * sizeof(cell));
+    put(cellNodeList.data(), cellNodeList.size() * sizeof(uint32_t));
+    put(keyList.data(), keyList.size() * sizeof(shapeKey));
+    put(shapeLat.data(), shapeLat.size() * sizeof(int32_t));
+    put(shapeLon.data(), shapeLon.size() * sizeof(int32_t));
+    put(shapeNodeList.data(), shapeNodeList.size() * sizeof(uint32_t));
+    if(!output){
+        LOG_ERROR("chgraph: could not write graph", "file", file);
+        return false;
+    }
+    LOG_INFO("chgraph: wrote graph", "file", file, "nodes", nodes, "forward_edges", top.forwardEdges, "backward_edges", top.backwardEdges, "shapes", top.shapes, "shape_points", top.shapePoints);
+    return true;
+}
+@}
+
+\subsubsection{Queries}
+
+The graph file is mapped read only and the arrays point into the mapping. The sizes are checked against the header, so a truncated file is not used.
+
+@O ../src/chgraph.cpp -d
+@{
+chgraph::chgraph(const std::string& file):
+    mapping(nullptr), mappedBytes(0), info(nullptr)
+{
+    int descriptor = open(file.c_str(), O_RDONLY);
+    if(descriptor < 0){
+        LOG_ERROR("chgraph: could not open graph", "file", file);
+        return;
+    }
+    struct stat status;
+    if(fstat(descriptor, &status) == 0 && status.st_size >= static_cast<off_t>(sizeof(header))){
+        mappedBytes = status.st_size;
+        mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, descriptor, 0);
+        if(mapping == MAP_FAILED)
+            mapping = nullptr;
+    }
+    close(descriptor);
+    if(!mapping){
+        LOG_ERROR("chgraph: could not map graph", "file", file);
+        return;
+    }
+    const char* position = static_cast<const char*>(mapping);
+    const header* top = reinterpret_cast<const header*>(position);
+    if(std::memcmp(top->magic, graphMagic, sizeof(graphMagic)) != 0){
+        LOG_ERROR("chgraph: not a graph file of this version", "file", file);
+        return;
+    }
+    std::size_t nodes = top->nodes;
+    std::size_t points = top->shapePoints;
+    std::size_t expected = sizeof(header) + nodes * 3 * sizeof(uint32_t) + 2 * (nodes + 1) * sizeof(uint32_t)
+        + (top->forwardEdges + top->backwardEdges) * sizeof(edge) + top->cells * sizeof(cell) + (nodes + points) * sizeof(uint32_t)
+        + (top->shapes + 1) * sizeof(shapeKey) + points * 3 * sizeof(uint32_t);
+    if(expected != mappedBytes){
+        LOG_ERROR("chgraph: graph file has the wrong size", "file", file, "bytes", mappedBytes, "expected", expected);
+        return;
+    }
+    position += sizeof(header);
+    auto take = [&position](std::size_t bytes){ const char* start = position; position += bytes; return start; };
+    latitudes = reinterpret_cast<const int32_t*>(take(nodes * sizeof(int32_t)));
+    longitudes = reinterpret_cast<const int32_t*>(take(nodes * sizeof(int32_t)));
+    ranks = reinterpret_cast<const uint32_t*>(take(nodes * sizeof(uint32_t)));
+    forwardFirst = reinterpret_cast<const uint32_t*>(take((nodes + 1) * sizeof(uint32_t)));
+    forward = reinterpret_cast<const edge*>(take(top->forwardEdges * sizeof(edge)));
+    backwardFirst = reinterpret_cast<const uint32_t*>(take((nodes + 1) * sizeof(uint32_t)));
+    backward = reinterpret_cast<const edge*>(take(top->backwardEdges * sizeof(edge)));
+    cells = reinterpret_cast<const cell*>(take(top->cells * sizeof(cell)));
+    cellNodes = reinterpret_cast<const uint32_t*>(take((nodes + points) * sizeof(uint32_t)));
+    shapeKeys = reinterpret_cast<const shapeKey*>(take((top->shapes + 1) * sizeof(shapeKey)));
+    shapeLatitudes = reinterpret_cast<const int32_t*>(take(points * sizeof(int32_t)));
+    shapeLongitudes = reinterpret_cast<const int32_t*>(take(points * sizeof(int32_t)));
+    shapeNodes = reinterpret_cast<const uint32_t*>(take(points * sizeof(uint32_t)));
+    info = top;
+    LOG_INFO("chgraph: mapped graph", "file", file, "nodes", nodes, "bytes", mappedBytes);
+}
+
+chgraph::~chgraph(void){
+    if(mapping)
+        munmap(mapping, mappedBytes);
+}
+
+bool chgraph::good(void) const{
+    return info != nullptr;
+}
+
+uint32_t chgraph::nodes(void) const{
+    return info ? info->nodes : 0;
+}
+
+double chgraph::lat(uint32_t node) const{
+    return latitudes[node] / 1e6;
+}
+
+double chgraph::lon(uint32_t node) const{
+    return longitudes[node] / 1e6;
+}
+
+void chgraph::geometry(uint32_t from, uint32_t to, std::vector<std::pair<double, double> >& points) const{
+    points.clear();
+    shapeKey wanted = {std::min(from, to), std::max(from, to), 0};
+    const shapeKey* found = std::lower_bound(shapeKeys, shapeKeys + info->shapes, wanted, [](const shapeKey& a, const shapeKey& b){ return std::tie(a.from, a.to) < std::tie(b.from, b.to); });
+    if(found == shapeKeys + info->shapes || found->from != wanted.from || found->to != wanted.to)
+        return;
+    for(uint32_t i=found->first; i<(found+1)->first; i++)
+        points.push_back({shapeLatitudes[i] / 1e6, shapeLongitudes[i] / 1e6});
+    if(from > to)
+        std::reverse(points.begin(), points.end());
+}
+@}
+
+The nearest node or point of a shape is searched in rings of cells around the cell of the position. Once one is found, the search stops when the next ring can not hold a nearer one.
+
+@O ../src/chgraph.cpp -d
+@{
+uint32_t chgraph::nearest(double l_lat, double l_lon, double maxDistance) const{
+    cell center = key(l_lat, l_lon);
+    const double cellMetres = cellDegrees * geo::radians(1.0) * geo::earthRadius * 1000.0 * std::max(0.1, std::cos(geo::radians(std::min(89.0, std::fabs(l_lat) + 1))));
+    int rings = static_cast<int>(maxDistance / cellMetres) + 1;
+    uint32_t best = none;
+    double bestDistance = maxDistance;
+    route::coordinate position = {l_lat, l_lon};
+    for(int ring=0; ring<=rings; ring++){
+        if(best != none && (ring - 1) * cellMetres > bestDistance)
+            break;
+        for(int row=center.row-ring; row<=center.row+ring; row++){
+            for(int column=center.column-ring; column<=center.column+ring; column++){
+                if(std::abs(row - center.row) != ring && std::abs(column - center.column) != ring)
+                    continue;
+                const cell* found = std::lower_bound(cells, cells + info->cells - 1, cell{row, column, 0}, [](const cell& a, const cell& b){ return std::tie(a.row, a.column) < std::tie(b.row, b.column); });
+                if(found == cells + info->cells - 1 || found->row != row || found->column != column)
+                    continue;
+                for(uint32_t i=found->first; i<(found+1)->first; i++){
+                    uint32_t entry = cellNodes[i];
+                    bool node = entry < info->nodes;
+                    route::coordinate point = node ? route::coordinate{lat(entry), lon(entry)} : route::coordinate{shapeLatitudes[entry - info->nodes] / 1e6, shapeLongitudes[entry - info->nodes] / 1e6};
+                    double distance = geo::haversine(position, point) * 1000.0;
+                    if(distance <= bestDistance){
+                        bestDistance = distance;
+                        best = node ? entry : shapeNodes[entry - info->nodes];
+                    }
+                }
+            }
+        }
+    }
+    return best;
+}
+@}
+
+The two searches run in turns, each is stopped when its smallest time is not below the best path found yet. The labels are kept per thread in arrays for all nodes, reset only where they were used, so a query allocates nothing.
+
+@O ../src/chgraph.cpp -d
+@{
+namespace {
+struct search {
+    struct label {
+        uint32_t time;
+        float distance;
+        uint32_t parent;
+        const chgraph::edge* via;
+    };
+    typedef std::pair<uint32_t, uint32_t> entry;
+    void prepare(std::size_t nodes){
+        if(labels.size() != nodes){
+            labels.assign(nodes, {std::numeric_limits<uint32_t>::max(), 0, chgraph::none, nullptr});
+            touched.clear();
+        }
+        for(uint32_t node: touched)
+            labels[node].time = std::numeric_limits<uint32_t>::max();
+        touched.clear();
+        heap = decltype(heap)();
+    }
+    void reach(uint32_t node, uint32_t time, float distance, uint32_t parent, const chgraph::edge* via){
+        if(labels[node].time == std::numeric_limits<uint32_t>::max())
+            touched.push_back(node);
+        labels[node] = {time, distance, parent, via};
+        heap.push({time, node});
+    }
+    std::vector<label> labels;
+    std::vector<uint32_t> touched;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > heap;
+};
+thread_local search forwardSearch;
+thread_local search backwardSearch;
+}
+
+uint32_t chgraph::meet(uint32_t from, uint32_t to, uint32_t& time, double& distance) const{
+    forwardSearch.prepare(info->nodes);
+    backwardSearch.prepare(info->nodes);
+    forwardSearch.reach(from, 0, 0, none, nullptr);
+    backwardSearch.reach(to, 0, 0, none, nullptr);
+    uint64_t best = std::numeric_limits<uint64_t>::max();
+    uint32_t meeting = none;
+    bool turn = true;
+    while(true){
+        bool forwardDone = forwardSearch.heap.empty() || forwardSearch.heap.top().first >= best;
+        bool backwardDone = backwardSearch.heap.empty() || backwardSearch.heap.top().first >= best;
+        if(forwardDone && backwardDone)
+            break;
+        turn = forwardDone ? false : backwardDone ? true : !turn;
+        search& current = turn ? forwardSearch : backwardSearch;
+        const search& opposite = turn ? backwardSearch : forwardSearch;
+        const uint32_t* first = turn ? forwardFirst : backwardFirst;
+        const edge* edges = turn ? forward : backward;
+        auto [reached, node] = current.heap.top();
+        current.heap.pop();
+        if(reached > current.labels[node].time)
+            continue;
+        if(opposite.labels[node].time != std::numeric_limits<uint32_t>::max() && static_cast<uint64_t>(reached) + opposite.labels[node].time < best){
+            best = static_cast<uint64_t>(reached) + opposite.labels[node].time;
+            meeting = node;
+        }
+        for(uint32_t i=first[node]; i<first[node+1]; i++){
+            uint32_t next = reached + edges[i].time;
+            if(next < current.labels[edges[i].other].time)
+                current.reach(edges[i].other, next, current.labels[node].distance + edges[i].distance, node, &edges[i]);
+        }
+    }
+    if(meeting == none)
+        return none;
+    time = static_cast<uint32_t>(best);
+    distance = forwardSearch.labels[meeting].distance + backwardSearch.labels[meeting].distance;
+    return meeting;
+}
+
+bool chgraph::fastest(uint32_t from, uint32_t to, uint32_t& time, double& distance) const{
+    if(!info || from >= info->nodes || to >= info->nodes)
+        return false;
+    return meet(from, to, time, distance) != none;
+}
+@}
+
+For the path the edges of both searches are followed back from the meeting node and unpacked. The halves of a shortcut are both stored at the bypassed node, which has the lowest rank of the three: the first half in its backward list and the second in its forward list.
+
+@O ../src/chgraph.cpp -d
+@{
+const chgraph::edge* chgraph::arc(uint32_t from, uint32_t to) const{
+    const edge* best = nullptr;
+    if(ranks[from] < ranks[to]){
+        for(uint32_t i=forwardFirst[from]; i<forwardFirst[from+1]; i++)
+            if(forward[i].other == to && (!best || forward[i].time < best->time))
+                best = &forward[i];
+    }
+    else{
+        for(uint32_t i=backwardFirst[to]; i<backwardFirst[to+1]; i++)
+            if(backward[i].other == from && (!best || backward[i].time < best->time))
+                best = &backward[i];
+    }
+    return best;
+}
+
+void chgraph::unpack(uint32_t from, uint32_t to, const edge& shortcut, std::vector<road>& roads) const{
+    std::vector<std::tuple<uint32_t, uint32_t, const edge*> > stack = {{from, to, &shortcut}};
+    while(!stack.empty()){
+        auto [a, b, current] = stack.back();
+        stack.pop_back();
+        if(current->middle == none){
+            roads.push_back({a, b, current->time, current->distance});
+            continue;
+        }
+        uint32_t middle = current->middle;
+        const edge* first = arc(a, middle);
+        const edge* second = arc(middle, b);
+        if(!first || !second){
+            LOG_ERROR("chgraph: broken shortcut", "from", a, "to", b, "middle", middle);
+            continue;
+        }
+        stack.push_back({middle, b, second});
+        stack.push_back({a, middle, first});
+    }
+}
+
+bool chgraph::path(uint32_t from, uint32_t to, std::vector<road>& roads) const{
+    roads.clear();
+    if(!info || from >= info->nodes || to >= info->nodes)
+        return false;
+    uint32_t time = 0;
+    double distance = 0;
+    uint32_t meeting = meet(from, to, time, distance);
+    if(meeting == none)
+        return false;
+    std::vector<std::tuple<uint32_t, uint32_t, const edge*> > upward;
+    for(uint32_t node=meeting; forwardSearch.labels[node].parent != none; node=forwardSearch.labels[node].parent)
+        upward.push_back({forwardSearch.labels[node].parent, node, forwardSearch.labels[node].via});
+    for(auto step=upward.rbegin(); step!=upward.rend(); ++step)
+        unpack(std::get<0>(*step), std::get<1>(*step), *std::get<2>(*step), roads);
+    for(uint32_t node=meeting; backwardSearch.labels[node].parent != none; node=backwardSearch.labels[node].parent)
+        unpack(node, backwardSearch.labels[node].parent, *backwardSearch.labels[node].via, roads);
+    return true;
+}
+@}
+
+\subsubsection{Many to many}
+
+A table of many sources and targets would repeat most of the work with one query per pair, as the searches from one source to all targets all look at the same nodes above the source. The bucket method\footnote{Knopp et al., Computing Many-to-Many Shortest Paths Using Highway Hierarchies, 2007} runs one complete upward search per target and per source instead. The backward search of every target leaves an entry with its time in a bucket at each node it settles. The forward search of a source then looks into the bucket of each node it settles, every entry there is a path to that target through this node and the shortest one of them is the fastest path, as for a single query. A table of 200 by 200 needs 400 searches instead of 40000 queries.
+
+The complete searches are kept small by stall on demand: a node reached more quickly from a more important node through an edge leading down to it is not on a fastest upward path, so it is neither expanded nor put into the buckets.
+
+The buckets are sorted by node and shared by all threads for reading. The sources are handed out in blocks of \verb|block| rows, so each thread fills its own rows of the matrix and needs no lock.
+
+The work is split into \verb|parts| which are shared with the workers of a scheduler (see \verb|scheduler::share|); the workers keep their labels from one table to the next. The targets and blocks are taken from shared counters, so the caller does all the work itself if the workers are busy.
+
+@O ../src/chgraph.cpp -d
+@{
+void chgraph::upward(uint32_t from, bool forwards, std::vector<settled>& space) const{
+    search& current = forwards ? forwardSearch : backwardSearch;
+    const uint32_t* first = forwards ? forwardFirst : backwardFirst;
+    const edge* edges = forwards ? forward : backward;
+    const uint32_t* downFirst = forwards ? backwardFirst : forwardFirst;
+    const edge* down = forwards ? backward : forward;
+    space.clear();
+    current.prepare(info->nodes);
+    current.reach(from, 0, 0, none, nullptr);
+    while(!current.heap.empty()){
+        auto [reached, node] = current.heap.top();
+        current.heap.pop();
+        if(reached > current.labels[node].time)
+            continue;
+        bool stalled = false;
+        for(uint32_t i=downFirst[node]; i<downFirst[node+1] && !stalled; i++){
+            uint32_t above = current.labels[down[i].other].time;
+            stalled = above != std::numeric_limits<uint32_t>::max() && above + down[i].time < reached;
+        }
+        if(stalled)
+            continue;
+        space.push_back({node, reached, current.labels[node].distance});
+        for(uint32_t i=first[node]; i<first[node+1]; i++){
+            uint32_t next = reached + edges[i].time;
+            if(next < current.labels[edges[i].other].time)
+                current.reach(edges[i].other, next, current.labels[node].distance + edges[i].distance, node, &edges[i]);
+        }
+    }
+}
+
+void chgraph::table(const std::vector<uint32_t>& sources, const std::vector<uint32_t>& targets, std::vector<uint32_t>& times, std::vector<float>& distances, scheduler* workers, unsigned int parts, std::size_t block) const{
+    const std::size_t columns = targets.size();
+    times.assign(sources.size() * columns, none);
+    distances.assign(sources.size() * columns, std::numeric_limits<float>::infinity());
+    if(!info || columns == 0)
+        return;
+    parts = workers ? std::max(1u, parts) : 1;
+    block = std::max<std::size_t>(1, block);
+    auto parallel = [workers, parts](const std::function<void(unsigned int)>& work){
+        if(workers)
+            workers->share(parts, work);
+        else
+            work(0);
+    };
+    struct entry {
+        uint32_t node;
+        uint32_t target;
+        uint32_t time;
+        float distance;
+    };
+    std::vector<std::vector<entry> > found(parts);
+    std::atomic<std::size_t> nextTarget(0);
+    parallel([&](unsigned int t){
+        std::vector<settled> space;
+        for(std::size_t j = nextTarget++; j < columns; j = nextTarget++){
+            if(targets[j] >= info->nodes)
+                continue;
+            upward(targets[j], false, space);
+            for(const auto& reached: space)
+                found[t].push_back({reached.node, static_cast<uint32_t>(j), reached.time, reached.distance});
+        }
+    });
+    std::vector<entry> buckets;
+    for(const auto& part: found)
+        buckets.insert(buckets.end(), part.begin(), part.end());
+    found.clear();
+    std::sort(buckets.begin(), buckets.end(), [](const entry& a, const entry& b){ return a.node < b.node; });
+    std::vector<uint32_t> bucketNodes, bucketFirst;
+    for(uint32_t i=0; i<buckets.size(); i++)
+        if(bucketNodes.empty() || bucketNodes.back() != buckets[i].node){
+            bucketNodes.push_back(buckets[i].node);
+            bucketFirst.push_back(i);
+        }
+    bucketFirst.push_back(buckets.size());
+    std::atomic<std::size_t> nextBlock(0);
+    parallel([&](unsigned int){
+        std::vector<settled> space;
+        for(std::size_t start = block * nextBlock++; start < sources.size(); start = block * nextBlock++){
+            for(std::size_t i=start; i<std::min(start + block, sources.size()); i++){
+                if(sources[i] >= info->nodes)
+                    continue;
+                upward(sources[i], true, space);
+                uint32_t* rowTimes = &times[i * columns];
+                float* rowDistances = &distances[i * columns];
+                for(const auto& reached: space){
+                    auto bucket = std::lower_bound(bucketNodes.begin(), bucketNodes.end(), reached.node);
+                    if(bucket == bucketNodes.end() || *bucket != reached.node)
+                        continue;
+                    std::size_t index = bucket - bucketNodes.begin();
+                    for(uint32_t k=bucketFirst[index]; k<bucketFirst[index+1]; k++){
+                        const entry& via = buckets[k];
+                        uint64_t total = static_cast<uint64_t>(reached.time) + via.time;
+                        if(total < rowTimes[via.target]){
+                            rowTimes[via.target] = static_cast<uint32_t>(total);
+                            rowDistances[via.target] = reached.distance + via.distance;
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+@}
@@ -0,0 +1,380 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{chrouter class}
+
+The embedded car router answers the car requests of graphhopper (see \verb|route::car_request|) from a contraction hierarchy (see the chgraph class) in the process itself, without a request over the network. It is used by rest for the urls configured in \verb|local| (see there), e.g. \verb|"local": {"car_router": {"graph": "car.ch", "pbf": "region.osm.pbf"}}|. If the graph file does not exist it is built from the OSM extract and written, which takes a while for a large region but only once.
+
+The reply has the fields of graphhopper read by \verb|route::readCarRoute|: the path as coordinates and the instructions, which matter for the $CO_2$ because each is an interval of the path driven at one speed. Consecutive roads with the same speed form one instruction. There are no street names, turn signs or texts; the last instruction is the arrival with sign 4 as in graphhopper. The positions are snapped to the nearest node within \verb|max_snap_m|, if there is none the reply is an error message as from graphhopper.
+
+The roads are the ways with a \verb|highway| tag of the classes in \verb|speeds| (in km/h). A \verb|maxspeed| given in km/h or mph is used instead, multiplied by \verb|max_speed_factor| as nobody drives the limit all the time. Ways closed for cars by \verb|access|, \verb|motor_vehicle| or \verb|motorcar| are skipped, as are areas. One way streets follow the \verb|oneway| tag, motorways, their links and roundabouts are one way by default. Turn restrictions (relations) are not read.
+
+@O ../src/chrouter.h -d
+@{
+#ifndef CHROUTER_CLASS
+#define CHROUTER_CLASS
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "chgraph.h"
+#include "scheduler.h"
+
+class chrouter {
+public:
+    chrouter(const nlohmann::json& config);
+    bool good(void) const;
+    // Reply in the format of graphhopper to a car request
+    nlohmann::json route(const nlohmann::json& request) const;
+    // Travel times in s, distances in m and CO2 in g of the car class from every source (lat, lon) to every target, row by row; infinity if there is no path
+    void table(const std::vector<std::pair<double, double> >& sources, const std::vector<std::pair<double, double> >& targets, const std::string& carClass, std::vector<double>& seconds, std::vector<double>& metres, std::vector<double>& co2) const;
+    // Reads the roads of the OSM extract and writes the graph
+    static bool prepare(const std::string& pbf, const std::string& graphFile, const nlohmann::json& config);
+private:
+    uint32_t snap(double lat, double lon) const;
+    std::unique_ptr<chgraph> graph;
+    unsigned int threads;
+    // Helpers of the tables, declared after the graph so they stop before it is unmapped
+    std::unique_ptr<scheduler> workers;
+    struct cfg {
+        cfg() : graph("car.ch"), pbf(""), max_snap_m(1000), witness_settled(500), max_speed_factor(0.9), threads(0), table_block(16),
+            speeds({{"motorway", 100}, {"motorway_link", 60}, {"trunk", 80}, {"trunk_link", 50}, {"primary", 65}, {"primary_link", 45},
+                {"secondary", 60}, {"secondary_link", 40}, {"tertiary", 50}, {"tertiary_link", 35}, {"unclassified", 40},
+                {"residential", 30}, {"living_street", 7}, {"service", 15}, {"road", 20}}){};
+        std::string graph;
+        std::string pbf;
+        double max_snap_m;
+        unsigned int witness_settled;
+        double max_speed_factor;
+        unsigned int threads;
+        unsigned int table_block;
+        std::map<std::string, double> speeds;
+    } config;
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, graph, pbf, max_snap_m, witness_settled, max_speed_factor, threads, table_block, speeds);
+};
+
+#endif
+@}
+
+@O ../src/chrouter.cpp -d
+@{
+#include "chrouter.h"
+#include "geo.h"
+#include "logger.h"
+#include "metrics.h"
+#include "osmpbf.h"
+
+#include "route.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+
+chrouter::chrouter(const nlohmann::json& l_config):
+    threads(1), config(l_config)
+{
+    if(access(config.graph.c_str(), R_OK) != 0){
+        if(config.pbf.empty()){
+            LOG_ERROR("chrouter: no graph and no OSM extract to build it", "graph", config.graph);
+            return;
+        }
+        LOG_INFO("chrouter: building graph", "pbf", config.pbf, "graph", config.graph);
+        if(!prepare(config.pbf, config.graph, l_config))
+            return;
+    }
+    graph = std::make_unique<chgraph>(config.graph);
+    if(!graph->good()){
+        graph.reset();
+        return;
+    }
+    threads = config.threads > 0 ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    if(threads > 1)
+        workers = std::make_unique<scheduler>(nlohmann::json{{"workers", threads - 1}});
+}
+
+bool chrouter::good(void) const{
+    return graph != nullptr;
+}
+@}
+
+The extract is read twice: first the ways, to know which nodes are part of roads, then only these nodes. Nodes of a way missing in the extract (cut at its border) split the way.
+
+Most nodes of the ways only give their shape: they are in the middle of one way and have no other road. Such a chain of nodes becomes one road between the nodes at its ends, with the nodes in between as its shape (see the chgraph class), so the graph has only the junctions, the ends of the ways and the nodes next to missing ones. This makes the graph several times smaller and its contraction faster. As there is only one shape for each pair of nodes, a chain which would join the same two nodes as another road, or a node with itself, is split at its middle node until no two roads with a shape share their nodes.
+
+@O ../src/chrouter.cpp -d
+@{
+bool chrouter::prepare(const std::string& pbf, const std::string& graphFile, const nlohmann::json& l_config){
+    cfg settings = l_config;
+    struct road {
+        std::size_t first;
+        std::size_t count;
+        double speed;
+        bool forward;
+        bool backward;
+    };
+    std::vector<road> roads;
+    std::vector<int64_t> refs;
+    osmpbf extract(pbf);
+    bool complete = extract.read(nullptr, [&](const osmpbf::way& found){
+        auto speed = settings.speeds.find(std::string(found.tag("highway")));
+        if(speed == settings.speeds.end() || found.refs.size() < 2 || found.tag("area") == "yes")
+            return;
+        auto closed = [](std::string_view value){ return value == "no" || value == "private" || value == "agricultural" || value == "forestry" || value == "delivery"; };
+        std::string_view carAccess = !found.tag("motorcar").empty() ? found.tag("motorcar") : found.tag("motor_vehicle");
+        if(closed(carAccess) || (carAccess.empty() && closed(found.tag("access"))))
+            return;
+        road next = {refs.size(), found.refs.size(), speed->second, true, true};
+        std::string maxspeed(found.tag("maxspeed"));
+        if(!maxspeed.empty() && std::isdigit(static_cast<unsigned char>(maxspeed[0]))){
+            double limit = std::atof(maxspeed.c_str());
+            if(maxspeed.find("mph") != std::string::npos)
+                limit *= 1.609344;
+            if(limit > 0)
+                next.speed = limit * settings.max_speed_factor;
+        }
+        std::string_view oneway = found.tag("oneway");
+        std::string_view highway = found.tag("highway");
+        if(oneway == "yes" || oneway == "true" || oneway == "1" || (oneway.empty() && (highway == "motorway" || highway == "motorway_link" || found.tag("junction") == "roundabout")))
+            next.backward = false;
+        else if(oneway == "-1" || oneway == "reverse")
+            next.forward = false;
+        roads.push_back(next);
+        refs.insert(refs.end(), found.refs.begin(), found.refs.end());
+    });
+    std::vector<int64_t> ids(refs);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    const int32_t missing = std::numeric_limits<int32_t>::min();
+    std::vector<int32_t> lat(ids.size(), missing), lon(ids.size(), missing);
+    complete = complete && extract.read([&](int64_t id, double l_lat, double l_lon){
+        auto found = std::lower_bound(ids.begin(), ids.end(), id);
+        if(found == ids.end() || *found != id)
+            return;
+        lat[found - ids.begin()] = static_cast<int32_t>(std::lround(l_lat * 1e6));
+        lon[found - ids.begin()] = static_cast<int32_t>(std::lround(l_lon * 1e6));
+    }, nullptr);
+    if(!complete){
+        LOG_ERROR("chrouter: could not read OSM extract", "pbf", pbf);
+        return false;
+    }
+    std::vector<std::size_t> position(refs.size());
+    for(std::size_t i=0; i<refs.size(); i++)
+        position[i] = std::lower_bound(ids.begin(), ids.end(), refs[i]) - ids.begin();
+    // Nodes at the end of a chain: ends of the ways, nodes used more than once and nodes next to missing ones
+    std::vector<uint8_t> junction(ids.size(), 0), uses(ids.size(), 0);
+    for(const auto& next: roads)
+        for(std::size_t i=next.first; i<next.first+next.count; i++){
+            std::size_t id = position[i];
+            uses[id] = std::min(2, uses[id] + 1);
+            if(i == next.first || i + 1 == next.first + next.count || uses[id] > 1)
+                junction[id] = 1;
+            if(lat[id] == missing){
+                if(i > next.first)
+                    junction[position[i-1]] = 1;
+                if(i + 1 < next.first + next.count)
+                    junction[position[i+1]] = 1;
+            }
+        }
+    for(std::size_t id=0; id<ids.size(); id++)
+        if(uses[id] > 1)
+            junction[id] = 1;
+    // Calls segment with the positions in refs of the ends of each chain
+    auto walk = [&](const std::function<void(const road&, std::size_t, std::size_t)>& segment){
+        for(const auto& next: roads){
+            std::size_t start = refs.size();
+            for(std::size_t i=next.first; i<next.first+next.count; i++){
+                std::size_t id = position[i];
+                if(lat[id] == missing){
+                    start = refs.size();
+                    continue;
+                }
+                if(!junction[id])
+                    continue;
+                if(start != refs.size())
+                    segment(next, start, i);
+                start = i;
+            }
+        }
+    };
+    for(;;){
+        std::vector<std::tuple<std::size_t, std::size_t, std::size_t> > ends;
+        walk([&](const road&, std::size_t first, std::size_t last){
+            auto pair = std::minmax(position[first], position[last]);
+            ends.push_back({pair.first, pair.second, last > first + 1 ? position[(first + last) / 2] : ids.size()});
+        });
+        std::sort(ends.begin(), ends.end());
+        std::size_t split = 0;
+        for(std::size_t i=0; i<ends.size(); i++){
+            auto [from, to, middle] = ends[i];
+            bool shared = (i > 0 && std::get<0>(ends[i-1]) == from && std::get<1>(ends[i-1]) == to) || (i + 1 < ends.size() && std::get<0>(ends[i+1]) == from && std::get<1>(ends[i+1]) == to);
+            if((shared || from == to) && middle != ids.size() && !junction[middle]){
+                junction[middle] = 1;
+                split++;
+            }
+        }
+        if(split == 0)
+            break;
+    }
+    std::vector<uint32_t> index(ids.size(), chgraph::none);
+    std::vector<int32_t> nodeLat, nodeLon;
+    for(std::size_t i=0; i<ids.size(); i++)
+        if(lat[i] != missing && junction[i]){
+            index[i] = nodeLat.size();
+            nodeLat.push_back(lat[i]);
+            nodeLon.push_back(lon[i]);
+        }
+    std::vector<chgraph::road> edges;
+    std::vector<chgraph::shape> shapes;
+    std::size_t shapePoints = 0;
+    walk([&](const road& next, std::size_t first, std::size_t last){
+        uint32_t from = index[position[first]], to = index[position[last]];
+        if(from == to)
+            return;
+        double distance = 0;
+        uint32_t time = 0;
+        chgraph::shape between = {from, to, {}, {}};
+        // Summed over the pieces between the OSM nodes, so the times are the same as without chains
+        for(std::size_t i=first+1; i<=last; i++){
+            std::size_t a = position[i-1], b = position[i];
+            double piece = geo::haversine({lat[a] / 1e6, lon[a] / 1e6}, {lat[b] / 1e6, lon[b] / 1e6}) * 1000.0;
+            distance += piece;
+            time += std::max<uint32_t>(1, static_cast<uint32_t>(std::lround(piece / (next.speed / 3.6) * 1000.0)));
+            if(i < last){
+                between.lat.push_back(lat[b]);
+                between.lon.push_back(lon[b]);
+            }
+        }
+        if(next.forward)
+            edges.push_back({from, to, time, static_cast<float>(distance)});
+        if(next.backward)
+            edges.push_back({to, from, time, static_cast<float>(distance)});
+        if(!between.lat.empty()){
+            shapePoints += between.lat.size();
+            shapes.push_back(std::move(between));
+        }
+    });
+    LOG_INFO("chrouter: read OSM extract", "pbf", pbf, "ways", roads.size(), "osm_nodes", ids.size(), "missing_nodes", std::count(lat.begin(), lat.end(), missing), "nodes", nodeLat.size(), "shape_points", shapePoints, "edges", edges.size());
+    return chgraph::write(graphFile, nodeLat, nodeLon, edges, shapes, settings.witness_settled);
+}
+@}
+
+A car request may have intermediate points, the legs between them are routed one after the other.
+
+@O ../src/chrouter.cpp -d
+@{
+uint32_t chrouter::snap(double lat, double lon) const{
+    return graph->nearest(lat, lon, config.max_snap_m);
+}
+
+nlohmann::json chrouter::route(const nlohmann::json& request) const{
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_chrouter_route_seconds", "Duration of routes of the embedded car router"), "chrouter::route", "chrouter");
+    std::vector<uint32_t> stops;
+    for(const auto& point: request.at("points")){
+        uint32_t node = snap(point.at(1).get<double>(), point.at(0).get<double>());
+        if(node == chgraph::none)
+            return {{"message", "Cannot find point " + std::to_string(stops.size()) + ": " + point.dump()}};
+        stops.push_back(node);
+    }
+    std::vector<chgraph::road> roads, leg;
+    std::vector<std::pair<double, double> > shape;
+    for(std::size_t i=1; i<stops.size(); i++){
+        if(!graph->path(stops[i-1], stops[i], leg))
+            return {{"message", "Connection between locations not found"}};
+        roads.insert(roads.end(), leg.begin(), leg.end());
+    }
+    nlohmann::json coordinates = nlohmann::json::array();
+    nlohmann::json instructions = nlohmann::json::array();
+    if(!stops.empty())
+        coordinates.push_back({graph->lon(stops.front()), graph->lat(stops.front())});
+    double totalDistance = 0, distance = 0;
+    unsigned long long int totalTime = 0, time = 0;
+    long int speed = -1;
+    std::size_t first = 0;
+    auto flush = [&](std::size_t last){
+        if(last > first)
+            instructions.push_back({{"distance", distance}, {"time", time}, {"interval", {first, last}}, {"sign", 0}, {"street_name", ""}, {"text", ""}});
+        first = last;
+        distance = 0;
+        time = 0;
+    };
+    for(const auto& next: roads){
+        long int roadSpeed = std::lround(next.distance / next.time * 3600.0);
+        if(roadSpeed != speed)
+            flush(coordinates.size() - 1);
+        speed = roadSpeed;
+        graph->geometry(next.from, next.to, shape);
+        for(const auto& point: shape)
+            coordinates.push_back({point.second, point.first});
+        coordinates.push_back({graph->lon(next.to), graph->lat(next.to)});
+        distance += next.distance;
+        time += next.time;
+        totalDistance += next.distance;
+        totalTime += next.time;
+    }
+    flush(coordinates.size() - 1);
+    instructions.push_back({{"distance", 0}, {"time", 0}, {"interval", {first, first}}, {"sign", 4}, {"street_name", ""}, {"text", "Arrive at destination"}});
+    nlohmann::json path = {{"distance", totalDistance}, {"time", totalTime}, {"points", {{"type", "LineString"}, {"coordinates", coordinates}}}, {"instructions", instructions}};
+    return {{"paths", nlohmann::json::array({path})}};
+}
+@}
+
+The table is computed with the buckets of the hierarchy (see the chgraph class) by \verb|threads| threads (0 for one per hardware thread) over blocks of \verb|table_block| sources. The calling thread is one of them, the others are started with the router and wait for tables in a scheduler of their own. The $CO_2$ of a cell is calculated from the average speed of its path as if it were one instruction of graphhopper (see \verb|route::co2|). This is only an estimate, the $CO_2$ of a route with its instructions is usually somewhat higher, since the speed changes along the way. Without a car class no $CO_2$ is calculated and \verb|co2| stays empty.
+
+@O ../src/chrouter.cpp -d
+@{
+void chrouter::table(const std::vector<std::pair<double, double> >& sources, const std::vector<std::pair<double, double> >& targets, const std::string& carClass, std::vector<double>& seconds, std::vector<double>& metres, std::vector<double>& co2) const{
+    metrics& registry = metrics::instance();
+    metrics::scopedTimer timer(registry.getHistogram("co2carpool_chrouter_table_seconds", "Duration of tables of the embedded car router"), "chrouter::table", "chrouter");
+    std::vector<uint32_t> sourceNodes, targetNodes;
+    for(const auto& source: sources)
+        sourceNodes.push_back(snap(source.first, source.second));
+    for(const auto& target: targets)
+        targetNodes.push_back(snap(target.first, target.second));
+    std::vector<uint32_t> times;
+    std::vector<float> distances;
+    unsigned int parts = std::min<std::size_t>(threads, std::max(1 + sources.size() / config.table_block, targets.size()));
+    graph->table(sourceNodes, targetNodes, times, distances, workers.get(), parts, config.table_block);
+    seconds.assign(times.size(), std::numeric_limits<double>::infinity());
+    metres.assign(times.size(), std::numeric_limits<double>::infinity());
+    co2.clear();
+    if(!carClass.empty())
+        co2.assign(times.size(), std::numeric_limits<double>::infinity());
+    SUMOEmissionClass emissionClass = carClass.empty() ? SUMOEmissionClass() : PollutantsInterface::getClassByName(carClass);
+    std::vector<route::instruction> average(1);
+    for(std::size_t i=0; i<times.size(); i++){
+        if(times[i] == chgraph::none)
+            continue;
+        seconds[i] = times[i] / 1000.0;
+        metres[i] = distances[i];
+        if(carClass.empty())
+            continue;
+        average[0].distance = distances[i];
+        average[0].time = times[i];
+        co2[i] = route::co2(emissionClass, average);
+    }
+    registry.getCounter("co2carpool_chrouter_table_cells_total", "Cells of the tables of the embedded car router").add(times.size());
+    LOG_DEBUG("chrouter: table", "sources", sources.size(), "targets", targets.size(), "parts", parts);
+}
+@}
@@ -36,7 +36,46 @@ find_package(CURL REQUIRED)
 # nlohmann json
 find_package(nlohmann_json 3.9.1 REQUIRED)
 
-add_executable(co2carpool main.cpp database.cpp rest.cpp route.cpp sumo/emissions/PollutantsInterface.cpp sumo/emissions/HelpersHBEFA4.cpp)
-target_link_libraries(co2carpool PRIVATE PostgreSQL::PostgreSQL ${CURL_LIBRARIES} nlohmann_json::nlohmann_json)
+# threads for the logger and the scheduler workers
+find_package(Threads REQUIRED)
+
+# Log levels below this one are removed at compile time (0 debug, 1 info, 2 warning, 3 error)
+set(CO2CARPOOL_LOG_LEVEL 0 CACHE STRING "Lowest log level compiled in")
+
+# Everything apart from main is in a library, so the benchmarks can use it as well
+add_library(co2carpool_core STATIC database.cpp bulkwriter.cpp listener.cpp pipeline.cpp scheduler.cpp server.cpp service.cpp rest.cpp limiter.cpp retrier.cpp projection.cpp route.cpp prefilter.cpp simplifier.cpp planner.cpp ptemission.cpp itineraries.cpp logger.cpp metrics.cpp generator.cpp sumo/emissions/PollutantsInterface.cpp sumo/emissions/HelpersHBEFA4.cpp)
+target_include_directories(co2carpool_core PUBLIC ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(co2carpool_core PUBLIC PostgreSQL::PostgreSQL ${CURL_LIBRARIES} nlohmann_json::nlohmann_json Threads::Threads)
+target_compile_definitions(co2carpool_core PUBLIC CO2CARPOOL_LOG_LEVEL=${CO2CARPOOL_LOG_LEVEL})
+
+# Asynchronous routing with the coroutines of C++20
+option(CO2CARPOOL_COROUTINES "Build the coroutine based route pipeline (needs C++20)" ON)
+if (CO2CARPOOL_COROUTINES)
+target_compile_features(co2carpool_core PUBLIC cxx_std_20)
+target_compile_definitions(co2carpool_core PUBLIC CO2CARPOOL_COROUTINES)
+endif (CO2CARPOOL_COROUTINES)
+
+# Embedded car router with a contraction hierarchy built from an OSM extract
+option(CO2CARPOOL_CH "Build the embedded contraction hierarchy car router (needs zlib)" OFF)
+if (CO2CARPOOL_CH)
+find_package(ZLIB REQUIRED)
+target_sources(co2carpool_core PRIVATE osmpbf.cpp chgraph.cpp chrouter.cpp)
+target_link_libraries(co2carpool_core PUBLIC ZLIB::ZLIB)
+target_compile_definitions(co2carpool_core PUBLIC CO2CARPOOL_CH)
+endif (CO2CARPOOL_CH)
+
+add_executable(co2carpool main.cpp)
+target_link_libraries(co2carpool PRIVATE co2carpool_core)
+
+add_executable(co2carpool_generate generate.cpp)
+target_link_libraries(co2carpool_generate PRIVATE co2carpool_core)
+
+# google benchmark
+option(CO2CARPOOL_BENCHMARKS "Build the co2carpool_bench benchmarks" OFF)
+if (CO2CARPOOL_BENCHMARKS)
+find_package(benchmark REQUIRED)
+add_executable(co2carpool_bench bench/bench.cpp)
+target_link_libraries(co2carpool_bench PRIVATE co2carpool_core benchmark::benchmark_main)
+endif (CO2CARPOOL_BENCHMARKS)
 @}
 
@@ -0,0 +1,190 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{Compact paths}
+
+A car route of graphhopper has a coordinate every few metres, as two doubles this is 16 bytes per point. For thousands of long routes that is a lot of memory for positions which are not more exact than a decimetre anyway. A compact path keeps the coordinates as integer microdegrees (about 0.1\,m) and stores only the difference to the previous point, zigzag and varint encoded: neighbouring points of a route are close, so most differences take one or two bytes. Every \verb|blockSize| points a checkpoint holds the absolute coordinate and the offset into the bytes, so a point is found by decoding at most one block and not the whole path.
+
+The path is filled with \verb|push_back| and read with its iterator or \verb|operator[]|, which give the points by value. It is a template over the point type so it does not depend on the route class; the point needs the members \verb|lat| and \verb|lon|.
+
+@O ../src/compactpath.h -d
+@{
+#ifndef COMPACTPATH_CLASS
+#define COMPACTPATH_CLASS
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+template<class point>
+class compactPath {
+public:
+    static const std::size_t blockSize = 64;
+    class const_iterator {
+    public:
+        // The points are decoded on the fly, so there is no reference to them
+        typedef std::input_iterator_tag iterator_category;
+        typedef point value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef point reference;
+        const_iterator(void) : path(nullptr), index(0), offset(0), lat(0), lon(0){}
+        point operator*(void) const { return make(lat, lon); }
+        const_iterator& operator++(void){
+            if(++index < path->count)
+                path->step(index, offset, lat, lon);
+            return *this;
+        }
+        const_iterator operator++(int){
+            const_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+        bool operator==(const const_iterator& other) const { return index == other.index; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+    private:
+        friend class compactPath;
+        const compactPath* path;
+        std::size_t index;
+        std::size_t offset;
+        int32_t lat;
+        int32_t lon;
+    };
+    compactPath(void) : count(0), lastLat(0), lastLon(0){}
+    compactPath(const std::vector<point>& points) : compactPath(){
+        for(const auto& position: points)
+            push_back(position);
+        shrink_to_fit();
+    }
+    void push_back(const point& position){
+        int32_t lat = fixed(position.lat);
+        int32_t lon = fixed(position.lon);
+        if(count % blockSize == 0)
+            checkpoints.push_back({static_cast<uint32_t>(data.size()), lat, lon});
+        else{
+            putVarint(static_cast<int64_t>(lat) - lastLat);
+            putVarint(static_cast<int64_t>(lon) - lastLon);
+        }
+        lastLat = lat;
+        lastLon = lon;
+        count++;
+    }
+    std::size_t size(void) const { return count; }
+    bool empty(void) const { return count == 0; }
+    point operator[](std::size_t index) const {
+        const checkpoint& block = checkpoints[index / blockSize];
+        std::size_t offset = block.offset;
+        int32_t lat = block.lat;
+        int32_t lon = block.lon;
+        for(std::size_t i = index - index % blockSize + 1; i <= index; i++)
+            step(i, offset, lat, lon);
+        return make(lat, lon);
+    }
+    point front(void) const { return make(checkpoints.front().lat, checkpoints.front().lon); }
+    point back(void) const { return make(lastLat, lastLon); }
+    const_iterator begin(void) const {
+        const_iterator first;
+        first.path = this;
+        if(count > 0){
+            first.lat = checkpoints.front().lat;
+            first.lon = checkpoints.front().lon;
+        }
+        return first;
+    }
+    const_iterator end(void) const {
+        const_iterator last;
+        last.path = this;
+        last.index = count;
+        return last;
+    }
+    void clear(void){
+        data.clear();
+        checkpoints.clear();
+        count = 0;
+        lastLat = 0;
+        lastLon = 0;
+    }
+    void shrink_to_fit(void){
+        data.shrink_to_fit();
+        checkpoints.shrink_to_fit();
+    }
+    std::vector<point> vector(void) const {
+        std::vector<point> points;
+        points.reserve(count);
+        for(const_iterator i = begin(); i != end(); ++i)
+            points.push_back(*i);
+        return points;
+    }
+    // Memory held by the path
+    std::size_t bytes(void) const {
+        return sizeof(*this) + data.capacity() + checkpoints.capacity() * sizeof(checkpoint);
+    }
+private:
+    struct checkpoint {
+        uint32_t offset;
+        int32_t lat;
+        int32_t lon;
+    };
+    static int32_t fixed(double degrees){
+        return static_cast<int32_t>(std::llround(degrees * 1e6));
+    }
+    static point make(int32_t lat, int32_t lon){
+        point position;
+        position.lat = lat / 1e6;
+        position.lon = lon / 1e6;
+        return position;
+    }
+    void putVarint(int64_t value){
+        uint64_t zigzag = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        while(zigzag >= 0x80){
+            data.push_back(static_cast<uint8_t>(zigzag | 0x80));
+            zigzag >>= 7;
+        }
+        data.push_back(static_cast<uint8_t>(zigzag));
+    }
+    int64_t getVarint(std::size_t& offset) const {
+        uint64_t zigzag = 0;
+        for(int shift = 0; ; shift += 7){
+            uint8_t byte = data[offset++];
+            zigzag |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if(byte < 0x80)
+                break;
+        }
+        return static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+    }
+    // Moves lat and lon from the point before index to the point at index
+    void step(std::size_t index, std::size_t& offset, int32_t& lat, int32_t& lon) const {
+        if(index % blockSize == 0){
+            const checkpoint& block = checkpoints[index / blockSize];
+            offset = block.offset;
+            lat = block.lat;
+            lon = block.lon;
+            return;
+        }
+        lat += static_cast<int32_t>(getVarint(offset));
+        lon += static_cast<int32_t>(getVarint(offset));
+    }
+    std::vector<uint8_t> data;
+    std::vector<checkpoint> checkpoints;
+    std::size_t count;
+    int32_t lastLat;
+    int32_t lastLon;
+};
+
+#endif
+@}
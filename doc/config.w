@@ -19,15 +19,132 @@
 
 The configuration is a json file which parts of should be directly usable by the classes. Edit according to your settings and rename to \verb|config.json|.
 
+The \verb|log| section sets the level of messages written (debug, info, warning or error) and optionally a file to write them to instead of the standard output.
+
+The \verb|rest| section has the urls of the routers and can switch to recording or replaying the requests (see the rest class). In \verb|concurrency| the start value and the upper bound of the number of requests sent to each router at the same time and the number of requests that may wait are set; the limit itself adapts to the router (see the limiter class). In \verb|endpoints| the timeouts and retries of the requests and hedging of slow requests are set for all urls or each one (see the retrier class). With \verb|local| the car requests are answered by the embedded car router instead of graphhopper, e.g. \verb|"local": {"car_router": {"graph": "car.ch", "pbf": "region.osm.pbf"}}| (see the chrouter class).
+
+The \verb|scheduler| section sets the number of worker threads (0 for one per hardware thread) and \verb|database| the connection string and the size of the connection pool (0 for one connection per worker); with \verb|migrate| the schema is created and updated on start. With \verb|listen| the program keeps running after the first plan and plans again when participants change in the database (see the listener class). With \verb|server| enabled, or when started with \verb|--daemon|, the program runs as daemon and answers planning requests over HTTP (see the server and service classes). The \verb|bulkwriter| copies route segments and isoemission zones in batches of \verb|batch_rows| rows or after \verb|flush_interval_ms|.
+
+In \verb|metrics| files for the Prometheus metrics and the Chrome trace can be given, which are written at the end (see the metrics class).
+
+If \verb|participants_file| is set the participants are read from this json file instead of using the debug locations. Such a file can be created by \verb|co2carpool_generate| with the settings in \verb|generator| (see the generator class).
+
+In \verb|planner| the number of routes calculated at the same time is limited by \verb|max_in_flight|. The \verb|simplifier| sets how far in m the simplified paths of the pickup routes may be off the paths of graphhopper, which method is used and in how many parts the paths are shared with the workers of the scheduler.
+
+The \verb|prefilter| values are the detour factor of roads and public transport compared to the great circle distance, a lower bound for the emissions of the cars and an upper bound for the emissions of public transport (both in $\frac{g}{km}$).
+
+The \verb|pt_emission| table gives the emission factors for public transport per mode and per agency in $\frac{g}{km}$, see the ptemission class. It also limits how many pages of later departures are asked from motis and how long this may take.
+
 
 @O ../src/build/config.json.template
 @{
 {
+  "log": {
+    "level": "info",
+    "file": ""
+  },
+  "metrics": {
+    "prometheus_file": "",
+    "trace_file": ""
+  },
+  "scheduler": {
+    "workers": 0
+  },
+  "database": {
+    "conninfo": "dbname = co2carpool",
+    "pool_size": 0,
+    "migrate": true,
+    "listen": false,
+    "debounce_ms": 200
+  },
+  "server": {
+    "enabled": false,
+    "address": "127.0.0.1",
+    "port": 8088,
+    "max_pending": 64,
+    "max_body_bytes": 1048576
+  },
+  "bulkwriter": {
+    "batch_rows": 1000,
+    "flush_interval_ms": 200
+  },
   "rest": {
     "urls":{
       "car_router": "http://localhost:8989/route",
       "pt_router": "http://localhost:8080/api/v1/plan"
-    }
+    },
+    "mode": "live",
+    "archive": "rest-archive.jsonl",
+    "replay_latency_ms": 0,
+    "concurrency": {
+      "initial": 8,
+      "max": 256,
+      "queue": 1024
+    },
+    "endpoints": {
+      "default": {
+        "timeout_ms": 30000,
+        "retries": 2,
+        "backoff_ms": 100
+      },
+      "pt_router": {
+        "hedge": true
+      }
+    },
+    "local": {}
+  },
+  "participants_file": "",
+  "generator": {
+    "count": 200,
+    "seed": 1,
+    "bbox": [45.8, 5.9, 55.1, 17.2],
+    "rural_fraction": 0.2,
+    "driver_fraction": 0.25,
+    "capacity_weights": [0.3, 0.3, 0.25, 0.15],
+    "car_classes": {
+      "HBEFA4/PC_petrol_Euro-4": 0.3,
+      "HBEFA4/PC_petrol_Euro-6ab": 0.3,
+      "HBEFA4/PC_diesel_Euro-5": 0.2,
+      "HBEFA4/PC_diesel_Euro-6ab": 0.2
+    },
+    "output": "participants.json"
+  },
+  "planner": {
+    "max_in_flight": 256
+  },
+  "prefilter": {
+    "detour_factor": 1.5,
+    "e_car": 100,
+    "e_pt": 55
+  },
+  "simplifier": {
+    "tolerance_m": 5,
+    "method": "douglas_peucker",
+    "threads": 0
+  },
+  "pt_emission": {
+    "default_factor": 38,
+    "modes": {
+      "WALK": 0,
+      "BIKE": 0,
+      "HIGHSPEED_RAIL": 29,
+      "LONG_DISTANCE": 29,
+      "NIGHT_RAIL": 29,
+      "REGIONAL_FAST_RAIL": 55,
+      "REGIONAL_RAIL": 55,
+      "METRO": 55,
+      "SUBWAY": 55,
+      "TRAM": 55,
+      "BUS": 80,
+      "COACH": 29
+    },
+    "agencies": {
+      "DB Fernverkehr AG": 29,
+      "DB Regio AG": 55
+    },
+    "max_pages": 3,
+    "page_budget_ms": 2000,
+    "max_walk_km": 2
   }
 }
 @}
@@ -21,13 +21,60 @@
 
 @i task.w
 
+@i logger.w
+
+@i metrics.w
+
 @i cmake.w
 
 @i main.w
 
 @i database.w
 
+@i bulkwriter.w
+
+@i pipeline.w
+
+@i listener.w
+
+@i server.w
+
+@i service.w
+
 @i rest.w
 
+@i limiter.w
+@i retrier.w
+
+@i projection.w
+
+@i coroutine.w
+
 @i route.w
 
+@i locations.w
+
+@i geo.w
+
+@i ewkb.w
+@i compactpath.w
+@i simplifier.w
+
+@i osmpbf.w
+@i chgraph.w
+@i chrouter.w
+
+@i participant.w
+
+@i ptemission.w
+
+@i itineraries.w
+
+@i prefilter.w
+
+@i planner.w
+
+@i generator.w
+
+@i bench.w
+
@@ -0,0 +1,201 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{coroutine class}
+
+A route waits twice for a router. With one thread per route thousands of routes in flight would need thousands of threads. With the coroutines of C++20 a route is written as before, but at every \verb|co_await| on a request it is suspended and the thread is free for other work until the reply is there (see the asynchronous requests of the rest class).
+
+\verb|coroutine<T>| is the result type of such a function. It is lazy: nothing runs before it is awaited by another coroutine, started with \verb|start| or waited for with \verb|wait|. \verb|whenAll| runs many coroutines with at most \verb|maxInFlight| of them started at the same time and blocks until all are finished. Coroutines resumed by the loop of rest are handed to the workers of the scheduler through a \verb|resumeQueue| (see \verb|rest::resumeWith|). \verb|whenAll| may itself run on a worker, so all workers could be blocked in it; given the function \verb|help|, it therefore runs waiting resumptions itself while it waits and never depends on a free worker.
+
+The coroutines are only built if the compiler supports C++20, see the option \verb|CO2CARPOOL_COROUTINES| in the CMakeLists.txt.
+
+@O ../src/coroutine.h -d
+@{
+#ifndef COROUTINE_CLASS
+#define COROUTINE_CLASS
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+template<typename T>
+class coroutine {
+public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+        std::function<void(void)> finished;
+        coroutine get_return_object(void){
+            return coroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend(void) noexcept{
+            return {};
+        }
+        struct finalAwaiter {
+            bool await_ready(void) noexcept{
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> done) noexcept{
+                // The frame may be destroyed as soon as finished was called
+                std::function<void(void)> finished = std::move(done.promise().finished);
+                std::coroutine_handle<> continuation = done.promise().continuation;
+                if(finished)
+                    finished();
+                if(continuation)
+                    return continuation;
+                return std::noop_coroutine();
+            }
+            void await_resume(void) noexcept{}
+        };
+        finalAwaiter final_suspend(void) noexcept{
+            return {};
+        }
+        void return_value(T result){
+            value = std::move(result);
+        }
+        void unhandled_exception(void){
+            error = std::current_exception();
+        }
+    };
+    coroutine(coroutine&& other) noexcept : handle(std::exchange(other.handle, {})){}
+    coroutine(const coroutine&) = delete;
+    coroutine& operator=(coroutine&& other) noexcept{
+        if(handle)
+            handle.destroy();
+        handle = std::exchange(other.handle, {});
+        return *this;
+    }
+    ~coroutine(void){
+        if(handle)
+            handle.destroy();
+    }
+    // Awaiting in another coroutine
+    bool await_ready(void) const noexcept{
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept{
+        handle.promise().continuation = waiting;
+        return handle;
+    }
+    T await_resume(void){
+        return result();
+    }
+    // Runs until the first suspension, finished is called when done (in the thread which resumed it last)
+    void start(std::function<void(void)> finished){
+        handle.promise().finished = finished;
+        handle.resume();
+    }
+    bool done(void) const{
+        return handle.done();
+    }
+    T result(void){
+        if(handle.promise().error)
+            std::rethrow_exception(handle.promise().error);
+        return std::move(*handle.promise().value);
+    }
+    // Blocks the calling thread until the coroutine is done
+    T wait(void){
+        std::mutex doneMutex;
+        std::condition_variable doneCondition;
+        bool isDone = false;
+        start([&]{
+            std::lock_guard<std::mutex> lock(doneMutex);
+            isDone = true;
+            doneCondition.notify_all();
+        });
+        std::unique_lock<std::mutex> lock(doneMutex);
+        doneCondition.wait(lock, [&isDone]{ return isDone; });
+        return result();
+    }
+private:
+    explicit coroutine(std::coroutine_handle<promise_type> l_handle) : handle(l_handle){}
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Resumptions of coroutines, run by the workers and by the thread waiting in whenAll
+class resumeQueue {
+public:
+    void push(std::function<void(void)> resume){
+        std::lock_guard<std::mutex> lock(queueMutex);
+        waiting.push_back(std::move(resume));
+    }
+    // Runs the oldest resumption, false if there was none
+    bool runOne(void){
+        std::function<void(void)> resume;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if(waiting.empty())
+                return false;
+            resume = std::move(waiting.front());
+            waiting.pop_front();
+        }
+        resume();
+        return true;
+    }
+private:
+    std::mutex queueMutex;
+    std::deque<std::function<void(void)> > waiting;
+};
+
+template<typename T>
+std::vector<T> whenAll(std::vector<coroutine<T> >& coroutines, unsigned int maxInFlight, std::function<bool(void)> help = nullptr){
+    std::mutex doneMutex;
+    std::condition_variable doneCondition;
+    size_t finished = 0;
+    maxInFlight = std::max(1u, maxInFlight);
+    std::unique_lock<std::mutex> lock(doneMutex);
+    auto wait = [&](auto condition){
+        if(!help){
+            doneCondition.wait(lock, condition);
+            return;
+        }
+        while(!condition()){
+            lock.unlock();
+            bool ran = help();
+            lock.lock();
+            if(!ran)
+                doneCondition.wait_for(lock, std::chrono::milliseconds(1), condition);
+        }
+    };
+    for(auto& next: coroutines){
+        wait([&]{ return (&next - coroutines.data()) - finished < maxInFlight; });
+        lock.unlock();
+        next.start([&]{
+            std::lock_guard<std::mutex> finishedLock(doneMutex);
+            finished++;
+            doneCondition.notify_all();
+        });
+        lock.lock();
+    }
+    wait([&]{ return finished == coroutines.size(); });
+    std::vector<T> results;
+    results.reserve(coroutines.size());
+    for(auto& running: coroutines)
+        results.push_back(running.result());
+    return results;
+}
+
+#endif
+@}
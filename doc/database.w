@@ -14,7 +14,6 @@
 %
 % You should have received a copy of the GNU Affero General Public License
 % along with this program.  If not, see <http://www.gnu.org/licenses/>.
-
 \subsection{database class}
 
 This should manage all queries to the PostGIS database.
@@ -25,54 +24,630 @@ We use ``libpq'' for talking to the PostGIS database. Probably not all of those
 apt-get install libpq5 libpq-dev postgresql-server-dev-all postgresql-all
 \end{lstlisting}
 
+A libpq connection must not be used by two threads at the same time. So that the tasks of the scheduler can read and write in parallel the database class keeps a pool of connections, by default as many as the scheduler has workers. A task takes a connection out of the pool with \verb|checkout| and it is given back when the returned \verb|lease| goes out of scope. A lease whose connection broke can connect again with \verb|reset|, which also prepares the statements again.
+
+Every connection prepares the statements for the frequent queries when it is opened, so later only the parameters have to be sent. The configuration is:
+
+\begin{lstlisting}
+"database": { "conninfo": "dbname = co2carpool", "pool_size": 0, "migrate": true }
+\end{lstlisting}
+
 @O ../src/database.h -d
 @{
 #ifndef DATABASE_CLASS
 #define DATABASE_CLASS
 
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 #include "libpq-fe.h"
 
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "participant.h"
+#include "route.h"
+
 class database {
 public:
-    database(void);
+    class lease {
+    public:
+        lease(database& pool, PGconn* connection);
+        lease(lease&& other);
+        lease(const lease&) = delete;
+        ~lease(void);
+        PGconn* get(void) const;
+        // Connects again after the connection broke, with the prepared statements
+        bool reset(void);
+    private:
+        database* pool;
+        PGconn* connection;
+    };
+    // One connection per worker unless pool_size is set in the configuration
+    database(const nlohmann::json& config = nlohmann::json::object(), unsigned int workers = 1);
     ~database(void);
+    bool connected(void) const;
+    unsigned int size(void) const;
+    // Blocks until a connection is free
+    lease checkout(void);
+    // True for the server process of one of the pool connections, e.g. for the sender of a notification
+    bool ownBackend(int pid);
+    // Inserts or updates participants in one transaction
+    bool insertParticipants(const std::vector<participant>& participants);
+    struct routeSegment {
+        unsigned int id;
+        unsigned int from_id;
+        unsigned int to_id;
+        std::vector<route::coordinate> path;
+    };
+    struct zone {
+        unsigned int id;
+        unsigned int driver_id;
+        unsigned int capacity;
+        std::vector<route::coordinate> boundary;
+    };
+    std::vector<participant> participants(void);
+    // Only the given participants, ids which do not exist are left out
+    std::vector<participant> participants(const std::vector<unsigned int>& ids);
+    std::vector<routeSegment> routeSegments(void);
+    std::vector<zone> isoemissionZones(void);
+    bool insertRouteSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const std::vector<route::coordinate>& path);
+    bool insertIsoemission(unsigned int id, unsigned int driver_id, unsigned int capacity, const std::vector<route::coordinate>& zone);
+    // Ids of the passengers inside the isoemission zone of a driver
+    std::vector<unsigned int> participantsInZone(unsigned int driver_id, unsigned int capacity);
+    struct zoneMembers {
+        unsigned int driver_id;
+        unsigned int capacity;
+        std::vector<unsigned int> passengers;
+    };
+    // Passengers inside the isoemission zones of all drivers in one query
+    std::vector<zoneMembers> passengersInZones(void);
 private:
-    PGconn *connection;
-    PGresult *result;
+    PGconn* open(void);
+    bool secure(PGconn* connection);
+    bool migrate(PGconn* connection);
+    PGresult* fetchBinary(PGconn* connection, const char* statement, int count = 0, const char* const* values = NULL);
+    bool prepare(PGconn* connection);
+    void giveBack(PGconn* connection);
+    struct cfg {
+        cfg() : conninfo("dbname = co2carpool"), pool_size(0), migrate(true){};
+        std::string conninfo;
+        unsigned int pool_size;
+        bool migrate;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, conninfo, pool_size, migrate);
+    } config;
+    std::vector<PGconn*> connections;
+    std::vector<PGconn*> idle;
+    // Process ids of the server backends of the pool connections
+    std::set<int> backends;
+    std::mutex poolMutex;
+    std::condition_variable available;
 };
 
 #endif
 @}
 
+Opening a connection also secures it by emptying the search path, so all tables and PostGIS functions in the queries have to be qualified with the schema.
+
 @O ../src/database.cpp -d
 @{
+#include <algorithm>
+
 #include "database.h"
+#include "ewkb.h"
+#include "logger.h"
+#include "metrics.h"
+
+database::database(const nlohmann::json& l_config, unsigned int workers):
+    config(l_config)
+{
+    unsigned int poolSize = config.pool_size > 0 ? config.pool_size : std::max(1u, workers);
+    LOG_INFO("database: connecting", "pool_size", poolSize);
+    for(unsigned int i=0; i<poolSize; i++){
+        PGconn* connection = open();
+        if(!connection)
+            break;
+        connections.push_back(connection);
+        idle.push_back(connection);
+        backends.insert(PQbackendPID(connection));
+    }
+    LOG_INFO("database: connected and secured", "connections", connections.size());
+}
+
+database::~database(void){
+    LOG_INFO("database: closing");
+    std::unique_lock<std::mutex> lock(poolMutex);
+    available.wait(lock, [this]{ return idle.size() == connections.size(); });
+    for(PGconn* connection: connections)
+        PQfinish(connection);
+}
 
-database::database(void){
-    std::cout << "Connecting to database...";
-    connection = PQconnectdb("dbname = co2carpool");
+bool database::connected(void) const{
+    return !connections.empty();
+}
+
+unsigned int database::size(void) const{
+    return connections.size();
+}
+
+PGconn* database::open(void){
+    metrics& registry = metrics::instance();
+    PGconn* connection;
+    {
+        metrics::scopedTimer timer(registry.getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "connect"}}), "database connect", "database");
+        connection = PQconnectdb(config.conninfo.c_str());
+    }
     if(PQstatus(connection) != CONNECTION_OK){
-        std::cout << " failed:\n  " << PQerrorMessage(connection) << "\n";
-        return;
+        LOG_ERROR("database: connecting failed", "error", PQerrorMessage(connection));
+        PQfinish(connection);
+        return nullptr;
+    }
+    if(!secure(connection)){
+        PQfinish(connection);
+        return nullptr;
+    }
+    if(config.migrate && connections.empty() && !migrate(connection)){
+        PQfinish(connection);
+        return nullptr;
+    }
+    if(!prepare(connection)){
+        PQfinish(connection);
+        return nullptr;
+    }
+    return connection;
+}
+
+bool database::secure(PGconn* connection){
+    PGresult* result;
+    {
+        metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "set_config"}}), "database set_config", "database");
+        result = PQexec(connection,
+                "SELECT pg_catalog.set_config('search_path', '', false)");
     }
-    std::cout << " ok!\n";
-    std::cout << "Securing database...";
-    result = PQexec(connection,
-            "SELECT pg_catalog.set_config('search_path', '', false)");
     if (PQresultStatus(result) != PGRES_TUPLES_OK)
     {
-        std::cout << " failed:\n  " << PQerrorMessage(connection) << "\n";
-        return;
+        LOG_ERROR("database: securing failed", "error", PQerrorMessage(connection));
+        PQclear(result);
+        return false;
     }
     PQclear(result);
-    std::cout << " ok!\n";
+    return true;
 }
 
-database::~database(void){
-    std::cout << "Closing database...\n";
-    PQfinish(connection);
+database::lease::lease(database& l_pool, PGconn* l_connection):
+    pool(&l_pool), connection(l_connection)
+{
+}
+
+database::lease::lease(lease&& other):
+    pool(other.pool), connection(other.connection)
+{
+    other.connection = nullptr;
+}
+
+database::lease::~lease(void){
+    if(connection)
+        pool->giveBack(connection);
+}
+
+PGconn* database::lease::get(void) const{
+    return connection;
+}
+
+bool database::lease::reset(void){
+    if(!connection)
+        return false;
+    LOG_WARNING("database: resetting connection");
+    PQsetnonblocking(connection, 0);
+    {
+        std::lock_guard<std::mutex> lock(pool->poolMutex);
+        pool->backends.erase(PQbackendPID(connection));
+    }
+    PQreset(connection);
+    if(PQstatus(connection) != CONNECTION_OK){
+        LOG_ERROR("database: reconnecting failed", "error", PQerrorMessage(connection));
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool->poolMutex);
+        pool->backends.insert(PQbackendPID(connection));
+    }
+    return pool->secure(connection) && pool->prepare(connection);
+}
+
+bool database::ownBackend(int pid){
+    std::lock_guard<std::mutex> lock(poolMutex);
+    return backends.count(pid) > 0;
+}
+
+database::lease database::checkout(void){
+    static metrics::histogram& waitSeconds = metrics::instance().getHistogram("co2carpool_database_checkout_seconds", "Time waiting for a free database connection");
+    metrics::scopedTimer timer(waitSeconds, "database checkout", "database");
+    std::unique_lock<std::mutex> lock(poolMutex);
+    available.wait(lock, [this]{ return !idle.empty() || connections.empty(); });
+    if(connections.empty())
+        return lease(*this, nullptr);
+    PGconn* connection = idle.back();
+    idle.pop_back();
+    return lease(*this, connection);
+}
+
+void database::giveBack(PGconn* connection){
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        idle.push_back(connection);
+    }
+    available.notify_all();
 }
 @}
 
+The prepared statements. Geometries are sent in binary as EWKB (see the EWKB geometries).
+
+@O ../src/database.cpp -d
+@{
+static const std::vector<std::pair<const char*, const char*> > statements = {
+    {"participants_fetch",
+        "SELECT id, name, driver, capacity, carclass, start FROM public.participants ORDER BY id"},
+    {"participants_fetch_ids",
+        "SELECT id, name, driver, capacity, carclass, start FROM public.participants WHERE id = ANY($1::smallint[]) ORDER BY id"},
+    {"routesegments_fetch",
+        "SELECT id, from_id, to_id, route FROM public.routesegment ORDER BY id"},
+    {"isoemissions_fetch",
+        "SELECT id, driver_id, capacity, isoemissionzone FROM public.isoemission ORDER BY id"},
+    {"participant_insert",
+        "INSERT INTO public.participants (id, name, driver, capacity, carclass, start) "
+        "VALUES ($1, $2, $3, $4, $5, public.ST_SetSRID(public.ST_MakePoint($6, $7), 4326)) "
+        "ON CONFLICT (id) DO UPDATE SET name = EXCLUDED.name, driver = EXCLUDED.driver, "
+        "capacity = EXCLUDED.capacity, carclass = EXCLUDED.carclass, start = EXCLUDED.start"},
+    {"routesegment_insert",
+        "INSERT INTO public.routesegment (id, from_id, to_id, route) "
+        "VALUES ($1, $2, $3, $4) "
+        "ON CONFLICT (id) DO UPDATE SET from_id = EXCLUDED.from_id, to_id = EXCLUDED.to_id, route = EXCLUDED.route"},
+    {"isoemission_insert",
+        "INSERT INTO public.isoemission (id, driver_id, capacity, isoemissionzone) "
+        "VALUES ($1, $2, $3, $4) "
+        "ON CONFLICT (id) DO UPDATE SET driver_id = EXCLUDED.driver_id, capacity = EXCLUDED.capacity, isoemissionzone = EXCLUDED.isoemissionzone"},
+    {"zone_containment",
+        "SELECT p.id FROM public.isoemission i JOIN public.participants p "
+        "ON public.ST_Contains(i.isoemissionzone, p.start) "
+        "WHERE i.driver_id = $1 AND i.capacity = $2 AND NOT p.driver ORDER BY p.id"},
+    {"zones_containment",
+        "SELECT i.driver_id, i.capacity, p.id FROM public.isoemission i JOIN public.participants p "
+        "ON public.ST_Contains(i.isoemissionzone, p.start) "
+        "WHERE NOT p.driver ORDER BY i.driver_id, i.capacity, p.id"},
+    {"participants_nearest",
+        "SELECT id FROM public.participants WHERE NOT driver "
+        "ORDER BY start OPERATOR(public.<->) public.ST_SetSRID(public.ST_MakePoint($2, $1), 4326) LIMIT $3"}
+};
+
+bool database::prepare(PGconn* connection){
+    for(const auto& statement: statements){
+        PGresult* result = PQprepare(connection, statement.first, statement.second, 0, NULL);
+        if(PQresultStatus(result) != PGRES_COMMAND_OK){
+            LOG_ERROR("database: preparing statement failed", "statement", statement.first, "error", PQerrorMessage(connection));
+            PQclear(result);
+            return false;
+        }
+        PQclear(result);
+    }
+    return true;
+}
+
+static bool commandOk(PGconn* connection, PGresult* result, const char* what){
+    bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    if(!ok)
+        LOG_ERROR("database: statement failed", "statement", what, "error", PQerrorMessage(connection));
+    PQclear(result);
+    return ok;
+}
+@}
 
+@O ../src/database.cpp -d
+@{
+bool database::insertParticipants(const std::vector<participant>& participants){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "insert_participants"}}), "database insertParticipants", "database");
+    lease connection = checkout();
+    if(!connection.get()) return false;
+    if(!commandOk(connection.get(), PQexec(connection.get(), "BEGIN"), "BEGIN")) return false;
+    for(const auto& traveller: participants){
+        std::string id = std::to_string(traveller.id);
+        std::string capacity = std::to_string(traveller.capacity);
+        std::string lon = std::to_string(traveller.start.lon);
+        std::string lat = std::to_string(traveller.start.lat);
+        const char* values[7] = {id.c_str(), traveller.name.c_str(), traveller.driver ? "true" : "false", capacity.c_str(), traveller.carClass.c_str(), lon.c_str(), lat.c_str()};
+        if(!commandOk(connection.get(), PQexecPrepared(connection.get(), "participant_insert", 7, values, NULL, NULL, 0), "participant_insert")){
+            PQclear(PQexec(connection.get(), "ROLLBACK"));
+            return false;
+        }
+    }
+    if(!commandOk(connection.get(), PQexec(connection.get(), "COMMIT"), "COMMIT")) return false;
+    LOG_INFO("database: inserted participants", "count", participants.size());
+    return true;
+}
+
+bool database::insertRouteSegment(unsigned int id, unsigned int from_id, unsigned int to_id, const std::vector<route::coordinate>& path){
+    static metrics::histogram& insertSeconds = metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "routesegment_insert"}});
+    metrics::scopedTimer timer(insertSeconds, "database insertRouteSegment", "database");
+    std::string l_id = std::to_string(id), l_from = std::to_string(from_id), l_to = std::to_string(to_id);
+    std::string geometry = ewkb::lineString(path);
+    const char* values[4] = {l_id.c_str(), l_from.c_str(), l_to.c_str(), geometry.data()};
+    const int lengths[4] = {0, 0, 0, static_cast<int>(geometry.size())};
+    const int formats[4] = {0, 0, 0, 1};
+    lease connection = checkout();
+    if(!connection.get()) return false;
+    return commandOk(connection.get(), PQexecPrepared(connection.get(), "routesegment_insert", 4, values, lengths, formats, 0), "routesegment_insert");
+}
+
+bool database::insertIsoemission(unsigned int id, unsigned int driver_id, unsigned int capacity, const std::vector<route::coordinate>& zone){
+    static metrics::histogram& insertSeconds = metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "isoemission_insert"}});
+    metrics::scopedTimer timer(insertSeconds, "database insertIsoemission", "database");
+    std::string l_id = std::to_string(id), l_driver = std::to_string(driver_id), l_capacity = std::to_string(capacity);
+    std::string geometry = ewkb::polygon(zone);
+    const char* values[4] = {l_id.c_str(), l_driver.c_str(), l_capacity.c_str(), geometry.data()};
+    const int lengths[4] = {0, 0, 0, static_cast<int>(geometry.size())};
+    const int formats[4] = {0, 0, 0, 1};
+    lease connection = checkout();
+    if(!connection.get()) return false;
+    return commandOk(connection.get(), PQexecPrepared(connection.get(), "isoemission_insert", 4, values, lengths, formats, 0), "isoemission_insert");
+}
+
+std::vector<unsigned int> database::participantsInZone(unsigned int driver_id, unsigned int capacity){
+    static metrics::histogram& querySeconds = metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "zone_containment"}});
+    metrics::scopedTimer timer(querySeconds, "database participantsInZone", "database");
+    std::vector<unsigned int> ids;
+    std::string l_driver = std::to_string(driver_id), l_capacity = std::to_string(capacity);
+    const char* values[2] = {l_driver.c_str(), l_capacity.c_str()};
+    lease connection = checkout();
+    if(!connection.get()) return ids;
+    PGresult* rows = PQexecPrepared(connection.get(), "zone_containment", 2, values, NULL, NULL, 0);
+    if(PQresultStatus(rows) != PGRES_TUPLES_OK)
+        LOG_ERROR("database: zone containment failed", "error", PQerrorMessage(connection.get()));
+    else
+        for(int i=0; i<PQntuples(rows); i++)
+            ids.push_back(std::stoul(PQgetvalue(rows, i, 0)));
+    PQclear(rows);
+    return ids;
+}
+@}
+
+Geometries and the other columns are read back in the binary result format. So the server does not format them as text and we do not parse text; the EWKB of the geometries is decoded straight into the coordinates. In the binary format integers are in network byte order and booleans are one byte. Rows with a geometry which can not be decoded are skipped with an error.
+
+@O ../src/database.cpp -d
+@{
+static unsigned int binarySmallint(const PGresult* rows, int row, int column){
+    if(PQgetisnull(rows, row, column) || PQgetlength(rows, row, column) != 2)
+        return 0;
+    const unsigned char* value = reinterpret_cast<const unsigned char*>(PQgetvalue(rows, row, column));
+    return static_cast<uint16_t>((value[0] << 8) | value[1]);
+}
+
+static bool binaryBoolean(const PGresult* rows, int row, int column){
+    return !PQgetisnull(rows, row, column) && PQgetvalue(rows, row, column)[0] != 0;
+}
+
+static std::string binaryText(const PGresult* rows, int row, int column){
+    return std::string(PQgetvalue(rows, row, column), PQgetlength(rows, row, column));
+}
+
+static ewkb::reader binaryGeometry(const PGresult* rows, int row, int column){
+    return ewkb::reader(PQgetvalue(rows, row, column), PQgetlength(rows, row, column));
+}
+
+PGresult* database::fetchBinary(PGconn* connection, const char* statement, int count, const char* const* values){
+    PGresult* rows = PQexecPrepared(connection, statement, count, values, NULL, NULL, 1);
+    if(PQresultStatus(rows) != PGRES_TUPLES_OK){
+        LOG_ERROR("database: fetching failed", "statement", statement, "error", PQerrorMessage(connection));
+        PQclear(rows);
+        return nullptr;
+    }
+    return rows;
+}
+
+static std::vector<participant> binaryParticipants(const PGresult* rows){
+    std::vector<participant> result;
+    result.reserve(PQntuples(rows));
+    for(int i=0; i<PQntuples(rows); i++){
+        participant traveller;
+        traveller.id = binarySmallint(rows, i, 0);
+        traveller.name = binaryText(rows, i, 1);
+        traveller.driver = binaryBoolean(rows, i, 2);
+        traveller.capacity = binarySmallint(rows, i, 3);
+        traveller.carClass = binaryText(rows, i, 4);
+        if(!binaryGeometry(rows, i, 5).point(traveller.start)){
+            LOG_ERROR("database: could not decode start", "participant", traveller.id);
+            continue;
+        }
+        result.push_back(traveller);
+    }
+    return result;
+}
+
+std::vector<participant> database::participants(void){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "participants_fetch"}}), "database participants", "database");
+    std::vector<participant> result;
+    lease connection = checkout();
+    if(!connection.get()) return result;
+    PGresult* rows = fetchBinary(connection.get(), "participants_fetch");
+    if(!rows) return result;
+    result = binaryParticipants(rows);
+    PQclear(rows);
+    return result;
+}
+
+std::vector<participant> database::participants(const std::vector<unsigned int>& ids){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "participants_fetch_ids"}}), "database participants", "database");
+    std::vector<participant> result;
+    std::string array = "{";
+    for(unsigned int i=0; i<ids.size(); i++)
+        array += (i > 0 ? "," : "") + std::to_string(ids[i]);
+    array += "}";
+    const char* values[1] = {array.c_str()};
+    lease connection = checkout();
+    if(!connection.get()) return result;
+    PGresult* rows = fetchBinary(connection.get(), "participants_fetch_ids", 1, values);
+    if(!rows) return result;
+    result = binaryParticipants(rows);
+    PQclear(rows);
+    return result;
+}
+
+std::vector<database::routeSegment> database::routeSegments(void){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "routesegments_fetch"}}), "database routeSegments", "database");
+    std::vector<routeSegment> result;
+    lease connection = checkout();
+    if(!connection.get()) return result;
+    PGresult* rows = fetchBinary(connection.get(), "routesegments_fetch");
+    if(!rows) return result;
+    result.resize(PQntuples(rows));
+    unsigned int decoded = 0;
+    for(int i=0; i<PQntuples(rows); i++){
+        routeSegment& segment = result[decoded];
+        segment.id = binarySmallint(rows, i, 0);
+        segment.from_id = binarySmallint(rows, i, 1);
+        segment.to_id = binarySmallint(rows, i, 2);
+        if(!binaryGeometry(rows, i, 3).lineString(segment.path)){
+            LOG_ERROR("database: could not decode route", "routesegment", segment.id);
+            continue;
+        }
+        decoded++;
+    }
+    result.resize(decoded);
+    PQclear(rows);
+    return result;
+}
+
+std::vector<database::zone> database::isoemissionZones(void){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "isoemissions_fetch"}}), "database isoemissionZones", "database");
+    std::vector<zone> result;
+    lease connection = checkout();
+    if(!connection.get()) return result;
+    PGresult* rows = fetchBinary(connection.get(), "isoemissions_fetch");
+    if(!rows) return result;
+    result.resize(PQntuples(rows));
+    unsigned int decoded = 0;
+    for(int i=0; i<PQntuples(rows); i++){
+        zone& isoemissionZone = result[decoded];
+        isoemissionZone.id = binarySmallint(rows, i, 0);
+        isoemissionZone.driver_id = binarySmallint(rows, i, 1);
+        isoemissionZone.capacity = binarySmallint(rows, i, 2);
+        if(!binaryGeometry(rows, i, 3).polygon(isoemissionZone.boundary)){
+            LOG_ERROR("database: could not decode isoemission zone", "isoemission", isoemissionZone.id);
+            continue;
+        }
+        decoded++;
+    }
+    result.resize(decoded);
+    PQclear(rows);
+    return result;
+}
+@}
+
+All pairs of drivers and passengers inside their zones are fetched with one join. With the GiST indexes PostGIS only compares the starts inside the bounding box of each zone exactly.
+
+@O ../src/database.cpp -d
+@{
+std::vector<database::zoneMembers> database::passengersInZones(void){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "zones_containment"}}), "database passengersInZones", "database");
+    std::vector<zoneMembers> result;
+    lease connection = checkout();
+    if(!connection.get()) return result;
+    PGresult* rows = fetchBinary(connection.get(), "zones_containment");
+    if(!rows) return result;
+    for(int i=0; i<PQntuples(rows); i++){
+        unsigned int driver_id = binarySmallint(rows, i, 0);
+        unsigned int capacity = binarySmallint(rows, i, 1);
+        if(result.empty() || result.back().driver_id != driver_id || result.back().capacity != capacity)
+            result.push_back({driver_id, capacity, {}});
+        result.back().passengers.push_back(binarySmallint(rows, i, 2));
+    }
+    PQclear(rows);
+    return result;
+}
+@}
+
+\subsubsection{Schema migrations}
+
+The tables and indexes of the PostGIS section are created by the program itself. Every change of the schema is a migration with a version number; the versions already applied are kept in the table \verb|schema_migrations|. When the first connection is opened all missing migrations are applied in one transaction. An advisory lock makes a second program starting at the same time wait until the first one is done. Migrations are never changed once released, a change of the schema is a new migration. With \verb|"migrate": false| nothing is changed and the schema has to be created by hand.
+
+The spatial indexes are GiST indexes on the geometries, so \verb|ST_Contains| and the nearest neighbour operator only look at the candidates from the index.
+
+@O ../src/database.cpp -d
+@{
+struct migration {
+    unsigned int version;
+    const char* description;
+    const char* statements;
+};
+
+static const std::vector<migration> migrations = {
+    {1, "tables",
+        "CREATE TABLE IF NOT EXISTS public.participants ("
+        " id smallint primary key, name varchar(50), driver boolean, capacity smallint,"
+        " carclass varchar(50), start public.geometry(POINT,4326));"
+        "CREATE TABLE IF NOT EXISTS public.routesegment ("
+        " id smallint primary key, from_id smallint, to_id smallint, route public.geometry,"
+        " constraint fk_from foreign key(from_id) references public.participants(id),"
+        " constraint fk_to foreign key(to_id) references public.participants(id));"
+        "CREATE TABLE IF NOT EXISTS public.isoemission ("
+        " id smallint primary key, driver_id smallint, capacity smallint, isoemissionzone public.geometry,"
+        " constraint fk_driver_id foreign key (driver_id) references public.participants(id));"},
+    {2, "spatial indexes",
+        "CREATE INDEX IF NOT EXISTS participants_start_gist ON public.participants USING gist (start);"
+        "CREATE INDEX IF NOT EXISTS routesegment_route_gist ON public.routesegment USING gist (route);"
+        "CREATE INDEX IF NOT EXISTS isoemission_zone_gist ON public.isoemission USING gist (isoemissionzone);"
+        "CREATE INDEX IF NOT EXISTS isoemission_driver_capacity ON public.isoemission (driver_id, capacity);"},
+    {3, "participants change notification",
+        "CREATE OR REPLACE FUNCTION public.participants_notify() RETURNS trigger LANGUAGE plpgsql AS $$"
+        " BEGIN"
+        "  IF TG_OP = 'DELETE' THEN"
+        "   PERFORM pg_catalog.pg_notify('participants_changed', OLD.id::text);"
+        "  ELSE"
+        "   PERFORM pg_catalog.pg_notify('participants_changed', NEW.id::text);"
+        "  END IF;"
+        "  RETURN NULL;"
+        " END $$;"
+        "DROP TRIGGER IF EXISTS participants_notify ON public.participants;"
+        "CREATE TRIGGER participants_notify AFTER INSERT OR UPDATE OR DELETE ON public.participants"
+        " FOR EACH ROW EXECUTE FUNCTION public.participants_notify();"}
+};
+
+bool database::migrate(PGconn* connection){
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_database_seconds", "Duration of database operations", {{"query", "migrate"}}), "database migrate", "database");
+    if(!commandOk(connection, PQexec(connection, "BEGIN"), "BEGIN"))
+        return false;
+    PGresult* result = PQexec(connection, "SELECT pg_catalog.pg_advisory_xact_lock(2024022401)");
+    bool ok = PQresultStatus(result) == PGRES_TUPLES_OK;
+    PQclear(result);
+    ok = ok && commandOk(connection, PQexec(connection,
+            "CREATE TABLE IF NOT EXISTS public.schema_migrations ("
+            " version integer primary key, description text,"
+            " applied timestamp with time zone not null default pg_catalog.now())"), "schema_migrations");
+    unsigned int applied = 0;
+    if(ok){
+        result = PQexec(connection, "SELECT coalesce(max(version), 0) FROM public.schema_migrations");
+        ok = PQresultStatus(result) == PGRES_TUPLES_OK;
+        if(ok)
+            applied = std::stoul(PQgetvalue(result, 0, 0));
+        PQclear(result);
+    }
+    for(const migration& step: migrations){
+        if(!ok) break;
+        if(step.version <= applied) continue;
+        LOG_INFO("database: applying migration", "version", step.version, "description", step.description);
+        ok = commandOk(connection, PQexec(connection, step.statements), step.description);
+        if(!ok) break;
+        std::string version = std::to_string(step.version);
+        const char* values[2] = {version.c_str(), step.description};
+        ok = commandOk(connection, PQexecParams(connection, "INSERT INTO public.schema_migrations (version, description) VALUES ($1, $2)", 2, NULL, values, NULL, NULL, 0), "schema_migrations");
+    }
+    if(!ok){
+        LOG_ERROR("database: migration failed", "error", PQerrorMessage(connection));
+        PQclear(PQexec(connection, "ROLLBACK"));
+        return false;
+    }
+    return commandOk(connection, PQexec(connection, "COMMIT"), "COMMIT");
+}
+@}
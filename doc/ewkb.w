@@ -0,0 +1,195 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{EWKB geometries}
+
+PostGIS reads and writes geometries in the binary format ``extended well known binary'' (EWKB). This is the well known binary of the OGC with the SRID added after the type. We use it to send geometries to the database without formatting and parsing text. All numbers are written little endian (byte order marker 1), coordinates as longitude and latitude in WGS 84.
+
+The reader decodes the geometries of binary query results directly into coordinates. It accepts both byte orders and skips $Z$ and $M$ values, so it reads everything PostGIS sends for points, linestrings and polygons. Of a polygon only the outer ring is kept as this is all we store. A wrong type or a truncated geometry makes the reader return false.
+
+@O ../src/ewkb.h -d
+@{
+#ifndef EWKB_HEADER
+#define EWKB_HEADER
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "route.h"
+
+namespace ewkb {
+    const uint32_t wgs84 = 4326;
+    const uint32_t sridFlag = 0x20000000;
+    enum geometryType : uint32_t { pointType = 1, lineStringType = 2, polygonType = 3 };
+
+    inline void putUint32(std::string& buffer, uint32_t value){
+        for(int i=0; i<4; i++)
+            buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+
+    inline void putDouble(std::string& buffer, double value){
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        for(int i=0; i<8; i++)
+            buffer.push_back(static_cast<char>((bits >> (8 * i)) & 0xff));
+    }
+
+    inline void putHeader(std::string& buffer, geometryType type, uint32_t srid){
+        buffer.push_back(1);
+        putUint32(buffer, type | sridFlag);
+        putUint32(buffer, srid);
+    }
+
+    // Points of a vector or a compact path
+    template<class points_t>
+    inline void putPoints(std::string& buffer, const points_t& points){
+        putUint32(buffer, points.size());
+        for(const auto& point: points){
+            putDouble(buffer, point.lon);
+            putDouble(buffer, point.lat);
+        }
+    }
+
+    inline std::string point(const route::coordinate& position, uint32_t srid = wgs84){
+        std::string buffer;
+        putHeader(buffer, pointType, srid);
+        putDouble(buffer, position.lon);
+        putDouble(buffer, position.lat);
+        return buffer;
+    }
+
+    template<class points_t>
+    inline std::string lineString(const points_t& path, uint32_t srid = wgs84){
+        std::string buffer;
+        buffer.reserve(13 + 16 * path.size());
+        putHeader(buffer, lineStringType, srid);
+        putPoints(buffer, path);
+        return buffer;
+    }
+
+    // Polygon with one ring, which is closed if needed
+    inline std::string polygon(const std::vector<route::coordinate>& ring, uint32_t srid = wgs84){
+        std::string buffer;
+        buffer.reserve(17 + 16 * (ring.size() + 1));
+        putHeader(buffer, polygonType, srid);
+        putUint32(buffer, 1);
+        if(!ring.empty() && (ring.front().lat != ring.back().lat || ring.front().lon != ring.back().lon)){
+            std::vector<route::coordinate> closed = ring;
+            closed.push_back(ring.front());
+            putPoints(buffer, closed);
+        }
+        else
+            putPoints(buffer, ring);
+        return buffer;
+    }
+
+    class reader {
+    public:
+        reader(const char* l_data, size_t l_size) : data(l_data), size(l_size), offset(0), swap(false), dimensions(2){}
+        bool point(route::coordinate& position){
+            return header(pointType) && coordinate(position);
+        }
+        bool lineString(std::vector<route::coordinate>& path){
+            return header(lineStringType) && points(path);
+        }
+        // Outer ring of the polygon
+        bool polygon(std::vector<route::coordinate>& ring){
+            uint32_t rings;
+            if(!header(polygonType) || !getUint32(rings) || rings == 0)
+                return false;
+            if(!points(ring))
+                return false;
+            std::vector<route::coordinate> hole;
+            for(uint32_t i=1; i<rings; i++)
+                if(!points(hole))
+                    return false;
+            return true;
+        }
+    private:
+        bool header(geometryType expected){
+            if(offset + 5 > size)
+                return false;
+            uint8_t order = data[offset++];
+            swap = (order == 1) != hostLittleEndian();
+            uint32_t type;
+            getUint32(type);
+            dimensions = 2 + ((type & 0x80000000) ? 1 : 0) + ((type & 0x40000000) ? 1 : 0);
+            if(type & sridFlag){
+                uint32_t srid;
+                if(!getUint32(srid))
+                    return false;
+            }
+            type &= 0x0fffffff;
+            // ISO WKB codes 1000, 2000 and 3000 for Z, M and ZM
+            if(type >= 1000){
+                dimensions = 2 + (type / 1000 == 3 ? 2 : 1);
+                type %= 1000;
+            }
+            return type == expected;
+        }
+        static bool hostLittleEndian(void){
+            const uint16_t probe = 1;
+            return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        }
+        bool getUint32(uint32_t& value){
+            if(offset + 4 > size)
+                return false;
+            std::memcpy(&value, data + offset, 4);
+            if(swap)
+                value = __builtin_bswap32(value);
+            offset += 4;
+            return true;
+        }
+        bool getDouble(double& value){
+            if(offset + 8 > size)
+                return false;
+            uint64_t bits;
+            std::memcpy(&bits, data + offset, 8);
+            if(swap)
+                bits = __builtin_bswap64(bits);
+            std::memcpy(&value, &bits, 8);
+            offset += 8;
+            return true;
+        }
+        bool coordinate(route::coordinate& position){
+            if(offset + 8 * dimensions > size)
+                return false;
+            getDouble(position.lon);
+            getDouble(position.lat);
+            offset += 8 * (dimensions - 2);
+            return true;
+        }
+        bool points(std::vector<route::coordinate>& path){
+            uint32_t count;
+            if(!getUint32(count) || offset + size_t(count) * 8 * dimensions > size)
+                return false;
+            path.resize(count);
+            for(uint32_t i=0; i<count; i++)
+                coordinate(path[i]);
+            return true;
+        }
+        const char* data;
+        size_t size;
+        size_t offset;
+        bool swap;
+        unsigned int dimensions;
+    };
+}
+
+#endif
+@}
@@ -0,0 +1,196 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{generator class}
+
+To see how the routing, the prefilter and the planning scale with the size of the event we need more than the few debug locations. The generator creates synthetic participants: most of them live in cities, which are chosen weighted by their population and the position is spread around the center with a normal distribution growing with the size of the city. The rest (\verb|rural_fraction|) is distributed evenly over the bounding box. Only cities inside the bounding box are used.
+
+A part of the participants (\verb|driver_fraction|) are drivers, their number of free seats and the emission class of their car are drawn with the given weights.
+
+@O ../src/generator.h -d
+@{
+#ifndef GENERATOR_CLASS
+#define GENERATOR_CLASS
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "participant.h"
+
+class generator {
+public:
+    generator(const nlohmann::json& config);
+    std::vector<participant> participants(unsigned int count);
+    unsigned int count(void) const;
+    const std::string& output(void) const;
+private:
+    struct city {
+        std::string name;
+        route::coordinate center;
+        // in thousands
+        double population;
+    };
+    static const std::vector<city> cities;
+    struct cfg {
+        cfg() : count(200), seed(1), bbox({45.8, 5.9, 55.1, 17.2}), rural_fraction(0.2), driver_fraction(0.25),
+            capacity_weights({0.3, 0.3, 0.25, 0.15}), car_classes({{"HBEFA4/PC_petrol_Euro-4", 1}}), output("participants.json"){};
+        unsigned int count;
+        unsigned int seed;
+        // lat min, lon min, lat max, lon max
+        std::vector<double> bbox;
+        double rural_fraction;
+        double driver_fraction;
+        // weight of 1, 2, ... free seats
+        std::vector<double> capacity_weights;
+        std::map<std::string, double> car_classes;
+        // file name or "database"
+        std::string output;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, count, seed, bbox, rural_fraction, driver_fraction, capacity_weights, car_classes, output);
+    } config;
+    std::mt19937 random;
+};
+
+#endif
+@}
+
+The populations are rounded numbers from the last census of the countries and only meant to give a plausible distribution.
+
+@O ../src/generator.cpp -d
+@{
+#include "generator.h"
+#include "geo.h"
+#include "logger.h"
+
+const std::vector<generator::city> generator::cities = {
+    {"Berlin", {52.520, 13.405}, 3755}, {"Hamburg", {53.551, 9.994}, 1892}, {"Muenchen", {48.137, 11.575}, 1512},
+    {"Koeln", {50.938, 6.960}, 1084}, {"Frankfurt", {50.110, 8.682}, 773}, {"Stuttgart", {48.776, 9.183}, 633},
+    {"Duesseldorf", {51.227, 6.774}, 629}, {"Leipzig", {51.340, 12.375}, 616}, {"Dortmund", {51.514, 7.466}, 593},
+    {"Essen", {51.456, 7.012}, 584}, {"Bremen", {53.079, 8.802}, 577}, {"Dresden", {51.050, 13.738}, 563},
+    {"Hannover", {52.376, 9.732}, 545}, {"Nuernberg", {49.452, 11.077}, 523}, {"Duisburg", {51.435, 6.763}, 502},
+    {"Bochum", {51.482, 7.216}, 365}, {"Wuppertal", {51.256, 7.151}, 358}, {"Bielefeld", {52.030, 8.532}, 334},
+    {"Bonn", {50.737, 7.098}, 336}, {"Muenster", {51.961, 7.626}, 320}, {"Mannheim", {49.487, 8.466}, 315},
+    {"Karlsruhe", {49.007, 8.404}, 308}, {"Augsburg", {48.371, 10.898}, 300}, {"Wiesbaden", {50.082, 8.240}, 283},
+    {"Freiburg", {47.999, 7.842}, 236}, {"Tuebingen", {48.521, 9.057}, 91}, {"Wien", {48.208, 16.373}, 1982},
+    {"Graz", {47.071, 15.439}, 298}, {"Linz", {48.306, 14.286}, 210}, {"Salzburg", {47.810, 13.055}, 157},
+    {"Innsbruck", {47.269, 11.404}, 131}, {"Zuerich", {47.377, 8.541}, 434}, {"Genf", {46.204, 6.143}, 203},
+    {"Basel", {47.560, 7.589}, 177}, {"Bern", {46.948, 7.447}, 134}
+};
+
+generator::generator(const nlohmann::json& l_config):
+    config(l_config), random(config.seed)
+{
+}
+
+unsigned int generator::count(void) const{
+    return config.count;
+}
+
+const std::string& generator::output(void) const{
+    return config.output;
+}
+
+std::vector<participant> generator::participants(unsigned int count){
+    std::vector<city> inside;
+    std::vector<double> populations;
+    for(const auto& candidate: cities){
+        if(candidate.center.lat < config.bbox[0] || candidate.center.lon < config.bbox[1] ||
+                candidate.center.lat > config.bbox[2] || candidate.center.lon > config.bbox[3])
+            continue;
+        inside.push_back(candidate);
+        populations.push_back(candidate.population);
+    }
+    std::vector<std::string> classNames;
+    std::vector<double> classWeights;
+    for(const auto& carClass: config.car_classes){
+        classNames.push_back(carClass.first);
+        classWeights.push_back(carClass.second);
+    }
+    std::discrete_distribution<unsigned int> chooseCity(populations.begin(), populations.end());
+    std::discrete_distribution<unsigned int> chooseCapacity(config.capacity_weights.begin(), config.capacity_weights.end());
+    std::discrete_distribution<unsigned int> chooseClass(classWeights.begin(), classWeights.end());
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::vector<participant> result;
+    result.reserve(count);
+    for(unsigned int i=0; i<count; i++){
+        participant traveller;
+        traveller.id = i + 1;
+        traveller.name = "participant " + std::to_string(i + 1);
+        if(inside.empty() || uniform(random) < config.rural_fraction){
+            traveller.start.lat = config.bbox[0] + uniform(random) * (config.bbox[2] - config.bbox[0]);
+            traveller.start.lon = config.bbox[1] + uniform(random) * (config.bbox[3] - config.bbox[1]);
+        }
+        else{
+            const city& home = inside[chooseCity(random)];
+            // A city with 100000 inhabitants spreads by about 3 km
+            double sigma = 3.0 * std::sqrt(home.population / 100.0);
+            double north = normal(random) * sigma;
+            double east = normal(random) * sigma;
+            traveller.start.lat = home.center.lat + geo::degrees(north / geo::earthRadius);
+            traveller.start.lon = home.center.lon + geo::degrees(east / geo::earthRadius) / std::cos(geo::radians(home.center.lat));
+            traveller.name += " (" + home.name + ")";
+        }
+        traveller.driver = uniform(random) < config.driver_fraction;
+        if(traveller.driver){
+            traveller.capacity = config.capacity_weights.empty() ? 1 : chooseCapacity(random) + 1;
+            traveller.carClass = classNames.empty() ? "HBEFA4/PC_petrol_Euro-4" : classNames[chooseClass(random)];
+        }
+        result.push_back(traveller);
+    }
+    LOG_INFO("generator: created participants", "count", result.size(), "cities", inside.size());
+    return result;
+}
+@}
+
+The generator is a separate program which takes the number of participants as optional argument and otherwise uses the configuration. It writes the participants into the json file given as output or into the database if the output is \verb|database|. The json file can be used by the main program with \verb|participants_file| in the configuration.
+
+@O ../src/generate.cpp -d
+@{
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "database.h"
+#include "generator.h"
+#include "logger.h"
+
+int main(int argc, char** argv){
+    std::ifstream ifs_config("config.json");
+    nlohmann::json j_config = nlohmann::json::parse(ifs_config);
+    logger::instance().configure(j_config.value("log", nlohmann::json::object()));
+    generator participantGenerator(j_config.value("generator", nlohmann::json::object()));
+    unsigned int count = argc > 1 ? std::strtoul(argv[1], NULL, 10) : participantGenerator.count();
+    std::vector<participant> participants = participantGenerator.participants(count);
+    if(participantGenerator.output() == "database"){
+        database maindb(j_config.value("database", nlohmann::json::object()));
+        return maindb.insertParticipants(participants) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    std::ofstream output(participantGenerator.output());
+    output << nlohmann::json(participants).dump(1) << "\n";
+    if(!output){
+        LOG_ERROR("generator: could not write participants", "file", participantGenerator.output());
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("generator: wrote participants", "file", participantGenerator.output());
+    return EXIT_SUCCESS;
+}
+@}
@@ -0,0 +1,103 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{geo helpers}
+
+Small helpers for distances on the earth surface. We use the haversine formula on a sphere, which is accurate enough for estimates (the error is below 0.5\%). Distances are returned in km as in the isoemission section.
+
+@O ../src/geo.h -d
+@{
+#ifndef GEO_HEADER
+#define GEO_HEADER
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "route.h"
+
+namespace geo {
+    const double earthRadius = 6371.0088;
+    const double pi = 3.14159265358979323846;
+
+    inline double radians(double degrees){
+        return degrees * pi / 180.0;
+    }
+
+    inline double degrees(double radians){
+        return radians * 180.0 / pi;
+    }
+
+    // Great circle distance in km
+    inline double haversine(const route::coordinate& a, const route::coordinate& b){
+        double dlat = radians(b.lat - a.lat);
+        double dlon = radians(b.lon - a.lon);
+        double h = std::sin(dlat/2) * std::sin(dlat/2) + std::cos(radians(a.lat)) * std::cos(radians(b.lat)) * std::sin(dlon/2) * std::sin(dlon/2);
+        return 2 * earthRadius * std::asin(std::sqrt(std::fmin(1.0, h)));
+    }
+
+    // Position reached from start after distance km in direction bearing (radians, clockwise from north)
+    inline route::coordinate destination(const route::coordinate& start, double bearing, double distance){
+        double angle = distance / earthRadius;
+        double lat1 = radians(start.lat), lon1 = radians(start.lon);
+        double lat2 = std::asin(std::sin(lat1) * std::cos(angle) + std::cos(lat1) * std::sin(angle) * std::cos(bearing));
+        double lon2 = lon1 + std::atan2(std::sin(bearing) * std::sin(angle) * std::cos(lat1), std::cos(angle) - std::sin(lat1) * std::sin(lat2));
+        return {degrees(lat2), std::remainder(degrees(lon2), 360.0)};
+    }
+
+    // Length of a path in km
+    inline double length(const std::vector<route::coordinate>& path){
+        double total = 0;
+        for(unsigned int i=1; i<path.size(); i++)
+            total += haversine(path[i-1], path[i]);
+        return total;
+    }
+
+    @<Decode polyline@>
+};
+
+#endif
+@}
+
+Motis sends the geometry of the legs as polylines in the format used by Google\footnote{\url{https://developers.google.com/maps/documentation/utilities/polylinealgorithm}}. Every value is the difference to the previous point multiplied by $10^\text{precision}$, zigzag encoded and written in chunks of five bits with an offset of 63 to get printable characters.
+
+@d Decode polyline
+@{inline std::vector<route::coordinate> decodePolyline(const std::string& points, int precision){
+    std::vector<route::coordinate> path;
+    const double factor = std::pow(10.0, -precision);
+    long long int lat = 0, lon = 0;
+    std::string::size_type i = 0;
+    auto next = [&points, &i](long long int& value) -> bool {
+        long long int result = 0;
+        int shift = 0;
+        int chunk;
+        do {
+            if(i >= points.size()) return false;
+            chunk = points[i++] - 63;
+            result |= (long long int)(chunk & 0x1f) << shift;
+            shift += 5;
+        } while(chunk >= 0x20);
+        value += (result & 1) ? ~(result >> 1) : (result >> 1);
+        return true;
+    };
+    while(i < points.size()){
+        if(!next(lat) || !next(lon)) break;
+        path.push_back({lat * factor, lon * factor});
+    }
+    return path;
+}
+@}
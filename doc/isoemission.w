@@ -311,3 +311,31 @@ plot [-250:550][-400:400] \
  '+' u (377):(0) t "Destination of route" w p ls 4
 @}
 
+
+\subsection{Evaluating the isoemission zone in C++}
+
+For the program we need the same functions as in the gnuplot script. They are put into a small header and use the same names, so $dd1$ gives $d'(d'')$ and $ddd0$ and $ddd1$ give the zero points of the zone on the axis of the route (equations \ref{eq:isonull2} and \ref{eq:isonull3}). All distances are in km and all emission factors in $\frac{g}{km}$.
+
+The zero points are also the largest reach of the zone: by the triangle inequality every pickup position inside the zone is at most $ddd0$ away from the start of the route and at most $d_\text{car} - ddd1$ away from the destination.
+
+@O ../src/isoemission.h -d
+@{
+#ifndef ISOEMISSION_HEADER
+#define ISOEMISSION_HEADER
+
+#include <cmath>
+
+namespace isoemissionzone {
+    inline double dd1(double d_doubledash, double n, double d_car, double e_car, double e_pt){
+        return @<Isoemission C++ equation 1@>;
+    }
+    inline double ddd0(double n, double d_car, double e_car, double e_pt){
+        return d_car*(2*e_car + e_pt*n - 2*e_pt)/(2*e_car - e_pt);
+    }
+    inline double ddd1(double n, double d_car, double e_car, double e_pt){
+        return -d_car*e_pt*n/(2*e_car - e_pt);
+    }
+};
+
+#endif
+@}
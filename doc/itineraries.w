@@ -0,0 +1,228 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{Compact itineraries}
+
+The structs of the motis api keep every name in its own \verb|std::string|. For thousands of public transport queries this means millions of small allocations for the same few values: the modes, the agencies, the names of the stations. For the $CO_2$ of the itineraries we convert the projected reply into compact structs instead. Their strings are views into an arena and each distinct string is stored there only once; the legs, the stops and the itineraries themselves are allocated from the same arena.
+
+An arena only grows: it hands out memory from blocks of \verb|block_bytes| and frees nothing until \verb|release|, which gives back all blocks in one go and forgets the interned strings. So everything read into an arena is valid until it is released. Each thread routing public transport has its own arena which is released after a batch of queries, once it holds more than a limit.
+
+@O ../src/itineraries.h -d
+@{
+#ifndef ITINERARIES_HEADER
+#define ITINERARIES_HEADER
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "route.h"
+
+namespace motis {
+
+class arena : public std::pmr::memory_resource {
+public:
+    arena(std::size_t blockBytes = 64 * 1024);
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    // The same text always gives the same view
+    std::string_view intern(std::string_view text);
+    // Copies text that is not worth interning, e.g. a geometry
+    std::string_view copy(std::string_view text);
+    // Frees all blocks at once, views and objects of the arena become invalid
+    void release(void);
+    std::size_t bytes(void) const;
+    std::size_t strings(void) const;
+private:
+    void* do_allocate(std::size_t size, std::size_t alignment) override;
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    std::size_t blockBytes;
+    std::vector<std::unique_ptr<char[]> > blocks;
+    char* position;
+    std::size_t left;
+    std::size_t used;
+    std::unordered_set<std::string_view> interned;
+};
+
+struct compactPlace {
+    std::string_view name;
+    double lat;
+    double lon;
+};
+
+struct compactLeg {
+    std::string_view mode;
+    std::string_view agencyName;
+    std::string_view agencyId;
+    std::string_view headsign;
+    std::string_view routeShortName;
+    compactPlace from;
+    compactPlace to;
+    long int duration;
+    double distance;
+    std::string_view geometry;
+    long int precision;
+    std::pmr::vector<route::coordinate> intermediateStops;
+};
+
+struct compactItinerary {
+    long int duration;
+    long int transfers;
+    std::pmr::vector<compactLeg> legs;
+};
+
+// Reads the itineraries of a (projected) plan reply into the arena
+std::pmr::vector<compactItinerary> itineraries(const nlohmann::json& reply, arena& memory);
+
+};
+
+#endif
+@}
+
+@O ../src/itineraries.cpp -d
+@{
+#include "itineraries.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace motis {
+
+arena::arena(std::size_t l_blockBytes):
+    blockBytes(l_blockBytes), position(nullptr), left(0), used(0)
+{
+}
+
+void* arena::do_allocate(std::size_t size, std::size_t alignment){
+    std::size_t padding = (alignment - reinterpret_cast<std::uintptr_t>(position) % alignment) % alignment;
+    if(!position || padding + size > left){
+        // Large requests get a block of their own
+        std::size_t bytes = std::max(blockBytes, size + alignment);
+        blocks.emplace_back(new char[bytes]);
+        position = blocks.back().get();
+        left = bytes;
+        padding = (alignment - reinterpret_cast<std::uintptr_t>(position) % alignment) % alignment;
+    }
+    char* result = position + padding;
+    position += padding + size;
+    left -= padding + size;
+    used += padding + size;
+    return result;
+}
+
+std::string_view arena::copy(std::string_view text){
+    if(text.empty()) return std::string_view();
+    char* data = static_cast<char*>(allocate(text.size(), 1));
+    std::memcpy(data, text.data(), text.size());
+    return std::string_view(data, text.size());
+}
+
+std::string_view arena::intern(std::string_view text){
+    auto known = interned.find(text);
+    if(known != interned.end())
+        return *known;
+    std::string_view stored = copy(text);
+    interned.insert(stored);
+    return stored;
+}
+
+void arena::release(void){
+    interned.clear();
+    blocks.clear();
+    position = nullptr;
+    left = 0;
+    used = 0;
+}
+
+std::size_t arena::bytes(void) const{
+    return used;
+}
+
+std::size_t arena::strings(void) const{
+    return interned.size();
+}
+@}
+
+The conversion reads the same fields as the structs of the api, missing ones get the same defaults.
+
+@O ../src/itineraries.cpp -d
+@{
+static std::string_view text(const nlohmann::json& object, const char* key, arena& memory){
+    auto value = object.find(key);
+    if(value == object.end() || !value->is_string()) return std::string_view();
+    return memory.intern(value->get_ref<const std::string&>());
+}
+
+template<typename T> static T number(const nlohmann::json& object, const char* key, T fallback = 0){
+    auto value = object.find(key);
+    if(value == object.end() || !value->is_number()) return fallback;
+    return value->get<T>();
+}
+
+static compactPlace place(const nlohmann::json& reply, const char* key, arena& memory){
+    auto value = reply.find(key);
+    if(value == reply.end() || !value->is_object()) return {std::string_view(), 0, 0};
+    return {text(*value, "name", memory), number<double>(*value, "lat"), number<double>(*value, "lon")};
+}
+
+std::pmr::vector<compactItinerary> itineraries(const nlohmann::json& reply, arena& memory){
+    std::pmr::vector<compactItinerary> result(&memory);
+    auto j_itineraries = reply.find("itineraries");
+    if(j_itineraries == reply.end() || !j_itineraries->is_array()) return result;
+    result.reserve(j_itineraries->size());
+    for(const auto& j_itinerary: *j_itineraries){
+        result.push_back({number<long int>(j_itinerary, "duration"), number<long int>(j_itinerary, "transfers"), std::pmr::vector<compactLeg>(&memory)});
+        auto j_legs = j_itinerary.find("legs");
+        if(j_legs == j_itinerary.end() || !j_legs->is_array()) continue;
+        std::pmr::vector<compactLeg>& legs = result.back().legs;
+        legs.reserve(j_legs->size());
+        for(const auto& j_leg: *j_legs){
+            compactLeg leg{text(j_leg, "mode", memory), text(j_leg, "agencyName", memory), text(j_leg, "agencyId", memory),
+                text(j_leg, "headsign", memory), text(j_leg, "routeShortName", memory),
+                place(j_leg, "from", memory), place(j_leg, "to", memory),
+                number<long int>(j_leg, "duration"), number<double>(j_leg, "distance"), std::string_view(), 7,
+                std::pmr::vector<route::coordinate>(&memory)};
+            auto geometry = j_leg.find("legGeometry");
+            if(geometry != j_leg.end() && geometry->is_object()){
+                auto points = geometry->find("points");
+                if(points != geometry->end() && points->is_string())
+                    leg.geometry = memory.copy(points->get_ref<const std::string&>());
+                leg.precision = number<long int>(*geometry, "precision", 7);
+            }
+            auto stops = j_leg.find("intermediateStops");
+            if(stops != j_leg.end() && stops->is_array()){
+                leg.intermediateStops.reserve(stops->size());
+                for(const auto& stop: *stops)
+                    leg.intermediateStops.push_back({number<double>(stop, "lat"), number<double>(stop, "lon")});
+            }
+            legs.push_back(std::move(leg));
+        }
+    }
+    return result;
+}
+
+};
+@}
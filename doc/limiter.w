@@ -0,0 +1,208 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{limiter class}
+
+Sending more requests at the same time to a router only helps until it is busy; after that the requests wait in the router and the latency goes up without more throughput, and at some point it answers with errors. The limiter finds the number of concurrent requests a router handles well by watching the replies, so nothing has to be tuned for the hardware the routers run on. Each url of the rest class has its own limiter.
+
+The limit is adapted like the congestion window of TCP (additive increase, multiplicative decrease) with the latency as signal as in TCP Vegas. The requests are looked at in round trips: a round trip is over when as many requests finished as the limit allows, but at least \verb|window| requests, as single latencies vary too much. The lowest average latency of a round trip seen recently is the baseline, the latency of a router that is not yet overloaded. If the average latency of a round trip is not more than \verb|tolerance| times the baseline, the limit grows by one, but only if it was actually used. If they were slower the limit shrinks by the factor \verb|decrease|. An error, a timeout or an answer with status 429 or 503 shrinks it at once by the factor \verb|backoff|, but only once per round trip, so one burst of errors counts once. The baseline is taken from the last \verb|probe_interval| requests only, so a router that became slower for good does not keep the limit down.
+
+Requests over the limit wait in a queue of at most \verb|queue| requests. If the queue is full the request is rejected at once; the caller gets it as a failed request and sees the pressure in \verb|co2carpool_rest_rejected_total|.
+
+@O ../src/limiter.h -d
+@{
+#ifndef LIMITER_CLASS
+#define LIMITER_CLASS
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "metrics.h"
+
+class limiter {
+public:
+    limiter(const std::string& name, const nlohmann::json& config);
+    // Runs start now or as soon as the limit allows, false if the queue is full
+    bool acquire(std::function<void(void)> start);
+    // Reports the end of a request started by acquire, without a latency sample if it was not measured
+    void release(double seconds, bool overloaded, bool measured = true);
+    unsigned int limit(void) const;
+    unsigned int inFlight(void) const;
+    std::size_t queued(void) const;
+private:
+    void changed(const char* reason);
+    struct cfg {
+        cfg() : initial(8), min(1), max(256), queue(1024), window(10), tolerance(1.5), decrease(0.9), backoff(0.5), probe_interval(200){};
+        unsigned int initial;
+        unsigned int min;
+        unsigned int max;
+        unsigned int queue;
+        unsigned int window;
+        double tolerance;
+        double decrease;
+        double backoff;
+        unsigned int probe_interval;
+    } config;
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, initial, min, max, queue, window, tolerance, decrease, backoff, probe_interval);
+    std::string name;
+    metrics::counter& rejected;
+    metrics::histogram& queueSeconds;
+    mutable std::mutex limitMutex;
+    double currentLimit;
+    unsigned int running;
+    unsigned int maxRunning;
+    // Requests finished in the current round trip and their latency
+    unsigned int finished;
+    double windowSeconds;
+    unsigned int windowCount;
+    bool backedOff;
+    unsigned int sinceProbe;
+    double minSeconds;
+    double probeSeconds;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::function<void(void)> > > waiting;
+};
+
+#endif
+@}
+
+@O ../src/limiter.cpp -d
+@{
+#include "limiter.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+limiter::limiter(const std::string& l_name, const nlohmann::json& l_config):
+    config(l_config), name(l_name),
+    rejected(metrics::instance().getCounter("co2carpool_rest_rejected_total", "Requests rejected because the queue of the router was full", {{"url", l_name}})),
+    queueSeconds(metrics::instance().getHistogram("co2carpool_rest_queue_seconds", "Time requests waited for the concurrency limit", {{"url", l_name}})),
+    running(0), maxRunning(0), finished(0), windowSeconds(0), windowCount(0), backedOff(false), sinceProbe(0),
+    minSeconds(std::numeric_limits<double>::infinity()), probeSeconds(std::numeric_limits<double>::infinity())
+{
+    config.min = std::max(1u, config.min);
+    config.max = std::max(config.min, config.max);
+    currentLimit = std::clamp<double>(config.initial, config.min, config.max);
+    LOG_INFO("limiter: adaptive concurrency", "url", name, "limit", currentLimit, "max", config.max, "queue", config.queue);
+}
+
+bool limiter::acquire(std::function<void(void)> start){
+    {
+        std::lock_guard<std::mutex> lock(limitMutex);
+        if(running >= static_cast<unsigned int>(currentLimit)){
+            if(waiting.size() >= config.queue){
+                rejected.add();
+                return false;
+            }
+            waiting.push_back({std::chrono::steady_clock::now(), start});
+            return true;
+        }
+        running++;
+        maxRunning = std::max(maxRunning, running);
+    }
+    start();
+    return true;
+}
+@}
+
+On release the limit is adapted and as many waiting requests are started as the new limit allows. A request that was aborted on purpose, like the loser of a hedge, gives back its slot but is neither a latency sample nor part of the round trip. They are started after the lock is given back, as starting a request may take a while.
+
+@O ../src/limiter.cpp -d
+@{
+void limiter::release(double seconds, bool overloaded, bool measured){
+    std::vector<std::function<void(void)> > starts;
+    {
+        std::lock_guard<std::mutex> lock(limitMutex);
+        running--;
+        if(overloaded && !backedOff){
+            currentLimit = std::max<double>(config.min, currentLimit * config.backoff);
+            backedOff = true;
+            changed("overloaded");
+        }
+        if(!overloaded && measured){
+            windowSeconds += seconds;
+            windowCount++;
+        }
+        // One round trip is over when as many requests finished as the limit allows
+        if(measured && ++finished >= std::max<unsigned int>(currentLimit, config.window)){
+            double average = windowCount > 0 ? windowSeconds / windowCount : 0;
+            if(windowCount > 0){
+                probeSeconds = std::min(probeSeconds, average);
+                minSeconds = std::min(minSeconds, average);
+                sinceProbe += windowCount;
+                if(sinceProbe >= config.probe_interval){
+                    minSeconds = probeSeconds;
+                    probeSeconds = std::numeric_limits<double>::infinity();
+                    sinceProbe = 0;
+                }
+            }
+            if(!backedOff && windowCount > 0 && average > minSeconds * config.tolerance){
+                currentLimit = std::max<double>(config.min, currentLimit * config.decrease);
+                changed("latency");
+            }
+            else if(!backedOff && windowCount > 0 && maxRunning >= static_cast<unsigned int>(currentLimit) && currentLimit < config.max){
+                currentLimit = std::min<double>(config.max, currentLimit + 1);
+                changed("increase");
+            }
+            finished = 0;
+            windowSeconds = 0;
+            windowCount = 0;
+            backedOff = false;
+            maxRunning = running;
+        }
+        auto now = std::chrono::steady_clock::now();
+        while(!waiting.empty() && running < static_cast<unsigned int>(currentLimit)){
+            queueSeconds.observe(std::chrono::duration<double>(now - waiting.front().first).count());
+            starts.push_back(waiting.front().second);
+            waiting.pop_front();
+            running++;
+        }
+        maxRunning = std::max(maxRunning, running);
+    }
+    for(auto& start: starts)
+        start();
+}
+
+void limiter::changed(const char* reason){
+    metrics::instance().getCounter("co2carpool_rest_limit_changes_total", "Changes of the concurrency limit of the routers", {{"url", name}, {"reason", reason}}).add();
+    metrics::instance().getHistogram("co2carpool_rest_concurrency_limit", "Concurrency limit of the routers after each change", {{"url", name}}, {1, 2, 4, 8, 16, 32, 64, 128, 256, 512}).observe(currentLimit);
+    LOG_DEBUG("limiter: new limit", "url", name, "limit", currentLimit, "reason", reason, "min_latency_s", minSeconds);
+}
+
+unsigned int limiter::limit(void) const{
+    std::lock_guard<std::mutex> lock(limitMutex);
+    return static_cast<unsigned int>(currentLimit);
+}
+
+unsigned int limiter::inFlight(void) const{
+    std::lock_guard<std::mutex> lock(limitMutex);
+    return running;
+}
+
+std::size_t limiter::queued(void) const{
+    std::lock_guard<std::mutex> lock(limitMutex);
+    return waiting.size();
+}
+@}
@@ -0,0 +1,240 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{listener class}
+
+For planning incrementally we need to know which participants changed. Instead of reading the whole table again and again, a trigger on \verb|participants| (see the schema migrations) sends a notification with the id of every inserted, updated or deleted participant on the channel \verb|participants_changed|.
+
+The listener waits for these notifications on its own connection and thread, as a connection which listens can not be used for queries from the pool. Changes often come in bursts, for example when a whole list of participants is imported, so the ids are collected for \verb|debounce_ms| after the first notification and then handed over together as one task to the scheduler. If the connection is lost the listener reconnects and, because notifications may have been missed in between, hands over an empty list which means that everything has to be read again. Changes the program wrote itself through the database pool, e.g. the participants of a \verb|POST /plan|, are already planned; their notifications are recognised by the process id of the sending server backend and dropped.
+
+The listener uses the \verb|database| section of the configuration:
+
+\begin{lstlisting}
+"database": { "conninfo": "dbname = co2carpool", "listen": true, "debounce_ms": 200 }
+\end{lstlisting}
+
+@O ../src/listener.h -d
+@{
+#ifndef LISTENER_CLASS
+#define LISTENER_CLASS
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "libpq-fe.h"
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "scheduler.h"
+#include "task.h"
+
+class listener {
+public:
+    // Called on the scheduler with the changed ids, an empty list if all may have changed
+    typedef std::function<void(const std::vector<unsigned int>&)> callback;
+    // Notifications sent by a server process for which ignored is true are dropped
+    listener(const nlohmann::json& config, scheduler& workers, callback changed, std::function<bool(int)> ignored = nullptr);
+    ~listener(void);
+    bool listening(void) const;
+private:
+    class changeTask : public task {
+    public:
+        changeTask(const std::vector<unsigned int>& ids, callback changed, unsigned int priority);
+        virtual bool isCompleted(void) const override;
+        virtual unsigned int priority(void) const override;
+        virtual void execute(void) override;
+    private:
+        std::vector<unsigned int> ids;
+        callback changed;
+        unsigned int prio;
+        bool completed;
+    };
+    bool connect(void);
+    void run(void);
+    void handOver(std::vector<unsigned int>& ids);
+    struct cfg {
+        cfg() : conninfo("dbname = co2carpool"), channel("participants_changed"), debounce_ms(200), priority(1){};
+        std::string conninfo;
+        std::string channel;
+        unsigned int debounce_ms;
+        unsigned int priority;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, conninfo, channel, debounce_ms, priority);
+    } config;
+    scheduler& workers;
+    callback changed;
+    std::function<bool(int)> ignored;
+    PGconn* connection;
+    std::atomic<bool> connected;
+    std::atomic<bool> stopping;
+    int wakeFds[2];
+    std::thread thread;
+};
+
+#endif
+@}
+
+@O ../src/listener.cpp -d
+@{
+#include <algorithm>
+#include <chrono>
+#include <poll.h>
+#include <unistd.h>
+
+#include "listener.h"
+#include "logger.h"
+#include "metrics.h"
+
+listener::changeTask::changeTask(const std::vector<unsigned int>& l_ids, callback l_changed, unsigned int l_priority):
+    ids(l_ids), changed(l_changed), prio(l_priority), completed(false)
+{
+}
+
+bool listener::changeTask::isCompleted(void) const{
+    return completed;
+}
+
+unsigned int listener::changeTask::priority(void) const{
+    return prio;
+}
+
+void listener::changeTask::execute(void){
+    changed(ids);
+    completed = true;
+}
+
+listener::listener(const nlohmann::json& l_config, scheduler& l_workers, callback l_changed, std::function<bool(int)> l_ignored):
+    config(l_config), workers(l_workers), changed(l_changed), ignored(l_ignored), connection(nullptr), connected(false), stopping(false)
+{
+    wakeFds[0] = wakeFds[1] = -1;
+    if(::pipe(wakeFds) != 0){
+        LOG_ERROR("listener: creating wake up pipe failed");
+        return;
+    }
+    connect();
+    thread = std::thread(&listener::run, this);
+}
+
+listener::~listener(void){
+    stopping = true;
+    if(thread.joinable()){
+        char byte = 0;
+        ssize_t written = ::write(wakeFds[1], &byte, 1);
+        (void)written;
+        thread.join();
+    }
+    for(int fd: wakeFds)
+        if(fd >= 0)
+            ::close(fd);
+    if(connection)
+        PQfinish(connection);
+}
+
+bool listener::listening(void) const{
+    return connected;
+}
+
+bool listener::connect(void){
+    if(!connection)
+        connection = PQconnectdb(config.conninfo.c_str());
+    else
+        PQreset(connection);
+    connected = false;
+    if(PQstatus(connection) != CONNECTION_OK){
+        LOG_ERROR("listener: connecting failed", "error", PQerrorMessage(connection));
+        return false;
+    }
+    char* channel = PQescapeIdentifier(connection, config.channel.c_str(), config.channel.size());
+    PGresult* result = PQexec(connection, (std::string("LISTEN ") + channel).c_str());
+    PQfreemem(channel);
+    bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+    if(!ok){
+        LOG_ERROR("listener: LISTEN failed", "channel", config.channel, "error", PQerrorMessage(connection));
+        return false;
+    }
+    LOG_INFO("listener: listening", "channel", config.channel);
+    connected = true;
+    return true;
+}
+
+void listener::handOver(std::vector<unsigned int>& ids){
+    static metrics::counter& notifications = metrics::instance().getCounter("co2carpool_database_notifications_total", "Participant changes received from the database");
+    notifications.add(ids.size());
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    LOG_DEBUG("listener: participants changed", "count", ids.size());
+    workers.submit(std::make_shared<changeTask>(ids, changed, config.priority));
+    ids.clear();
+}
+@}
+
+The thread waits on the socket of the connection and on the wake up pipe. While ids are collected the wait is limited to the rest of the debounce time.
+
+@O ../src/listener.cpp -d
+@{
+void listener::run(void){
+    static metrics::counter& ignoredNotifications = metrics::instance().getCounter("co2carpool_database_notifications_ignored_total", "Participant changes dropped because the program made them itself");
+    std::vector<unsigned int> ids;
+    std::chrono::steady_clock::time_point deadline;
+    while(!stopping){
+        if(!connected){
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if(!stopping && connect()){
+                ids.clear();
+                handOver(ids);
+            }
+            continue;
+        }
+        int timeout = -1;
+        if(!ids.empty()){
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            timeout = std::max<long long int>(0, left);
+        }
+        struct pollfd fds[2] = {
+            {PQsocket(connection), POLLIN, 0},
+            {wakeFds[0], POLLIN, 0}
+        };
+        if(::poll(fds, 2, timeout) < 0)
+            continue;
+        if(fds[0].revents & (POLLIN | POLLERR | POLLHUP)){
+            if(!PQconsumeInput(connection) || PQstatus(connection) != CONNECTION_OK){
+                LOG_WARNING("listener: connection lost", "error", PQerrorMessage(connection));
+                connected = false;
+                continue;
+            }
+            while(PGnotify* notification = PQnotifies(connection)){
+                if(ignored && ignored(notification->be_pid)){
+                    ignoredNotifications.add();
+                    PQfreemem(notification);
+                    continue;
+                }
+                if(ids.empty())
+                    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(config.debounce_ms);
+                char* end;
+                unsigned long int id = std::strtoul(notification->extra, &end, 10);
+                if(end != notification->extra)
+                    ids.push_back(id);
+                PQfreemem(notification);
+            }
+        }
+        if(!ids.empty() && std::chrono::steady_clock::now() >= deadline)
+            handOver(ids);
+    }
+}
+@}
@@ -0,0 +1,342 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{logger class}
+
+Printing with \verb|std::cout| in the routing functions becomes a bottleneck when thousands of routes are calculated, as every line is written synchronously to the terminal. The logger formats a message directly into a slot of a lock-free ring buffer and a background thread writes the slots to the output in batches.
+
+Messages have a level and optional structured fields which are given as key value pairs after the message:
+
+\begin{lstlisting}
+LOG_DEBUG("rest: post request", "url", url, "bytes", resultString.size());
+\end{lstlisting}
+
+The arguments are only evaluated if the level is enabled at runtime. Levels below \verb|CO2CARPOOL_LOG_LEVEL| (0 debug, 1 info, 2 warning, 3 error) are removed completely by the preprocessor, so debug messages in hot loops cost nothing in such a build. If the ring buffer is full the message is dropped instead of blocking the caller and the writer reports the number of dropped messages.
+
+The configuration selects the level at runtime and optionally a file instead of standard output:
+
+\begin{lstlisting}
+"log": { "level": "info", "file": "" }
+\end{lstlisting}
+
+@O ../src/logger.h -d
+@{
+#ifndef LOGGER_CLASS
+#define LOGGER_CLASS
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#ifndef CO2CARPOOL_LOG_LEVEL
+#define CO2CARPOOL_LOG_LEVEL 0
+#endif
+
+class logger {
+public:
+    enum class level : int { debug = 0, info = 1, warning = 2, error = 3 };
+    static logger& instance(void);
+    static bool enabled(level messageLevel){
+        return static_cast<int>(messageLevel) >= runtimeLevel.load(std::memory_order_relaxed);
+    }
+    void configure(const nlohmann::json& config);
+    // Blocks until everything logged so far is written
+    void flush(void);
+    template<typename... Fields>
+    void write(level messageLevel, const char* message, const Fields&... fields){
+        static_assert(sizeof...(Fields) % 2 == 0, "fields have to be key value pairs");
+        slot* entry = acquire();
+        if(!entry){
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        entry->messageLevel = messageLevel;
+        entry->time = std::chrono::system_clock::now();
+        char* pos = entry->text.data();
+        char* end = pos + entry->text.size() - 1;
+        pos = append(pos, end, message);
+        appendFields(pos, end, fields...);
+        *pos = '\0';
+        publish(entry);
+    }
+    ~logger(void);
+private:
+    static const std::size_t capacity = 4096;
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        level messageLevel;
+        std::chrono::system_clock::time_point time;
+        std::array<char, 480> text;
+    };
+    logger(void);
+    slot* acquire(void);
+    void publish(slot* entry);
+    void writer(void);
+    std::size_t drain(void);
+
+    static char* append(char* pos, char* end, const char* value);
+    static char* append(char* pos, char* end, std::string_view value);
+    static char* append(char* pos, char* end, bool value);
+    static char* append(char* pos, char* end, double value);
+    static char* append(char* pos, char* end, long long int value);
+    static char* append(char* pos, char* end, unsigned long long int value);
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, char*>::type append(char* pos, char* end, T value){
+        return append(pos, end, static_cast<long long int>(value));
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value, char*>::type append(char* pos, char* end, T value){
+        return append(pos, end, static_cast<unsigned long long int>(value));
+    }
+    static char* append(char* pos, char* end, float value){
+        return append(pos, end, static_cast<double>(value));
+    }
+    static void appendFields(char*&, char*){
+    }
+    template<typename Key, typename Value, typename... Fields>
+    static void appendFields(char*& pos, char* end, const Key& key, const Value& value, const Fields&... fields){
+        pos = append(pos, end, " ");
+        pos = append(pos, end, key);
+        pos = append(pos, end, "=");
+        pos = append(pos, end, value);
+        appendFields(pos, end, fields...);
+    }
+
+    static std::atomic<int> runtimeLevel;
+    std::array<slot, capacity> slots;
+    std::atomic<std::size_t> enqueuePos;
+    std::size_t dequeuePos;
+    std::atomic<unsigned long int> dropped;
+    std::atomic<std::size_t> written;
+    std::atomic<bool> running;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    FILE* output;
+    std::thread writerThread;
+};
+
+#define CO2CARPOOL_LOG(messageLevel, ...) do { if(logger::enabled(messageLevel)) logger::instance().write(messageLevel, __VA_ARGS__); } while(0)
+
+#if CO2CARPOOL_LOG_LEVEL <= 0
+#define LOG_DEBUG(...) CO2CARPOOL_LOG(logger::level::debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while(0)
+#endif
+
+#if CO2CARPOOL_LOG_LEVEL <= 1
+#define LOG_INFO(...) CO2CARPOOL_LOG(logger::level::info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while(0)
+#endif
+
+#if CO2CARPOOL_LOG_LEVEL <= 2
+#define LOG_WARNING(...) CO2CARPOOL_LOG(logger::level::warning, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) do {} while(0)
+#endif
+
+#define LOG_ERROR(...) CO2CARPOOL_LOG(logger::level::error, __VA_ARGS__)
+
+#endif
+@}
+
+The ring buffer follows the bounded queue by Dmitry Vyukov\footnote{\url{https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue}}: every slot has a sequence number which tells producers and the consumer whether the slot is free or filled. Producers claim a slot with a compare and swap on the enqueue position, there is only a single consumer (the writer thread). The writer does not get notified by the producers, it wakes up every few milliseconds and writes everything which is there with a single flush.
+
+@O ../src/logger.cpp -d
+@{
+#include "logger.h"
+
+#include <algorithm>
+#include <ctime>
+#include <map>
+
+std::atomic<int> logger::runtimeLevel(static_cast<int>(logger::level::info));
+
+logger& logger::instance(void){
+    static logger theLogger;
+    return theLogger;
+}
+
+logger::logger(void):
+    enqueuePos(0), dequeuePos(0), dropped(0), written(0), running(true), output(stdout)
+{
+    for(std::size_t i=0; i<capacity; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    writerThread = std::thread(&logger::writer, this);
+}
+
+logger::~logger(void){
+    running = false;
+    wake.notify_one();
+    writerThread.join();
+    if(output != stdout)
+        fclose(output);
+}
+
+void logger::configure(const nlohmann::json& config){
+    static const std::map<std::string, level> levels = {
+        {"debug", level::debug}, {"info", level::info}, {"warning", level::warning}, {"error", level::error}
+    };
+    auto configuredLevel = levels.find(config.value("level", "info"));
+    if(configuredLevel != levels.end())
+        runtimeLevel = static_cast<int>(configuredLevel->second);
+    std::string file = config.value("file", "");
+    if(!file.empty()){
+        FILE* logFile = fopen(file.c_str(), "a");
+        if(!logFile){
+            LOG_ERROR("logger: could not open log file", "file", file);
+            return;
+        }
+        flush();
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        if(output != stdout)
+            fclose(output);
+        output = logFile;
+    }
+}
+
+logger::slot* logger::acquire(void){
+    std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for(;;){
+        slot* entry = &slots[pos % capacity];
+        std::size_t sequence = entry->sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t difference = (std::ptrdiff_t)sequence - (std::ptrdiff_t)pos;
+        if(difference == 0){
+            if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                return entry;
+        }
+        else if(difference < 0)
+            return nullptr;
+        else
+            pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+}
+
+void logger::publish(slot* entry){
+    std::size_t pos = entry->sequence.load(std::memory_order_relaxed);
+    entry->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void logger::flush(void){
+    std::size_t target = enqueuePos.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(wakeMutex);
+    wake.notify_one();
+    drained.wait(lock, [this, target]{ return written.load() >= target || !running; });
+}
+@}
+
+The writer formats the time stamp and the level in front of the message.
+
+@O ../src/logger.cpp -d
+@{
+std::size_t logger::drain(void){
+    static const char* levelNames[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+    std::size_t count = 0;
+    for(;;){
+        slot* entry = &slots[dequeuePos % capacity];
+        if(entry->sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+            break;
+        std::time_t seconds = std::chrono::system_clock::to_time_t(entry->time);
+        long int milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(entry->time.time_since_epoch()).count() % 1000;
+        std::tm utc;
+        gmtime_r(&seconds, &utc);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        fprintf(output, "%s.%03ldZ %-7s %s\n", stamp, milliseconds, levelNames[static_cast<int>(entry->messageLevel)], entry->text.data());
+        entry->sequence.store(dequeuePos + capacity, std::memory_order_release);
+        dequeuePos++;
+        count++;
+    }
+    unsigned long int lost = dropped.exchange(0, std::memory_order_relaxed);
+    if(lost > 0)
+        fprintf(output, "logger: dropped %lu messages, ring buffer was full\n", lost);
+    if(count > 0 || lost > 0)
+        fflush(output);
+    return count;
+}
+
+void logger::writer(void){
+    for(;;){
+        bool stop = !running.load();
+        std::size_t count;
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            count = drain();
+        }
+        written.fetch_add(count);
+        drained.notify_all();
+        if(stop)
+            break;
+        if(count == 0){
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            wake.wait_for(lock, std::chrono::milliseconds(5));
+        }
+    }
+}
+@}
+
+Formatting of the fields is kept simple, strings are quoted if they contain a space.
+
+@O ../src/logger.cpp -d
+@{
+char* logger::append(char* pos, char* end, const char* value){
+    while(*value && pos < end)
+        *pos++ = *value++;
+    return pos;
+}
+
+char* logger::append(char* pos, char* end, std::string_view value){
+    bool quote = value.empty() || value.find(' ') != std::string_view::npos;
+    if(quote && pos < end) *pos++ = '"';
+    for(char c: value){
+        if(pos >= end) break;
+        *pos++ = c;
+    }
+    if(quote && pos < end) *pos++ = '"';
+    return pos;
+}
+
+char* logger::append(char* pos, char* end, bool value){
+    return append(pos, end, value ? "true" : "false");
+}
+
+char* logger::append(char* pos, char* end, double value){
+    int length = snprintf(pos, end - pos + 1, "%g", value);
+    return length < 0 ? pos : std::min(pos + length, end);
+}
+
+char* logger::append(char* pos, char* end, long long int value){
+    int length = snprintf(pos, end - pos + 1, "%lld", value);
+    return length < 0 ? pos : std::min(pos + length, end);
+}
+
+char* logger::append(char* pos, char* end, unsigned long long int value){
+    int length = snprintf(pos, end - pos + 1, "%llu", value);
+    return length < 0 ? pos : std::min(pos + length, end);
+}
+@}
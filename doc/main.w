@@ -24,30 +24,99 @@ Shouldn't be exciting.
 #include <iostream>
 #include <memory>
 
+#include "bulkwriter.h"
 #include "database.h"
+#include "listener.h"
 #include "rest.h"
 #include "locations.h"
+#include "logger.h"
+#include "metrics.h"
+#include "participant.h"
+#include "planner.h"
 #include "route.h"
+#include "scheduler.h"
+#include "server.h"
+#include "service.h"
 
 @}
 
 @O ../src/main.cpp -d
 @{
 #include "main.h"
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <fstream>
+#include <thread>
 
-int main(){
+static std::atomic<bool> running(true);
+
+static void stop(int){
+    running = false;
+}
+
+int main(int argc, char** argv){
     std::cout << "CO2 carpool\n";
     std::cout << "Load config file...";
     std::ifstream ifs_config("config.json");
     nlohmann::json j_config = nlohmann::json::parse(ifs_config);
     std::cout << " ok!\n";
+    logger::instance().configure(j_config.value("log", nlohmann::json::object()));
+    metrics::instance().configure(j_config.value("metrics", nlohmann::json::object()));
 
-    database maindb = database();
+    scheduler workers(j_config.value("scheduler", nlohmann::json::object()));
+    std::shared_ptr<database> maindb = std::make_shared<database>(j_config.value("database", nlohmann::json::object()), workers.workers());
     std::shared_ptr<rest> restApi = std::make_shared<rest>(j_config["rest"]);
     //*restApi = j_config["rest"];
-    std::shared_ptr<task> cologne_gss_route = std::make_shared<route>(restApi, locations::cologne_central_station, locations::tuebingen_gss_school);
-    cologne_gss_route->execute();
+    std::vector<participant> participants = {
+        {1, "Cologne", true, 3, "HBEFA4/PC_petrol_Euro-4", locations::cologne_central_station},
+        {2, "Berlin central", true, 3, "HBEFA4/PC_petrol_Euro-4", locations::berlin_central_station},
+        {3, "Berlin east", false, 0, "", locations::berlin_east_station},
+        {4, "Berlin south cross", false, 0, "", locations::berlin_south_cross_station},
+        {5, "Stuttgart", false, 0, "", locations::stuttgart_central_station}
+    };
+    std::string participantsFile = j_config.value("participants_file", "");
+    if(!participantsFile.empty()){
+        std::ifstream ifs_participants(participantsFile);
+        participants = nlohmann::json::parse(ifs_participants).get<std::vector<participant> >();
+        LOG_INFO("main: read participants", "file", participantsFile, "count", participants.size());
+    }
+    bool stored = maindb->connected() && maindb->insertParticipants(participants);
+    planner eventPlanner(restApi, j_config, stored ? maindb : nullptr, &workers);
+    eventPlanner.plan(participants, locations::tuebingen_gss_school);
+    if(stored){
+        bulkwriter segmentWriter(*maindb, j_config.value("bulkwriter", nlohmann::json::object()));
+        unsigned int segmentId = 1;
+        for(const auto& pickup: eventPlanner.pickups())
+            if(!segmentWriter.addRouteSegment(segmentId++, participants[pickup.driver].id, participants[pickup.passenger].id, pickup.pickupRoute->path())){
+                LOG_WARNING("main: route segment ids exhausted, remaining pickups not stored", "pickups", eventPlanner.pickups().size());
+                break;
+            }
+    }
+    server api(j_config.value("server", nlohmann::json::object()), workers);
+    bool daemonMode = api.enabled() || (argc > 1 && std::string(argv[1]) == "--daemon");
+    bool listen = stored && j_config.value("database", nlohmann::json::object()).value("listen", false);
+    if(daemonMode || listen){
+        service planning(eventPlanner, stored ? maindb : nullptr, participants, locations::tuebingen_gss_school);
+        planning.serve(api);
+        if(daemonMode && !api.start())
+            return EXIT_FAILURE;
+        // Started only now, so no change task can be queued when returning above
+        std::unique_ptr<listener> changes;
+        if(listen)
+            changes.reset(new listener(j_config["database"], workers, [&planning](const std::vector<unsigned int>& ids){ planning.changed(ids); }, [maindb](int pid){ return maindb->ownBackend(pid); }));
+        std::signal(SIGINT, stop);
+        std::signal(SIGTERM, stop);
+        LOG_INFO("main: running until stopped", "server", daemonMode, "listen", listen);
+        while(running)
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        api.stop();
+        changes.reset();
+        // The queued tasks of the server and the listener use planning, which ends with this block
+        workers.wait();
+    }
+    workers.wait();
+    metrics::instance().write();
     return EXIT_SUCCESS;
 }
 @}
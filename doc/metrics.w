@@ -0,0 +1,358 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{metrics class}
+
+To see where the time goes (curl, json parsing, conversion into our structs, $CO_2$ calculation or the database) the stages are instrumented with counters and histograms. A \verb|scopedTimer| measures the time of a block and adds it to a histogram; if tracing is switched on it also records the block as an event for the Chrome trace viewer (\verb|chrome://tracing| or \url{https://ui.perfetto.dev}).
+
+Looking up a metric takes a lock, so in hot functions the reference should be looked up once and kept. Recording a value is only an atomic add.
+
+At the end the metrics are written as a Prometheus text file and the trace as Chrome trace json if configured:
+
+\begin{lstlisting}
+"metrics": {
+  "prometheus_file": "co2carpool.prom",
+  "trace_file": "co2carpool-trace.json"
+}
+\end{lstlisting}
+
+Tracing is only active if \verb|trace_file| is set. To limit the memory at most \verb|max_trace_events| events (default one million) are kept.
+
+@O ../src/metrics.h -d
+@{
+#ifndef METRICS_CLASS
+#define METRICS_CLASS
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+class metrics {
+public:
+    typedef std::vector<std::pair<std::string, std::string> > labels;
+    typedef std::chrono::steady_clock clock;
+    class counter {
+    public:
+        counter(void) : value(0){};
+        void add(unsigned long long int amount = 1){
+            value.fetch_add(amount, std::memory_order_relaxed);
+        }
+        unsigned long long int get(void) const{
+            return value.load(std::memory_order_relaxed);
+        }
+    private:
+        std::atomic<unsigned long long int> value;
+    };
+    class histogram {
+    public:
+        histogram(const std::vector<double>& bounds);
+        void observe(double value);
+        const std::vector<double>& bounds(void) const;
+        // Cumulative counts for each bound and +Inf
+        std::vector<unsigned long long int> buckets(void) const;
+        unsigned long long int count(void) const;
+        double sum(void) const;
+    private:
+        std::vector<double> upperBounds;
+        std::unique_ptr<std::atomic<unsigned long long int>[]> bucketCounts;
+        std::atomic<unsigned long long int> total;
+        std::atomic<double> valueSum;
+    };
+    class scopedTimer {
+    public:
+        scopedTimer(histogram& target, const char* traceName, const char* traceCategory = "co2carpool");
+        ~scopedTimer(void);
+        double elapsed(void) const;
+    private:
+        histogram& target;
+        const char* traceName;
+        const char* traceCategory;
+        clock::time_point start;
+    };
+    static const std::vector<double> latencyBuckets;
+    static const std::vector<double> sizeBuckets;
+
+    static metrics& instance(void);
+    void configure(const nlohmann::json& config);
+    counter& getCounter(const std::string& name, const std::string& help, const labels& metricLabels = {});
+    histogram& getHistogram(const std::string& name, const std::string& help, const labels& metricLabels = {}, const std::vector<double>& bounds = latencyBuckets);
+    bool tracing(void) const{
+        return traceEnabled.load(std::memory_order_relaxed);
+    }
+    void trace(const char* name, const char* category, clock::time_point start, clock::time_point end);
+    // Write to the files given in the configuration
+    void write(void);
+    void writePrometheus(const std::string& file);
+    void writeChromeTrace(const std::string& file);
+private:
+    metrics(void);
+    struct family {
+        std::string help;
+        std::string type;
+        std::map<labels, std::unique_ptr<counter> > counters;
+        std::map<labels, std::unique_ptr<histogram> > histograms;
+    };
+    struct traceEvent {
+        std::string name;
+        const char* category;
+        long long int start;
+        long long int duration;
+    };
+    struct traceBuffer {
+        std::mutex lock;
+        unsigned int thread;
+        std::vector<traceEvent> events;
+    };
+    traceBuffer& threadBuffer(void);
+    std::mutex lock;
+    std::map<std::string, family> families;
+    std::vector<std::shared_ptr<traceBuffer> > traceBuffers;
+    std::atomic<bool> traceEnabled;
+    std::atomic<unsigned long int> traceEvents;
+    unsigned long int maxTraceEvents;
+    clock::time_point epoch;
+    std::string prometheusFile;
+    std::string traceFile;
+};
+
+#endif
+@}
+
+@O ../src/metrics.cpp -d
+@{
+#include "metrics.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+const std::vector<double> metrics::latencyBuckets = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+const std::vector<double> metrics::sizeBuckets = {256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216};
+
+metrics::histogram::histogram(const std::vector<double>& bounds):
+    upperBounds(bounds), bucketCounts(new std::atomic<unsigned long long int>[bounds.size() + 1]), total(0), valueSum(0)
+{
+    for(unsigned int i=0; i<=upperBounds.size(); i++)
+        bucketCounts[i].store(0);
+}
+
+void metrics::histogram::observe(double value){
+    unsigned int i = std::lower_bound(upperBounds.begin(), upperBounds.end(), value) - upperBounds.begin();
+    bucketCounts[i].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    double current = valueSum.load(std::memory_order_relaxed);
+    while(!valueSum.compare_exchange_weak(current, current + value, std::memory_order_relaxed));
+}
+
+const std::vector<double>& metrics::histogram::bounds(void) const{
+    return upperBounds;
+}
+
+std::vector<unsigned long long int> metrics::histogram::buckets(void) const{
+    std::vector<unsigned long long int> cumulative(upperBounds.size() + 1);
+    unsigned long long int running = 0;
+    for(unsigned int i=0; i<=upperBounds.size(); i++){
+        running += bucketCounts[i].load(std::memory_order_relaxed);
+        cumulative[i] = running;
+    }
+    return cumulative;
+}
+
+unsigned long long int metrics::histogram::count(void) const{
+    return total.load(std::memory_order_relaxed);
+}
+
+double metrics::histogram::sum(void) const{
+    return valueSum.load(std::memory_order_relaxed);
+}
+
+metrics::scopedTimer::scopedTimer(histogram& l_target, const char* l_traceName, const char* l_traceCategory):
+    target(l_target), traceName(l_traceName), traceCategory(l_traceCategory), start(clock::now())
+{
+}
+
+metrics::scopedTimer::~scopedTimer(void){
+    clock::time_point end = clock::now();
+    target.observe(std::chrono::duration<double>(end - start).count());
+    metrics& registry = metrics::instance();
+    if(registry.tracing())
+        registry.trace(traceName, traceCategory, start, end);
+}
+
+double metrics::scopedTimer::elapsed(void) const{
+    return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+metrics& metrics::instance(void){
+    static metrics theMetrics;
+    return theMetrics;
+}
+
+metrics::metrics(void):
+    traceEnabled(false), traceEvents(0), maxTraceEvents(1000000), epoch(clock::now())
+{
+}
+
+void metrics::configure(const nlohmann::json& config){
+    std::lock_guard<std::mutex> guard(lock);
+    prometheusFile = config.value("prometheus_file", "");
+    traceFile = config.value("trace_file", "");
+    maxTraceEvents = config.value("max_trace_events", 1000000ul);
+    traceEnabled = !traceFile.empty();
+}
+
+metrics::counter& metrics::getCounter(const std::string& name, const std::string& help, const labels& metricLabels){
+    std::lock_guard<std::mutex> guard(lock);
+    family& metricFamily = families[name];
+    metricFamily.help = help;
+    metricFamily.type = "counter";
+    std::unique_ptr<counter>& metric = metricFamily.counters[metricLabels];
+    if(!metric)
+        metric.reset(new counter());
+    return *metric;
+}
+
+metrics::histogram& metrics::getHistogram(const std::string& name, const std::string& help, const labels& metricLabels, const std::vector<double>& bounds){
+    std::lock_guard<std::mutex> guard(lock);
+    family& metricFamily = families[name];
+    metricFamily.help = help;
+    metricFamily.type = "histogram";
+    std::unique_ptr<histogram>& metric = metricFamily.histograms[metricLabels];
+    if(!metric)
+        metric.reset(new histogram(bounds));
+    return *metric;
+}
+@}
+
+Every thread writes trace events into its own buffer, the lock of the buffer is only contended while the trace is written out.
+
+@O ../src/metrics.cpp -d
+@{
+metrics::traceBuffer& metrics::threadBuffer(void){
+    thread_local std::shared_ptr<traceBuffer> buffer;
+    if(!buffer){
+        buffer = std::make_shared<traceBuffer>();
+        std::lock_guard<std::mutex> guard(lock);
+        buffer->thread = traceBuffers.size() + 1;
+        traceBuffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+void metrics::trace(const char* name, const char* category, clock::time_point start, clock::time_point end){
+    if(traceEvents.fetch_add(1, std::memory_order_relaxed) >= maxTraceEvents)
+        return;
+    traceBuffer& buffer = threadBuffer();
+    std::lock_guard<std::mutex> guard(buffer.lock);
+    buffer.events.push_back({name, category,
+            std::chrono::duration_cast<std::chrono::microseconds>(start - epoch).count(),
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()});
+}
+
+void metrics::write(void){
+    if(!prometheusFile.empty())
+        writePrometheus(prometheusFile);
+    if(!traceFile.empty())
+        writeChromeTrace(traceFile);
+}
+@}
+
+The Prometheus text format\footnote{\url{https://prometheus.io/docs/instrumenting/exposition_formats/}} has a help and a type line per metric, followed by one line per set of labels. Histograms are written as cumulative buckets with the label \verb|le| plus the sum and the count.
+
+@O ../src/metrics.cpp -d
+@{
+static std::string prometheusLabels(const metrics::labels& metricLabels, const std::string& extra = ""){
+    if(metricLabels.empty() && extra.empty())
+        return "";
+    std::string text = "{";
+    for(const auto& label: metricLabels){
+        if(text.size() > 1) text += ",";
+        text += label.first + "=\"";
+        for(char c: label.second){
+            if(c == '\\' || c == '"') text += '\\';
+            if(c == '\n') { text += "\\n"; continue; }
+            text += c;
+        }
+        text += "\"";
+    }
+    if(!extra.empty()){
+        if(text.size() > 1) text += ",";
+        text += extra;
+    }
+    return text + "}";
+}
+
+void metrics::writePrometheus(const std::string& file){
+    std::ostringstream out;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(const auto& metricFamily: families){
+            const std::string& name = metricFamily.first;
+            out << "# HELP " << name << " " << metricFamily.second.help << "\n";
+            out << "# TYPE " << name << " " << metricFamily.second.type << "\n";
+            for(const auto& metric: metricFamily.second.counters)
+                out << name << prometheusLabels(metric.first) << " " << metric.second->get() << "\n";
+            for(const auto& metric: metricFamily.second.histograms){
+                std::vector<unsigned long long int> cumulative = metric.second->buckets();
+                const std::vector<double>& bounds = metric.second->bounds();
+                for(unsigned int i=0; i<bounds.size(); i++){
+                    std::ostringstream bound;
+                    bound << "le=\"" << bounds[i] << "\"";
+                    out << name << "_bucket" << prometheusLabels(metric.first, bound.str()) << " " << cumulative[i] << "\n";
+                }
+                out << name << "_bucket" << prometheusLabels(metric.first, "le=\"+Inf\"") << " " << cumulative.back() << "\n";
+                out << name << "_sum" << prometheusLabels(metric.first) << " " << metric.second->sum() << "\n";
+                out << name << "_count" << prometheusLabels(metric.first) << " " << metric.second->count() << "\n";
+            }
+        }
+    }
+    std::ofstream prometheus(file);
+    prometheus << out.str();
+    if(!prometheus)
+        LOG_ERROR("metrics: could not write prometheus file", "file", file);
+    else
+        LOG_INFO("metrics: wrote prometheus file", "file", file);
+}
+
+void metrics::writeChromeTrace(const std::string& file){
+    nlohmann::json events = nlohmann::json::array();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(const auto& buffer: traceBuffers){
+            std::lock_guard<std::mutex> bufferGuard(buffer->lock);
+            for(const auto& event: buffer->events)
+                events.push_back({{"name", event.name}, {"cat", event.category}, {"ph", "X"},
+                        {"ts", event.start}, {"dur", event.duration}, {"pid", 1}, {"tid", buffer->thread}});
+        }
+    }
+    std::ofstream trace(file);
+    trace << nlohmann::json{{"traceEvents", events}, {"displayTimeUnit", "ms"}}.dump();
+    if(!trace)
+        LOG_ERROR("metrics: could not write trace file", "file", file);
+    else
+        LOG_INFO("metrics: wrote trace file", "file", file, "events", events.size());
+}
+@}
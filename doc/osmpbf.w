@@ -0,0 +1,331 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{osmpbf class}
+
+The embedded car router reads the roads from an OpenStreetMap extract in the PBF format\footnote{\url{https://wiki.openstreetmap.org/wiki/PBF_Format}}, the same file graphhopper imports. The format is a sequence of blobs, each with a small header; the blobs with data are zlib compressed protobuf messages holding a block of nodes or ways with a table of strings which the keys and values of the tags refer to. Only the few messages and fields needed for routing are decoded by hand, so no protobuf library is needed, only zlib:
+
+\begin{lstlisting}
+apt-get install zlib1g-dev
+\end{lstlisting}
+
+The nodes come as dense nodes, where the ids and coordinates are differences to the previous node, or rarely one by one. Relations and the metadata are skipped. \verb|read| calls the callbacks for the nodes and ways of the whole file; if one of them is empty, the groups of that kind are not decoded at all, so reading only the ways or only the nodes is fast. Blobs compressed with other methods than zlib make \verb|read| fail.
+
+@O ../src/osmpbf.h -d
+@{
+#ifndef OSMPBF_CLASS
+#define OSMPBF_CLASS
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class osmpbf {
+public:
+    struct way {
+        int64_t id;
+        std::vector<int64_t> refs;
+        std::vector<std::pair<std::string_view, std::string_view> > tags;
+        // Value of the tag or empty
+        std::string_view tag(std::string_view key) const;
+    };
+    typedef std::function<void(int64_t, double, double)> nodeCallback;
+    typedef std::function<void(const way&)> wayCallback;
+    osmpbf(const std::string& file);
+    // False if the file could not be read completely
+    bool read(nodeCallback node, wayCallback wayFound);
+private:
+    // Reads the fields of a protobuf message one after the other
+    class message {
+    public:
+        message(const char* begin, const char* end) : position(begin), end(end), wire(0), number(0), failed(false){}
+        message(std::string_view data) : message(data.data(), data.data() + data.size()){}
+        bool next(void);
+        unsigned int field(void) const { return number; }
+        uint64_t varint(void);
+        int64_t svarint(void);
+        std::string_view bytes(void);
+        void skip(void);
+        bool good(void) const { return !failed; }
+        // For packed repeated fields, which are a run of values without keys
+        bool done(void) const { return failed || position >= end; }
+    private:
+        const char* position;
+        const char* end;
+        unsigned int wire;
+        unsigned int number;
+        bool failed;
+    };
+    bool block(std::string_view data, const nodeCallback& node, const wayCallback& wayFound);
+    void denseNodes(std::string_view data, const nodeCallback& node, int64_t granularity, int64_t latOffset, int64_t lonOffset);
+    std::string file;
+};
+
+#endif
+@}
+
+@O ../src/osmpbf.cpp -d
+@{
+#include "osmpbf.h"
+#include "logger.h"
+
+#include <fstream>
+#include <zlib.h>
+
+std::string_view osmpbf::way::tag(std::string_view key) const{
+    for(const auto& entry: tags)
+        if(entry.first == key)
+            return entry.second;
+    return std::string_view();
+}
+
+osmpbf::osmpbf(const std::string& l_file):
+    file(l_file)
+{
+}
+
+bool osmpbf::message::next(void){
+    if(failed || position >= end)
+        return false;
+    uint64_t key = varint();
+    wire = key & 7;
+    number = key >> 3;
+    return !failed;
+}
+
+uint64_t osmpbf::message::varint(void){
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if(position >= end){
+            failed = true;
+            return 0;
+        }
+        uint8_t byte = static_cast<uint8_t>(*position++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(byte < 0x80)
+            return value;
+    }
+    failed = true;
+    return 0;
+}
+
+int64_t osmpbf::message::svarint(void){
+    uint64_t value = varint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+std::string_view osmpbf::message::bytes(void){
+    uint64_t size = varint();
+    if(failed || size > static_cast<uint64_t>(end - position)){
+        failed = true;
+        return std::string_view();
+    }
+    std::string_view result(position, size);
+    position += size;
+    return result;
+}
+
+void osmpbf::message::skip(void){
+    switch(wire){
+    case 0: varint(); break;
+    case 1: position += 8; break;
+    case 2: bytes(); break;
+    case 5: position += 4; break;
+    default: failed = true;
+    }
+    if(position > end)
+        failed = true;
+}
+@}
+
+The file is read blob by blob. The size of the header is a big endian integer of four bytes, the size of the blob is in the header.
+
+@O ../src/osmpbf.cpp -d
+@{
+bool osmpbf::read(nodeCallback node, wayCallback wayFound){
+    std::ifstream input(file, std::ios::binary);
+    if(!input){
+        LOG_ERROR("osmpbf: could not open file", "file", file);
+        return false;
+    }
+    std::string header, blob, data;
+    unsigned long long int blocks = 0;
+    while(true){
+        unsigned char size[4];
+        if(!input.read(reinterpret_cast<char*>(size), 4))
+            break;
+        header.resize((size[0] << 24) | (size[1] << 16) | (size[2] << 8) | size[3]);
+        if(!input.read(header.data(), header.size()))
+            return false;
+        std::string_view type;
+        uint64_t blobSize = 0;
+        message blobHeader(header);
+        while(blobHeader.next()){
+            if(blobHeader.field() == 1) type = blobHeader.bytes();
+            else if(blobHeader.field() == 3) blobSize = blobHeader.varint();
+            else blobHeader.skip();
+        }
+        blob.resize(blobSize);
+        if(!blobHeader.good() || !input.read(blob.data(), blob.size())){
+            LOG_ERROR("osmpbf: truncated file", "file", file);
+            return false;
+        }
+        if(type != "OSMData")
+            continue;
+        std::string_view raw, compressed;
+        uint64_t rawSize = 0;
+        message content(blob);
+        while(content.next()){
+            if(content.field() == 1) raw = content.bytes();
+            else if(content.field() == 2) rawSize = content.varint();
+            else if(content.field() == 3) compressed = content.bytes();
+            else{
+                LOG_ERROR("osmpbf: unsupported compression", "file", file, "field", content.field());
+                return false;
+            }
+        }
+        if(!compressed.empty()){
+            data.resize(rawSize);
+            uLongf length = rawSize;
+            if(uncompress(reinterpret_cast<Bytef*>(data.data()), &length, reinterpret_cast<const Bytef*>(compressed.data()), compressed.size()) != Z_OK || length != rawSize){
+                LOG_ERROR("osmpbf: could not uncompress block", "file", file);
+                return false;
+            }
+            raw = data;
+        }
+        if(!block(raw, node, wayFound)){
+            LOG_ERROR("osmpbf: broken block", "file", file);
+            return false;
+        }
+        blocks++;
+    }
+    LOG_DEBUG("osmpbf: read file", "file", file, "blocks", blocks);
+    return true;
+}
+@}
+
+A block has the table of strings, the granularity of the coordinates in nanodegrees with an offset and the groups of nodes or ways. As the table of strings may come after the groups, the groups are decoded in a second pass over the block.
+
+@O ../src/osmpbf.cpp -d
+@{
+bool osmpbf::block(std::string_view data, const nodeCallback& node, const wayCallback& wayFound){
+    std::vector<std::string_view> strings;
+    std::vector<std::string_view> groups;
+    int64_t granularity = 100, latOffset = 0, lonOffset = 0;
+    message primitive(data);
+    while(primitive.next()){
+        switch(primitive.field()){
+        case 1: {
+            message table(primitive.bytes());
+            while(table.next()){
+                if(table.field() == 1) strings.push_back(table.bytes());
+                else table.skip();
+            }
+            break;
+        }
+        case 2: groups.push_back(primitive.bytes()); break;
+        case 17: granularity = primitive.varint(); break;
+        case 19: latOffset = primitive.varint(); break;
+        case 20: lonOffset = primitive.varint(); break;
+        default: primitive.skip();
+        }
+    }
+    if(!primitive.good())
+        return false;
+    auto text = [&strings](uint64_t index){ return index < strings.size() ? strings[index] : std::string_view(); };
+    way current;
+    for(std::string_view group: groups){
+        message entries(group);
+        while(entries.next()){
+            if(entries.field() == 2 && node)
+                denseNodes(entries.bytes(), node, granularity, latOffset, lonOffset);
+            else if(entries.field() == 1 && node){
+                message single(entries.bytes());
+                int64_t id = 0, lat = 0, lon = 0;
+                while(single.next()){
+                    if(single.field() == 1) id = single.svarint();
+                    else if(single.field() == 8) lat = single.svarint();
+                    else if(single.field() == 9) lon = single.svarint();
+                    else single.skip();
+                }
+                node(id, 1e-9 * (latOffset + granularity * lat), 1e-9 * (lonOffset + granularity * lon));
+            }
+            else if(entries.field() == 3 && wayFound){
+                message fields(entries.bytes());
+                current.id = 0;
+                current.refs.clear();
+                current.tags.clear();
+                std::vector<std::string_view> keys;
+                std::vector<std::string_view> values;
+                while(fields.next()){
+                    if(fields.field() == 1)
+                        current.id = fields.varint();
+                    else if(fields.field() == 2 || fields.field() == 3){
+                        std::vector<std::string_view>& target = fields.field() == 2 ? keys : values;
+                        message packed(fields.bytes());
+                        while(!packed.done())
+                            target.push_back(text(packed.varint()));
+                    }
+                    else if(fields.field() == 8){
+                        message packed(fields.bytes());
+                        int64_t ref = 0;
+                        while(!packed.done())
+                            current.refs.push_back(ref += packed.svarint());
+                    }
+                    else
+                        fields.skip();
+                }
+                if(!fields.good())
+                    return false;
+                for(std::size_t i=0; i<keys.size() && i<values.size(); i++)
+                    current.tags.push_back({keys[i], values[i]});
+                wayFound(current);
+            }
+            else
+                entries.skip();
+        }
+        if(!entries.good())
+            return false;
+    }
+    return true;
+}
+@}
+
+The dense nodes have the ids and coordinates as packed lists of differences. The tags of all nodes are in one list, which is skipped, as only the coordinates are needed.
+
+@O ../src/osmpbf.cpp -d
+@{
+void osmpbf::denseNodes(std::string_view data, const nodeCallback& node, int64_t granularity, int64_t latOffset, int64_t lonOffset){
+    std::vector<int64_t> ids, lats, lons;
+    message dense(data);
+    while(dense.next()){
+        std::vector<int64_t>* target = dense.field() == 1 ? &ids : dense.field() == 8 ? &lats : dense.field() == 9 ? &lons : nullptr;
+        if(!target){
+            dense.skip();
+            continue;
+        }
+        message packed(dense.bytes());
+        int64_t value = 0;
+        while(!packed.done())
+            target->push_back(value += packed.svarint());
+    }
+    for(std::size_t i=0; i<ids.size() && i<lats.size() && i<lons.size(); i++)
+        node(ids[i], 1e-9 * (latOffset + granularity * lats[i]), 1e-9 * (lonOffset + granularity * lons[i]));
+}
+@}
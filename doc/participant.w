@@ -0,0 +1,45 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{participant}
+
+A participant of the event. Drivers bring a car with \verb|capacity| free seats and an emission class as understood by the HBEFA4 model, everybody else would use public transport. Participants can be read from and written to json files, the start is written as an object with \verb|lat| and \verb|lon|.
+
+@O ../src/participant.h -d
+@{
+#ifndef PARTICIPANT_HEADER
+#define PARTICIPANT_HEADER
+
+#include <string>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "route.h"
+
+struct participant {
+    unsigned int id = 0;
+    std::string name;
+    bool driver = false;
+    unsigned int capacity = 0;
+    std::string carClass;
+    route::coordinate start = {0, 0};
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(participant, id, name, driver, capacity, carClass, start);
+};
+
+#endif
+@}
@@ -0,0 +1,347 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{pipeline class}
+
+When the planner asks many small spatial questions (which passengers are nearest to a driver, which are inside an isoemission zone) each synchronous query waits a full round trip for the answer. The pipeline class uses the pipeline mode of libpq instead: queries are sent one after the other on one connection without waiting and the results are read as they arrive. So hundreds of queries can be in flight at the same time.
+
+A query is given as the name of a prepared statement of the database class and its parameters. The result is handed to a callback, which runs as a task on the scheduler, so the I/O thread of the pipeline only sends and receives. The connection is checked out of the database pool for the lifetime of the pipeline, so the pool should have more than one connection.
+
+Queries which are submitted together are followed by one synchronisation point. If a query fails, libpq aborts the remaining queries up to the synchronisation point; their callbacks get a result with the status \verb|PGRES_PIPELINE_ABORTED|. If sending or reading fails on the connection itself, the callbacks of the queries already sent and of the rest of the batch get an empty result, and the connection is reset; queries queued afterwards are sent on the new connection. Only if it can not be reset the pipeline stops and fails all further queries.
+
+@O ../src/pipeline.h -d
+@{
+#ifndef PIPELINE_CLASS
+#define PIPELINE_CLASS
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "database.h"
+#include "scheduler.h"
+
+class pipeline {
+public:
+    typedef std::shared_ptr<PGresult> result;
+    typedef std::function<void(result)> callback;
+    pipeline(database& db, scheduler& workers);
+    ~pipeline(void);
+    bool ready(void) const;
+    // Sends a prepared statement, done is run on the scheduler with the result
+    void send(const std::string& statement, const std::vector<std::string>& parameters, callback done, unsigned int priority = 0);
+    void participantsInZone(unsigned int driver_id, unsigned int capacity, std::function<void(std::vector<unsigned int>)> done);
+    void nearestPassengers(const route::coordinate& position, unsigned int count, std::function<void(std::vector<unsigned int>)> done);
+    // Number of queries sent and not yet answered
+    unsigned int inFlight(void);
+private:
+    struct query {
+        std::string statement;
+        std::vector<std::string> parameters;
+        callback done;
+        unsigned int priority;
+        PGresult* answer;
+        bool sync;
+    };
+    void run(void);
+    bool sendQueued(void);
+    bool receive(void);
+    // Fails the queries in flight and connects again
+    bool restart(void);
+    // With queueMutex held
+    void fail(query& unanswered);
+    void wake(void);
+    static std::vector<unsigned int> ids(result answer);
+    database::lease connection;
+    scheduler& workers;
+    bool usable;
+    bool stopping;
+    int wakeFds[2];
+    std::mutex queueMutex;
+    std::deque<query> queued;
+    std::deque<query> sent;
+    unsigned int pending;
+    std::thread io;
+};
+
+#endif
+@}
+
+The I/O thread waits with \verb|poll| on the socket of the connection and on a pipe which is written to when new queries are queued or the pipeline is closed.
+
+@O ../src/pipeline.cpp -d
+@{
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "pipeline.h"
+#include "logger.h"
+#include "metrics.h"
+
+pipeline::pipeline(database& db, scheduler& l_workers):
+    connection(db.checkout()), workers(l_workers), usable(false), stopping(false), pending(0)
+{
+    wakeFds[0] = wakeFds[1] = -1;
+    PGconn* conn = connection.get();
+    if(!conn)
+        return;
+    if(!PQenterPipelineMode(conn) || PQsetnonblocking(conn, 1) != 0){
+        LOG_ERROR("pipeline: entering pipeline mode failed", "error", PQerrorMessage(conn));
+        return;
+    }
+    if(::pipe(wakeFds) != 0){
+        LOG_ERROR("pipeline: creating wake up pipe failed");
+        return;
+    }
+    fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+    usable = true;
+    io = std::thread(&pipeline::run, this);
+}
+
+pipeline::~pipeline(void){
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    if(io.joinable()){
+        wake();
+        io.join();
+    }
+    for(int fd: wakeFds)
+        if(fd >= 0)
+            ::close(fd);
+    PGconn* conn = connection.get();
+    if(conn && PQpipelineStatus(conn) != PQ_PIPELINE_OFF){
+        PQsetnonblocking(conn, 0);
+        PQexitPipelineMode(conn);
+    }
+}
+
+bool pipeline::ready(void) const{
+    return usable;
+}
+
+unsigned int pipeline::inFlight(void){
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return pending;
+}
+
+void pipeline::wake(void){
+    char byte = 0;
+    // if the pipe is full the thread is woken up anyway
+    ssize_t written = ::write(wakeFds[1], &byte, 1);
+    (void)written;
+}
+
+void pipeline::send(const std::string& statement, const std::vector<std::string>& parameters, callback done, unsigned int priority){
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if(!usable){
+            lock.unlock();
+            LOG_ERROR("pipeline: not connected", "statement", statement);
+            done(result());
+            return;
+        }
+        queued.push_back({statement, parameters, done, priority, nullptr, false});
+        pending++;
+    }
+    wake();
+}
+@}
+
+The thread sends all queued queries with one synchronisation point, flushes as much as the socket takes and then reads the results. In pipeline mode every query ends with a \verb|NULL| result, the synchronisation point has its own result.
+
+@O ../src/pipeline.cpp -d
+@{
+void pipeline::run(void){
+    PGconn* conn = connection.get();
+    for(;;){
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if(stopping && queued.empty() && sent.empty())
+                break;
+        }
+        if(!sendQueued()){
+            if(!restart())
+                break;
+            continue;
+        }
+        bool writing = PQflush(conn) == 1;
+        struct pollfd fds[2] = {
+            {PQsocket(conn), static_cast<short>(POLLIN | (writing ? POLLOUT : 0)), 0},
+            {wakeFds[0], POLLIN, 0}
+        };
+        if(::poll(fds, 2, -1) < 0)
+            continue;
+        if(fds[1].revents & POLLIN){
+            char buffer[64];
+            while(::read(wakeFds[0], buffer, sizeof(buffer)) > 0){}
+        }
+        if(fds[0].revents & (POLLIN | POLLERR | POLLHUP)){
+            if(!PQconsumeInput(conn)){
+                LOG_ERROR("pipeline: reading from the connection failed", "error", PQerrorMessage(conn));
+                if(!restart())
+                    break;
+                continue;
+            }
+            receive();
+        }
+    }
+    std::lock_guard<std::mutex> lock(queueMutex);
+    usable = false;
+    for(std::deque<query>* queries: {&sent, &queued})
+        for(query& unanswered: *queries)
+            fail(unanswered);
+    sent.clear();
+    queued.clear();
+}
+
+void pipeline::fail(query& unanswered){
+    if(unanswered.answer)
+        PQclear(unanswered.answer);
+    unanswered.answer = nullptr;
+    if(unanswered.sync)
+        return;
+    workers.submit([done = unanswered.done]{ done(result()); }, unanswered.priority);
+    pending--;
+}
+
+bool pipeline::restart(void){
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        for(query& unanswered: sent)
+            fail(unanswered);
+        sent.clear();
+        if(stopping)
+            return false;
+    }
+    metrics::instance().getCounter("co2carpool_database_pipeline_resets_total", "Connections of the database pipeline reset after a failure").add();
+    if(!connection.reset())
+        return false;
+    PGconn* conn = connection.get();
+    if(PQsetnonblocking(conn, 1) != 0 || (PQpipelineStatus(conn) == PQ_PIPELINE_OFF && !PQenterPipelineMode(conn))){
+        LOG_ERROR("pipeline: entering pipeline mode failed", "error", PQerrorMessage(conn));
+        return false;
+    }
+    LOG_INFO("pipeline: connection reset");
+    return true;
+}
+
+bool pipeline::sendQueued(void){
+    static metrics::counter& queries = metrics::instance().getCounter("co2carpool_database_pipeline_queries_total", "Queries sent through the database pipeline");
+    PGconn* conn = connection.get();
+    std::deque<query> batch;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        batch.swap(queued);
+    }
+    if(batch.empty())
+        return true;
+    std::size_t count = 0;
+    bool failed = false;
+    for(; count < batch.size(); count++){
+        query& next = batch[count];
+        std::vector<const char*> values;
+        for(const auto& parameter: next.parameters)
+            values.push_back(parameter.c_str());
+        if(!PQsendQueryPrepared(conn, next.statement.c_str(), values.size(), values.data(), NULL, NULL, 0)){
+            LOG_ERROR("pipeline: sending query failed", "statement", next.statement, "error", PQerrorMessage(conn));
+            failed = true;
+            break;
+        }
+        queries.add();
+    }
+    if(!failed){
+        batch.push_back({"", {}, callback(), 0, nullptr, true});
+        count++;
+        if(!PQpipelineSync(conn)){
+            LOG_ERROR("pipeline: sending synchronisation failed", "error", PQerrorMessage(conn));
+            failed = true;
+            batch.pop_back();
+            count--;
+        }
+    }
+    // The queries sent are answered or failed with the others in flight, the rest never reached the server
+    std::lock_guard<std::mutex> lock(queueMutex);
+    for(std::size_t i=0; i<batch.size(); i++){
+        if(i < count)
+            sent.push_back(std::move(batch[i]));
+        else
+            fail(batch[i]);
+    }
+    return !failed;
+}
+
+bool pipeline::receive(void){
+    PGconn* conn = connection.get();
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while(!sent.empty() && !PQisBusy(conn)){
+        query& front = sent.front();
+        lock.unlock();
+        PGresult* answer = PQgetResult(conn);
+        lock.lock();
+        if(front.sync){
+            if(answer)
+                PQclear(answer);
+            sent.pop_front();
+            continue;
+        }
+        if(answer){
+            if(front.answer)
+                PQclear(front.answer);
+            front.answer = answer;
+            continue;
+        }
+        result finished(front.answer, PQclear);
+        if(!finished)
+            finished.reset(PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR), PQclear);
+        workers.submit([done = front.done, finished]{ done(finished); }, front.priority);
+        sent.pop_front();
+        pending--;
+    }
+    return true;
+}
+@}
+
+Helpers for the spatial queries of the planner, which return the participant ids.
+
+@O ../src/pipeline.cpp -d
+@{
+std::vector<unsigned int> pipeline::ids(result answer){
+    std::vector<unsigned int> participantIds;
+    if(!answer || PQresultStatus(answer.get()) != PGRES_TUPLES_OK){
+        LOG_ERROR("pipeline: query failed", "error", answer ? PQresultErrorMessage(answer.get()) : "no connection");
+        return participantIds;
+    }
+    for(int i=0; i<PQntuples(answer.get()); i++)
+        participantIds.push_back(std::stoul(PQgetvalue(answer.get(), i, 0)));
+    return participantIds;
+}
+
+void pipeline::participantsInZone(unsigned int driver_id, unsigned int capacity, std::function<void(std::vector<unsigned int>)> done){
+    send("zone_containment", {std::to_string(driver_id), std::to_string(capacity)}, [done](result answer){ done(ids(answer)); });
+}
+
+void pipeline::nearestPassengers(const route::coordinate& position, unsigned int count, std::function<void(std::vector<unsigned int>)> done){
+    send("participants_nearest", {std::to_string(position.lat), std::to_string(position.lon), std::to_string(count)}, [done](result answer){ done(ids(answer)); });
+}
+@}
@@ -0,0 +1,293 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{planner class}
+
+The planner takes all participants of the event and calculates the routes needed for deciding on the pickups. Pairs of drivers and passengers which can not save $CO_2$ are removed by the prefilter first, only the remaining pairs are routed exactly.
+
+If the participants are stored in the database, the zones of all drivers are written as polygons into the \verb|isoemission| table instead and the pairs are taken from one query for the passengers inside the zones, so the database does the pair test with its spatial index. This is not possible if a zone is not bounded, then the prefilter is used. If the car routes come from the embedded router, the pairs found either way are checked again with the road distances of one table (see the prefilter class).
+
+For the remaining pairs we also need the direct car route of the driver and the public transport alternative of the passenger. The saving of a pickup is then the $CO_2$ of both travelling separately minus the $CO_2$ of the car route with the pickup. A pair where one of the three routes failed has no finite $CO_2$ and is skipped with a warning, it is neither stored nor returned.
+
+With coroutines (see the CMakeLists.txt) all routes of a plan are calculated at the same time with at most \verb|max_in_flight| routes waiting for the routers (section \verb|planner| of the configuration), otherwise one after the other. Given the scheduler, the planner lets rest resume the waiting coroutines on its workers, so the replies are parsed and their $CO_2$ calculated in parallel instead of in the one thread of the transfers; the thread waiting for the routes helps with this (see \verb|whenAll|).
+
+The paths of the pickup routes, which are stored as route segments, are simplified afterwards with the settings of the section \verb|simplifier| (see there); a tolerance of 0 keeps every point. The $CO_2$ is calculated from the instructions of graphhopper and does not change.
+
+@O ../src/planner.h -d
+@{
+#ifndef PLANNER_CLASS
+#define PLANNER_CLASS
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "database.h"
+#include "participant.h"
+#include "prefilter.h"
+#include "ptemission.h"
+#include "rest.h"
+#include "route.h"
+#include "scheduler.h"
+#include "simplifier.h"
+
+class planner {
+public:
+    struct pickup {
+        unsigned int driver;
+        unsigned int passenger;
+        double co2Saving;
+        std::shared_ptr<route> pickupRoute;
+    };
+    // With a database the participants have to be stored there already
+    // With workers the replies of the asynchronous routes are parsed and the paths simplified on the scheduler
+    planner(std::shared_ptr<rest> restApi, const nlohmann::json& config, std::shared_ptr<database> db = nullptr, scheduler* workers = nullptr);
+    ~planner(void);
+    void plan(const std::vector<participant>& participants, const route::coordinate& destination);
+    // Plans again only the pairs with a changed participant, changed are ids
+    void update(const std::vector<participant>& participants, const std::vector<unsigned int>& changed, const route::coordinate& destination);
+    // Not to be used while plan or update run in another thread
+    const std::vector<pickup>& pickups(void) const;
+    // Polygon of the isoemission zone of a driver
+    std::vector<route::coordinate> zone(const participant& driver, const route::coordinate& destination) const;
+private:
+    void routePickups(const std::vector<participant>& participants, const std::vector<prefilter::candidate>& candidates, const route::coordinate& destination);
+    std::vector<prefilter::candidate> zoneCandidates(const std::vector<participant>& participants, const route::coordinate& destination);
+    std::shared_ptr<route> directRoute(const participant& traveller, const route::coordinate& destination);
+    std::shared_ptr<rest> restApi;
+    std::shared_ptr<database> db;
+    nlohmann::json writerConfig;
+    std::shared_ptr<ptemission> ptEmission;
+    prefilter pairFilter;
+    simplifier pathSimplifier;
+    scheduler* workers;
+#ifdef CO2CARPOOL_COROUTINES
+    std::shared_ptr<resumeQueue> resumes;
+#endif
+    std::map<unsigned int, std::shared_ptr<route> > directRoutes;
+    std::vector<pickup> pickupSavings;
+    struct cfg {
+        cfg() : max_in_flight(256){};
+        unsigned int max_in_flight;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, max_in_flight);
+    } config;
+    // Ids of the participants of the last plan, the pickups refer to their indices
+    std::vector<unsigned int> plannedIds;
+    std::mutex planMutex;
+};
+
+#endif
+@}
+
+@O ../src/planner.cpp -d
+@{
+#include "planner.h"
+#include "bulkwriter.h"
+#include "logger.h"
+
+#include <cmath>
+#include <set>
+
+planner::planner(std::shared_ptr<rest> l_restApi, const nlohmann::json& config, std::shared_ptr<database> l_db, scheduler* l_workers):
+    restApi(l_restApi),
+    db(l_db),
+    writerConfig(config.value("bulkwriter", nlohmann::json::object())),
+    ptEmission(std::make_shared<ptemission>(config.value("pt_emission", nlohmann::json::object()))),
+    pairFilter(config.value("prefilter", nlohmann::json::object())),
+    pathSimplifier(config.value("simplifier", nlohmann::json::object())),
+    workers(l_workers),
+    config(config.value("planner", nlohmann::json::object()))
+{
+#ifdef CO2CARPOOL_COROUTINES
+    if(workers){
+        resumes = std::make_shared<resumeQueue>();
+        restApi->resumeWith([queue = resumes, workers = l_workers](std::function<void(void)> resume){
+            queue->push(resume);
+            workers->submit([queue]{ queue->runOne(); });
+        });
+    }
+#endif
+}
+
+planner::~planner(void){
+#ifdef CO2CARPOOL_COROUTINES
+    if(resumes)
+        restApi->resumeWith(nullptr);
+#endif
+}
+
+const std::vector<planner::pickup>& planner::pickups(void) const{
+    return pickupSavings;
+}
+
+std::vector<route::coordinate> planner::zone(const participant& driver, const route::coordinate& destination) const{
+    return pairFilter.zone(driver, destination);
+}
+
+std::shared_ptr<route> planner::directRoute(const participant& traveller, const route::coordinate& destination){
+    auto known = directRoutes.find(traveller.id);
+    if(known != directRoutes.end())
+        return known->second;
+    std::shared_ptr<route> travellerRoute = std::make_shared<route>(restApi, traveller.start, destination, ptEmission);
+    if(traveller.driver)
+        travellerRoute->carRouting();
+    else
+        travellerRoute->publicTransportRouting();
+    directRoutes[traveller.id] = travellerRoute;
+    return travellerRoute;
+}
+
+void planner::plan(const std::vector<participant>& participants, const route::coordinate& destination){
+    std::lock_guard<std::mutex> lock(planMutex);
+    std::vector<prefilter::candidate> candidates = db ? zoneCandidates(participants, destination) : pairFilter.candidates(participants, destination);
+    candidates = pairFilter.roadCandidates(participants, destination, candidates, *restApi, "car_router");
+    directRoutes.clear();
+    pickupSavings.clear();
+    routePickups(participants, candidates, destination);
+}
+
+void planner::routePickups(const std::vector<participant>& participants, const std::vector<prefilter::candidate>& candidates, const route::coordinate& destination){
+    std::vector<std::shared_ptr<route> > pickupRoutes;
+    for(const auto& candidate: candidates)
+        pickupRoutes.push_back(std::make_shared<route>(restApi, participants[candidate.driver].start, participants[candidate.passenger].start, destination, ptEmission));
+#ifdef CO2CARPOOL_COROUTINES
+    std::vector<coroutine<bool> > running;
+    for(unsigned int i=0; i<candidates.size(); i++){
+        for(const participant* traveller: {&participants[candidates[i].driver], &participants[candidates[i].passenger]}){
+            if(directRoutes.count(traveller->id))
+                continue;
+            std::shared_ptr<route> travellerRoute = std::make_shared<route>(restApi, traveller->start, destination, ptEmission);
+            directRoutes[traveller->id] = travellerRoute;
+            running.push_back(travellerRoute->executeAsync(traveller->driver, !traveller->driver));
+        }
+        running.push_back(pickupRoutes[i]->executeAsync());
+    }
+    LOG_DEBUG("planner: routing asynchronously", "routes", running.size(), "max_in_flight", config.max_in_flight);
+    if(resumes)
+        whenAll(running, config.max_in_flight, [queue = resumes]{ return queue->runOne(); });
+    else
+        whenAll(running, config.max_in_flight);
+#else
+    for(auto& pickupRoute: pickupRoutes)
+        pickupRoute->execute();
+#endif
+    if(pathSimplifier.tolerance() > 0)
+        pathSimplifier.simplify(pickupRoutes, workers);
+    for(unsigned int i=0; i<candidates.size(); i++){
+        const participant& driver = participants[candidates[i].driver];
+        const participant& passenger = participants[candidates[i].passenger];
+        double driverCo2 = directRoute(driver, destination)->carCo2();
+        double passengerCo2 = directRoute(passenger, destination)->publicTransportCo2();
+        double pickupCo2 = pickupRoutes[i]->carCo2();
+        if(!std::isfinite(driverCo2) || !std::isfinite(passengerCo2) || !std::isfinite(pickupCo2)){
+            LOG_WARNING("planner: skipping pickup without routes", "driver", driver.name, "passenger", passenger.name, "driver_co2", driverCo2, "passenger_co2", passengerCo2, "pickup_co2", pickupCo2);
+            continue;
+        }
+        double saving = driverCo2 + passengerCo2 - pickupCo2;
+        LOG_INFO("planner: pickup", "driver", driver.name, "passenger", passenger.name, "co2_saving_kg", saving / 1000.0);
+        pickupSavings.push_back({candidates[i].driver, candidates[i].passenger, saving, pickupRoutes[i]});
+    }
+    plannedIds.clear();
+    for(const auto& traveller: participants)
+        plannedIds.push_back(traveller.id);
+}
+@}
+
+The zones are stored with the id of the driver. Zones left from earlier runs for drivers which are not participating anymore are ignored.
+
+@O ../src/planner.cpp -d
+@{
+std::vector<prefilter::candidate> planner::zoneCandidates(const std::vector<participant>& participants, const route::coordinate& destination){
+    std::map<unsigned int, unsigned int> indices;
+    std::vector<std::pair<unsigned int, std::vector<route::coordinate> > > zones;
+    for(unsigned int i=0; i<participants.size(); i++){
+        indices[participants[i].id] = i;
+        if(!participants[i].driver || participants[i].capacity == 0)
+            continue;
+        std::vector<route::coordinate> polygon = pairFilter.zone(participants[i], destination);
+        if(polygon.empty()){
+            LOG_INFO("planner: zone not bounded, using the prefilter", "driver", participants[i].name);
+            return pairFilter.candidates(participants, destination);
+        }
+        zones.push_back({i, polygon});
+    }
+    {
+        bulkwriter zoneWriter(*db, writerConfig);
+        for(const auto& zone: zones){
+            const participant& driver = participants[zone.first];
+            zoneWriter.addIsoemission(driver.id, driver.id, driver.capacity, zone.second);
+        }
+        zoneWriter.flush();
+        if(zoneWriter.rows() < zones.size()){
+            LOG_WARNING("planner: writing zones failed, using the prefilter");
+            return pairFilter.candidates(participants, destination);
+        }
+    }
+    std::vector<prefilter::candidate> result;
+    for(const auto& members: db->passengersInZones()){
+        auto driver = indices.find(members.driver_id);
+        if(driver == indices.end() || participants[driver->second].capacity != members.capacity)
+            continue;
+        for(unsigned int passenger: members.passengers){
+            auto found = indices.find(passenger);
+            if(found != indices.end())
+                result.push_back({driver->second, found->second});
+        }
+    }
+    LOG_INFO("planner: pairs inside the isoemission zones", "drivers", zones.size(), "pairs", result.size());
+    return result;
+}
+@}
+
+When participants change only the pairs with a changed participant are routed again. The pickups of the other pairs are kept, their indices are moved to the new list of participants. The candidates for the changed participants come from the prefilter, which only needs the participants in memory.
+
+@O ../src/planner.cpp -d
+@{
+void planner::update(const std::vector<participant>& participants, const std::vector<unsigned int>& changed, const route::coordinate& destination){
+    std::lock_guard<std::mutex> lock(planMutex);
+    std::set<unsigned int> changedIds(changed.begin(), changed.end());
+    std::map<unsigned int, unsigned int> indices;
+    for(unsigned int i=0; i<participants.size(); i++)
+        indices[participants[i].id] = i;
+    for(unsigned int id: changedIds)
+        directRoutes.erase(id);
+    std::vector<pickup> kept;
+    for(pickup& planned: pickupSavings){
+        unsigned int driverId = plannedIds[planned.driver];
+        unsigned int passengerId = plannedIds[planned.passenger];
+        auto driver = indices.find(driverId);
+        auto passenger = indices.find(passengerId);
+        if(changedIds.count(driverId) || changedIds.count(passengerId) || driver == indices.end() || passenger == indices.end())
+            continue;
+        planned.driver = driver->second;
+        planned.passenger = passenger->second;
+        kept.push_back(planned);
+    }
+    LOG_INFO("planner: update", "changed", changedIds.size(), "kept_pickups", kept.size(), "dropped_pickups", pickupSavings.size() - kept.size());
+    pickupSavings = kept;
+    std::vector<prefilter::candidate> candidates;
+    for(const auto& candidate: pairFilter.candidates(participants, destination))
+        if(changedIds.count(participants[candidate.driver].id) || changedIds.count(participants[candidate.passenger].id))
+            candidates.push_back(candidate);
+    candidates = pairFilter.roadCandidates(participants, destination, candidates, *restApi, "car_router");
+    routePickups(participants, candidates, destination);
+}
+@}
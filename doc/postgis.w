@@ -53,13 +53,15 @@ psql -d co2carpool
 co2carpool=# create extension postgis;
 \end{lstlisting}
 
-In the database:
+The program creates the tables and indexes itself when it connects for the first time (see the schema migrations in the database class). For reference, the tables are:
 
 \begin{lstlisting}
 CREATE TABLE participants (
     id smallint primary key,
     name varchar(50),
     driver boolean,
+    capacity smallint,
+    carclass varchar(50),
     start geometry(POINT,4326)
 );
 CREATE TABLE routesegment (
@@ -77,6 +79,10 @@ CREATE TABLE isoemission (
     isoemissionzone geometry,
     constraint fk_driver_id foreign key (driver_id) references participants(id)
 );
+CREATE INDEX participants_start_gist ON participants USING gist (start);
+CREATE INDEX routesegment_route_gist ON routesegment USING gist (route);
+CREATE INDEX isoemission_zone_gist ON isoemission USING gist (isoemissionzone);
+CREATE INDEX isoemission_driver_capacity ON isoemission (driver_id, capacity);
 \end{lstlisting}
 
 @O ../bin/scripts/setup_postgis_db.sh
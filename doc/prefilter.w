@@ -0,0 +1,249 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{prefilter class}
+
+Routing every driver/passenger pair through graphhopper is a waste for most pairs: a passenger living hundreds of km off the route of a driver can never be picked up with a $CO_2$ saving. The prefilter discards those pairs before any routing call by only using great circle distances.
+
+For a driver going from $S$ to the destination $D$ and a pickup position $P$ the pickup saves $CO_2$ if (see the isoemission section)
+
+\begin{equation*}
+e_\text{car} d_{SP} + e_\text{car} d_{PD} \leq e_\text{car} d_\text{car} + e_\text{pt} d_{PD}^\text{pt} + (n - 1) e_\text{pt} d_\text{car}
+\end{equation*}
+
+The road and public transport distances are not known yet, but we know that they are longer than the great circle distances $h$ and assume they are at most $k$ times as long (the detour factor). Replacing every distance by its bound which makes the pickup look best gives a condition which no pair with savings can violate:
+
+\begin{equation*}
+e_\text{car} h_{SP} + (e_\text{car} - k e_\text{pt}) h_{PD} \leq k (e_\text{car} + (n - 1) e_\text{pt}) h_{SD}
+\end{equation*}
+
+For the same reason $e_\text{car}$ in the configuration should be a lower bound for the cars and $e_\text{pt}$ an upper bound for public transport. The capacity of the car of the driver is used as $n$ which gives the largest zone.
+
+Evaluating this for all pairs still needs three haversine distances per pair. Before that we throw away most pairs with a bounding box around the start of the driver: the zone is contained in the circle around $S$ with radius $ddd0$ and around $D$ with radius $d_\text{car} - ddd1$ when calculated with $d_\text{car} = k h_{SD}$ and $e_\text{pt}$ replaced by $k e_\text{pt}$ (this is slightly larger than the exact reach, so still safe). If $e_\text{car} \leq k e_\text{pt}$ the zone is not bounded by these circles and only the exact condition is used.
+
+@O ../src/prefilter.h -d
+@{
+#ifndef PREFILTER_CLASS
+#define PREFILTER_CLASS
+
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "participant.h"
+#include "rest.h"
+#include "route.h"
+
+class prefilter {
+public:
+    struct candidate {
+        unsigned int driver;
+        unsigned int passenger;
+    };
+    prefilter(const nlohmann::json& config);
+    // Returns the indices into participants of all pairs which could save CO2
+    std::vector<candidate> candidates(const std::vector<participant>& participants, const route::coordinate& destination);
+    // Keeps the candidates which could still save CO2 with the road distances of the car, all if the url has no table
+    std::vector<candidate> roadCandidates(const std::vector<participant>& participants, const route::coordinate& destination, const std::vector<candidate>& kept, rest& restApi, const std::string& url_ref);
+    // Polygon containing the zone of the driver, empty if the zone is not bounded
+    std::vector<route::coordinate> zone(const participant& driver, const route::coordinate& destination, unsigned int corners = 72) const;
+    unsigned long int pruned(void) const;
+    unsigned long int kept(void) const;
+private:
+    struct cfg {
+        cfg() : detour_factor(1.5), e_car(100), e_pt(55){};
+        double detour_factor;
+        double e_car;
+        double e_pt;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, detour_factor, e_car, e_pt);
+    } config;
+    unsigned long int prunedPairs;
+    unsigned long int keptPairs;
+};
+
+#endif
+@}
+
+For every driver we first calculate the reach of the zone and the bounding box in degrees around the start of the driver. The box in longitude direction is widened by the smallest cosine of the latitude inside the box so it is never too small.
+
+@O ../src/prefilter.cpp -d
+@{
+#include "prefilter.h"
+#include "geo.h"
+#include "isoemission.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+prefilter::prefilter(const nlohmann::json& l_config):
+    config(l_config), prunedPairs(0), keptPairs(0)
+{
+}
+
+unsigned long int prefilter::pruned(void) const{
+    return prunedPairs;
+}
+
+unsigned long int prefilter::kept(void) const{
+    return keptPairs;
+}
+
+std::vector<prefilter::candidate> prefilter::candidates(const std::vector<participant>& participants, const route::coordinate& destination){
+    std::vector<candidate> result;
+    prunedPairs = 0;
+    keptPairs = 0;
+    const double k = config.detour_factor;
+    const double e_car = config.e_car;
+    const double e_pt = config.e_pt;
+    std::vector<double> passengerToDestination(participants.size());
+    for(unsigned int i=0; i<participants.size(); i++)
+        passengerToDestination[i] = geo::haversine(participants[i].start, destination);
+    for(unsigned int i_driver=0; i_driver<participants.size(); i_driver++){
+        const participant& driver = participants[i_driver];
+        if(!driver.driver || driver.capacity == 0) continue;
+        const double n = driver.capacity;
+        const double h_SD = passengerToDestination[i_driver];
+        const double c = k * (e_car + (n - 1) * e_pt) * h_SD;
+        const bool bounded = e_car > k * e_pt;
+        double reachStart = 0, reachDestination = 0;
+        double dlat = 180, dlon = 360;
+        if(bounded){
+            reachStart = isoemissionzone::ddd0(n, k * h_SD, e_car, k * e_pt);
+            reachDestination = k * h_SD - isoemissionzone::ddd1(n, k * h_SD, e_car, k * e_pt);
+            dlat = geo::degrees(reachStart / geo::earthRadius);
+            double maxLat = std::min(89.0, std::fabs(driver.start.lat) + dlat);
+            dlon = std::min(360.0, dlat / std::cos(geo::radians(maxLat)));
+        }
+        for(unsigned int i_passenger=0; i_passenger<participants.size(); i_passenger++){
+            const participant& passenger = participants[i_passenger];
+            if(passenger.driver) continue;
+            if(bounded){
+                if(std::fabs(passenger.start.lat - driver.start.lat) > dlat ||
+                        std::fabs(std::remainder(passenger.start.lon - driver.start.lon, 360.0)) > dlon ||
+                        passengerToDestination[i_passenger] > reachDestination){
+                    prunedPairs++;
+                    continue;
+                }
+            }
+            const double h_SP = geo::haversine(driver.start, passenger.start);
+            const double h_PD = passengerToDestination[i_passenger];
+            if((bounded && h_SP > reachStart) || e_car * h_SP + (e_car - k * e_pt) * h_PD > c){
+                prunedPairs++;
+                continue;
+            }
+            keptPairs++;
+            result.push_back({i_driver, i_passenger});
+        }
+    }
+    unsigned long int total = prunedPairs + keptPairs;
+    LOG_INFO("prefilter: pre-pruned driver/passenger pairs", "kept", keptPairs, "total", total, "pruned", prunedPairs, "pruned_percent", total > 0 ? (100.0 * prunedPairs) / total : 0.0);
+    return result;
+}
+@}
+
+When the car router can give a table of distances (the embedded router, see the chrouter class), the kept pairs are checked again with the road distances $d$ of the car instead of their bounds. Only the public transport distance is still bounded by $k h_{PD}$:
+
+\begin{equation*}
+e_\text{car} (d_{SP} + d_{PD} - d_{SD}) \leq k e_\text{pt} h_{PD} + (n - 1) e_\text{pt} d_{SD}
+\end{equation*}
+
+This is as safe as the condition above, but much tighter for passengers behind a river or a mountain. The table has the starts of the drivers and passengers of the kept pairs as sources and the passengers and the destination as targets, so one table of some hundred rows replaces three routes per pair. Pairs without a car route are dropped as well. The condition uses the configured $e_\text{car}$ and no car class, so the table is asked for distances only and no $CO_2$ is calculated for its cells.
+
+@O ../src/prefilter.cpp -d
+@{
+std::vector<prefilter::candidate> prefilter::roadCandidates(const std::vector<participant>& participants, const route::coordinate& destination, const std::vector<candidate>& kept, rest& restApi, const std::string& url_ref){
+    if(kept.empty())
+        return kept;
+    const double k = config.detour_factor;
+    const double e_car = config.e_car;
+    const double e_pt = config.e_pt;
+    std::map<unsigned int, std::size_t> rows, columns;
+    std::vector<std::pair<double, double> > sources, targets;
+    for(const auto& pair: kept){
+        for(unsigned int traveller: {pair.driver, pair.passenger})
+            if(rows.emplace(traveller, sources.size()).second)
+                sources.push_back({participants[traveller].start.lat, participants[traveller].start.lon});
+        if(columns.emplace(pair.passenger, targets.size()).second)
+            targets.push_back({participants[pair.passenger].start.lat, participants[pair.passenger].start.lon});
+    }
+    const std::size_t toDestination = targets.size();
+    targets.push_back({destination.lat, destination.lon});
+    rest::matrix table;
+    if(!restApi.table(url_ref, sources, targets, "", table))
+        return kept;
+    auto km = [&table](std::size_t row, std::size_t column){ return table.metres[row * table.targets + column] / 1000.0; };
+    std::vector<candidate> result;
+    for(const auto& pair: kept){
+        const double n = participants[pair.driver].capacity;
+        const double d_SP = km(rows[pair.driver], columns[pair.passenger]);
+        const double d_PD = km(rows[pair.passenger], toDestination);
+        const double d_SD = km(rows[pair.driver], toDestination);
+        const double h_PD = geo::haversine(participants[pair.passenger].start, destination);
+        if(std::isinf(d_SP + d_PD + d_SD) || e_car * (d_SP + d_PD - d_SD) > k * e_pt * h_PD + (n - 1) * e_pt * d_SD)
+            continue;
+        result.push_back(pair);
+    }
+    prunedPairs += kept.size() - result.size();
+    keptPairs = result.size();
+    LOG_INFO("prefilter: pruned pairs with road distances", "kept", result.size(), "before", kept.size(), "sources", sources.size(), "targets", targets.size());
+    return result;
+}
+@}
+
+For the database the zone of a driver is also needed as polygon. Along every ray from $S$ the left hand side of the condition grows at least with $2 e_\text{car} - k e_\text{pt}$ per km (triangle inequality), so for a bounded zone it is positive and the border is crossed exactly once, which we find by bisection up to the reach $ddd0$. The zone is star shaped around $S$, so connecting the border points gives its shape. The corners are moved outward by $\frac{1}{\cos\frac{\pi}{\text{corners}}}$ so the edges do not cut off the border between two corners when the zone is convex, and by another 1\% because the polygon is straight in degrees and not on the sphere. With 3000 generated participants the polygons contain all pairs kept by the prefilter and 0.5\% more.
+
+@O ../src/prefilter.cpp -d
+@{
+std::vector<route::coordinate> prefilter::zone(const participant& driver, const route::coordinate& destination, unsigned int corners) const{
+    std::vector<route::coordinate> polygon;
+    const double k = config.detour_factor;
+    const double e_car = config.e_car;
+    const double e_pt = config.e_pt;
+    if(!driver.driver || driver.capacity == 0 || e_car <= k * e_pt || corners < 3)
+        return polygon;
+    const double n = driver.capacity;
+    const double h_SD = geo::haversine(driver.start, destination);
+    const double c = k * (e_car + (n - 1) * e_pt) * h_SD;
+    const double reachStart = isoemissionzone::ddd0(n, k * h_SD, e_car, k * e_pt);
+    const double widening = 1.01 / std::cos(geo::pi / corners);
+    auto outside = [&](double bearing, double distance){
+        route::coordinate position = geo::destination(driver.start, bearing, distance);
+        return e_car * distance + (e_car - k * e_pt) * geo::haversine(position, destination) > c;
+    };
+    polygon.reserve(corners + 1);
+    for(unsigned int i=0; i<corners; i++){
+        const double bearing = 2 * geo::pi * i / corners;
+        double inside = 0, border = reachStart;
+        if(outside(bearing, border)){
+            for(int step=0; step<40 && border - inside > 1e-3; step++){
+                double middle = (inside + border) / 2;
+                if(outside(bearing, middle))
+                    border = middle;
+                else
+                    inside = middle;
+            }
+        }
+        polygon.push_back(geo::destination(driver.start, bearing, border * widening));
+    }
+    polygon.push_back(polygon.front());
+    return polygon;
+}
+@}
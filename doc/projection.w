@@ -0,0 +1,253 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{Projected json parsing}
+
+The replies of motis contain much more than we need: for every leg all intermediate stops with their names, tracks and delays, the walking instructions, the geometry with levels and the debug output of the router. Building a json document of all this and converting it into structs takes most of the time and memory of a public transport query. A projection is the list of fields the caller needs, written as paths with dots like \verb|itineraries.legs.mode|. Arrays do not appear in the path, the fields apply to each element. A path ending in an object keeps the whole object.
+
+The projection does not tokenize the fields it leaves out. A small scanner walks the objects and arrays along the projected paths; a value that is not needed is skipped by looking only for quotes, backslashes and brackets until its end. Only the kept values are handed to nlohmann json. The resulting json document contains just the projected fields and converts into the same structs as before, missing fields get their default values. Skipped values are not checked for errors, if the scanner finds the reply itself malformed it is parsed completely, so nlohmann json reports the error as before.
+
+@O ../src/projection.h -d
+@{
+#ifndef PROJECTION_CLASS
+#define PROJECTION_CLASS
+
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+class projection {
+public:
+    projection(std::initializer_list<std::string> fields);
+    projection(const std::vector<std::string>& fields);
+    // Adds fields, e.g. the ones another part of the program reads from the same reply
+    projection& add(const std::vector<std::string>& fields);
+    const std::vector<std::string>& fields(void) const;
+    nlohmann::json parse(const std::string& text) const;
+private:
+    // Fields below an object, no children means the whole value is kept
+    struct node {
+        std::map<std::string, node> children;
+    };
+    class scanner;
+    node root;
+    std::vector<std::string> paths;
+};
+
+#endif
+@}
+
+@O ../src/projection.cpp -d
+@{
+#include "projection.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+projection::projection(std::initializer_list<std::string> l_fields){
+    add(std::vector<std::string>(l_fields));
+}
+
+projection::projection(const std::vector<std::string>& l_fields){
+    add(l_fields);
+}
+
+projection& projection::add(const std::vector<std::string>& l_fields){
+    for(const auto& field: l_fields){
+        node* current = &root;
+        std::string::size_type begin = 0;
+        while(begin <= field.size()){
+            std::string::size_type end = field.find('.', begin);
+            if(end == std::string::npos) end = field.size();
+            current = &current->children[field.substr(begin, end - begin)];
+            begin = end + 1;
+        }
+        // A shorter path keeps everything below
+        current->children.clear();
+        paths.push_back(field);
+    }
+    return *this;
+}
+
+const std::vector<std::string>& projection::fields(void) const{
+    return paths;
+}
+@}
+
+The scanner works on the raw text. \verb|value| fills the json of one value with the fields below the given node of the projection; without a node the whole value is parsed by nlohmann json. Keys, strings without escapes and numbers are converted directly, this saves setting up a parser for each coordinate of a stop.
+
+@O ../src/projection.cpp -d
+@{
+class projection::scanner {
+public:
+    scanner(const std::string& text) : position(text.data()), end(text.data() + text.size()) {}
+    bool value(const node* filter, nlohmann::json& result){
+        space();
+        if(position == end) return false;
+        if(filter && *position == '{') return object(*filter, result);
+        if(filter && *position == '[') return array(filter, result);
+        const char* begin = position;
+        if(!skip()) return false;
+        if(!scalar(begin, result))
+            result = nlohmann::json::parse(begin, position);
+        return true;
+    }
+    bool finished(void){
+        space();
+        return position == end;
+    }
+private:
+    void space(void){
+        while(position != end && (*position == ' ' || *position == '\n' || *position == '\r' || *position == '\t'))
+            position++;
+    }
+    bool skipString(void){
+        for(position++; position != end; position++){
+            if(*position == '\\'){
+                if(++position == end) return false;
+            }
+            else if(*position == '"'){
+                position++;
+                return true;
+            }
+        }
+        return false;
+    }
+    // Moves behind the value without looking into it
+    bool skip(void){
+        space();
+        if(position == end) return false;
+        if(*position == '"') return skipString();
+        if(*position == '{' || *position == '['){
+            unsigned int depth = 0;
+            while(position != end){
+                char c = *position;
+                if(c == '"'){
+                    if(!skipString()) return false;
+                    continue;
+                }
+                position++;
+                if(c == '{' || c == '[') depth++;
+                else if((c == '}' || c == ']') && --depth == 0) return true;
+            }
+            return false;
+        }
+        const char* begin = position;
+        while(position != end && *position != ',' && *position != '}' && *position != ']' && *position != ' ' && *position != '\n' && *position != '\r' && *position != '\t')
+            position++;
+        return position != begin;
+    }
+    // Plain strings and numbers are converted here, everything else by nlohmann json
+    bool scalar(const char* begin, nlohmann::json& result){
+        if(*begin == '"'){
+            if(std::find(begin, position, '\\') != position) return false;
+            result = std::string(begin + 1, position - 1);
+            return true;
+        }
+        if(*begin != '-' && (*begin < '0' || *begin > '9')) return false;
+        std::string number(begin, position);
+        char* numberEnd = nullptr;
+        if(number.find_first_of(".eE") == std::string::npos){
+            errno = 0;
+            if(*begin == '-') result = static_cast<nlohmann::json::number_integer_t>(std::strtoll(number.c_str(), &numberEnd, 10));
+            else result = static_cast<nlohmann::json::number_unsigned_t>(std::strtoull(number.c_str(), &numberEnd, 10));
+            if(errno == 0 && *numberEnd == 0) return true;
+        }
+        else{
+            result = std::strtod(number.c_str(), &numberEnd);
+            if(*numberEnd == 0) return true;
+        }
+        result = nullptr;
+        return false;
+    }
+    bool key(std::string& name){
+        space();
+        if(position == end || *position != '"') return false;
+        const char* begin = position;
+        if(!skipString()) return false;
+        if(std::find(begin, position, '\\') == position)
+            name.assign(begin + 1, position - 1);
+        else
+            name = nlohmann::json::parse(begin, position).get<std::string>();
+        space();
+        if(position == end || *position != ':') return false;
+        position++;
+        return true;
+    }
+    // After a value either the next one follows or the object or array is closed
+    bool next(char close, bool& closed){
+        space();
+        if(position == end) return false;
+        closed = *position == close;
+        if(*position != ',' && !closed) return false;
+        position++;
+        return true;
+    }
+    bool object(const node& filter, nlohmann::json& result){
+        result = nlohmann::json::object();
+        position++;
+        space();
+        if(position != end && *position == '}'){
+            position++;
+            return true;
+        }
+        std::string name;
+        for(bool closed = false; !closed; ){
+            if(!key(name)) return false;
+            auto child = filter.children.find(name);
+            if(child == filter.children.end()){
+                if(!skip()) return false;
+            }
+            else if(!value(child->second.children.empty() ? nullptr : &child->second, result[name]))
+                return false;
+            if(!next('}', closed)) return false;
+        }
+        return true;
+    }
+    bool array(const node* filter, nlohmann::json& result){
+        result = nlohmann::json::array();
+        position++;
+        space();
+        if(position != end && *position == ']'){
+            position++;
+            return true;
+        }
+        for(bool closed = false; !closed; ){
+            result.push_back(nullptr);
+            if(!value(filter, result.back())) return false;
+            if(!next(']', closed)) return false;
+        }
+        return true;
+    }
+    const char* position;
+    const char* end;
+};
+
+nlohmann::json projection::parse(const std::string& text) const{
+    scanner reader(text);
+    nlohmann::json result;
+    if(reader.value(root.children.empty() ? nullptr : &root, result) && reader.finished())
+        return result;
+    // A malformed reply is parsed completely, so the error is reported as usual
+    return nlohmann::json::parse(text);
+}
+@}
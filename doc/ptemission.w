@@ -0,0 +1,208 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\subsection{ptemission class}
+
+Instead of the flat $38 \frac{g}{km}$ from the isoemission section we calculate the $CO_2$ of a public transport itinerary from its legs as returned by motis. Each leg gets an emission factor in $\frac{g}{km}$: if there is an entry for the agency (by name or id) this one is used, otherwise the one for the mode of the leg and if that is not known either the default. The table is read from the configuration:
+
+\begin{lstlisting}
+"pt_emission": {
+  "default_factor": 38,
+  "modes": { "WALK": 0, "REGIONAL_RAIL": 55, ... },
+  "agencies": { "DB Fernverkehr AG": 29, ... }
+}
+\end{lstlisting}
+
+The values for the trains are the ones from the isoemission section, the others are rough estimates for now.
+
+Motis does not give a distance for every leg. If it is missing we use the length of the geometry of the leg and if there is none either the great circle distance over all stops of the leg.
+
+Motis returns the itineraries in pages of departures. The later pages are fetched as long as they can still contain an itinerary with less $CO_2$, but at most \verb|max_pages| pages within \verb|page_budget_ms| milliseconds. A lower bound for the $CO_2$ of any itinerary is the great circle distance times the lowest factor above zero; only walking and cycling have no emissions and motis uses them for at most \verb|max_walk_km| at the start and the end.
+
+The fields of the motis reply read here are listed by \verb|fields|, so the reply can be parsed with a projection that leaves out everything else.
+
+@O ../src/ptemission.h -d
+@{
+#ifndef PTEMISSION_CLASS
+#define PTEMISSION_CLASS
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "api-client-motis.h"
+
+namespace motis {
+    struct compactLeg;
+    struct compactItinerary;
+};
+
+class ptemission {
+public:
+    ptemission(void);
+    ptemission(const nlohmann::json& config);
+    // Emission factor of a leg in g/km
+    double factor(const motis::Leg& leg) const;
+    // Distance of a leg in km
+    double distance(const motis::Leg& leg) const;
+    // CO2 of a leg or a whole itinerary in g
+    double co2(const motis::Leg& leg) const;
+    double co2(const motis::Itinerary& itinerary) const;
+    // The same for the compact itineraries read into an arena
+    double factor(const motis::compactLeg& leg) const;
+    double distance(const motis::compactLeg& leg) const;
+    double co2(const motis::compactLeg& leg) const;
+    double co2(const motis::compactItinerary& itinerary) const;
+    // Fields of a motis plan reply needed for the CO2
+    static std::vector<std::string> fields(void);
+    // Lowest CO2 in g any itinerary over this great circle distance in km can have
+    double minimum(double distance) const;
+    unsigned int maxPages(void) const;
+    std::chrono::milliseconds pageBudget(void) const;
+private:
+    template<typename leg_t> double legFactor(const leg_t& leg) const;
+    template<typename leg_t> double legCo2(const leg_t& leg) const;
+    struct cfg {
+        cfg() : default_factor(38), max_pages(3), page_budget_ms(2000), max_walk_km(2){};
+        double default_factor;
+        std::map<std::string, double, std::less<> > modes;
+        std::map<std::string, double, std::less<> > agencies;
+        unsigned int max_pages;
+        unsigned int page_budget_ms;
+        double max_walk_km;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, default_factor, modes, agencies, max_pages, page_budget_ms, max_walk_km);
+    } config;
+};
+
+#endif
+@}
+
+@O ../src/ptemission.cpp -d
+@{
+#include "ptemission.h"
+#include "geo.h"
+#include "itineraries.h"
+
+#include <algorithm>
+
+ptemission::ptemission(void){
+}
+
+ptemission::ptemission(const nlohmann::json& l_config):
+    config(l_config)
+{
+}
+
+template<typename leg_t> double ptemission::legFactor(const leg_t& leg) const{
+    auto agency = config.agencies.find(leg.agencyName);
+    if(agency == config.agencies.end())
+        agency = config.agencies.find(leg.agencyId);
+    if(agency != config.agencies.end())
+        return agency->second;
+    auto mode = config.modes.find(leg.mode);
+    if(mode != config.modes.end())
+        return mode->second;
+    return config.default_factor;
+}
+
+double ptemission::distance(const motis::Leg& leg) const{
+    if(leg.distance > 0)
+        return leg.distance / 1000.0;
+    if(!leg.legGeometry.points.empty())
+        return geo::length(geo::decodePolyline(leg.legGeometry.points, leg.legGeometry.precision));
+    std::vector<route::coordinate> stops = {{leg.from.lat, leg.from.lon}};
+    for(const auto& stop: leg.intermediateStops)
+        stops.push_back({stop.lat, stop.lon});
+    stops.push_back({leg.to.lat, leg.to.lon});
+    return geo::length(stops);
+}
+
+template<typename leg_t> double ptemission::legCo2(const leg_t& leg) const{
+    double factor = legFactor(leg);
+    if(factor == 0) return 0;
+    return factor * distance(leg);
+}
+
+double ptemission::factor(const motis::Leg& leg) const{
+    return legFactor(leg);
+}
+
+double ptemission::co2(const motis::Leg& leg) const{
+    return legCo2(leg);
+}
+
+double ptemission::minimum(double distance) const{
+    double lowest = config.default_factor;
+    for(const auto& entry: config.modes)
+        if(entry.second > 0) lowest = std::min(lowest, entry.second);
+    for(const auto& entry: config.agencies)
+        if(entry.second > 0) lowest = std::min(lowest, entry.second);
+    return lowest * std::max(0.0, distance - 2 * config.max_walk_km);
+}
+
+unsigned int ptemission::maxPages(void) const{
+    return std::max(1u, config.max_pages);
+}
+
+std::chrono::milliseconds ptemission::pageBudget(void) const{
+    return std::chrono::milliseconds(config.page_budget_ms);
+}
+
+std::vector<std::string> ptemission::fields(void){
+    return {"itineraries.legs.mode", "itineraries.legs.agencyName", "itineraries.legs.agencyId", "itineraries.legs.distance",
+        "itineraries.legs.legGeometry", "itineraries.legs.from.lat", "itineraries.legs.from.lon",
+        "itineraries.legs.to.lat", "itineraries.legs.to.lon",
+        "itineraries.legs.intermediateStops.lat", "itineraries.legs.intermediateStops.lon"};
+}
+
+double ptemission::co2(const motis::Itinerary& itinerary) const{
+    double total_co2 = 0;
+    for(const auto& leg: itinerary.legs)
+        total_co2 += co2(leg);
+    return total_co2;
+}
+
+double ptemission::factor(const motis::compactLeg& leg) const{
+    return legFactor(leg);
+}
+
+double ptemission::distance(const motis::compactLeg& leg) const{
+    if(leg.distance > 0)
+        return leg.distance / 1000.0;
+    if(!leg.geometry.empty())
+        return geo::length(geo::decodePolyline(std::string(leg.geometry), leg.precision));
+    std::vector<route::coordinate> stops = {{leg.from.lat, leg.from.lon}};
+    stops.insert(stops.end(), leg.intermediateStops.begin(), leg.intermediateStops.end());
+    stops.push_back({leg.to.lat, leg.to.lon});
+    return geo::length(stops);
+}
+
+double ptemission::co2(const motis::compactLeg& leg) const{
+    return legCo2(leg);
+}
+
+double ptemission::co2(const motis::compactItinerary& itinerary) const{
+    double total_co2 = 0;
+    for(const auto& leg: itinerary.legs)
+        total_co2 += co2(leg);
+    return total_co2;
+}
+@}
@@ -23,33 +23,227 @@ The rest class uses libcurl to send rest requests to graphhopper.
 apt-get install libcurl4 libcurl4-openssl-dev nlohmann-json3-dev
 \end{lstlisting}
 
+For benchmarks and tests without a running graphhopper or motis the requests can be recorded and replayed. With \verb|"mode": "record"| every request and its reply is appended to the \verb|archive| file (one json object per line). With \verb|"mode": "replay"| no request is sent at all, the replies are taken from the archive and \verb|replay_latency_ms| can be set to simulate the time the router would need. The key of a request is the method, the name of the url and the request itself; post bodies are parsed and dumped again, so the order of the keys does not matter, and the query options of get requests are sorted. The default mode is \verb|live|.
+
+Car requests can also be answered by the embedded car router (see the chrouter class) in the process, if the program was built with \verb|CO2CARPOOL_CH|. The urls listed in \verb|local| with the settings of their router are then never requested over the network, neither blocking nor asynchronously, and the reply is ready at once. A router whose graph could not be loaded is dropped with an error and the url is requested as before. For these urls \verb|table| gives the times, distances and $CO_2$ of all pairs of many sources and targets at once; for the others it returns false, as graphhopper offers no matrix in its open source version.
+
+The duration of every request is observed in \verb|co2carpool_rest_request_seconds| by method and url, together with the bytes sent and received, the size of the replies, the time to parse them and the errors. The metrics of the configured urls are looked up once in the constructor, so a request does not search the registry under its lock.
+
 @O ../src/rest.h -d
 @{
 #ifndef REST_CLASS
 #define REST_CLASS
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <curl/curl.h>
 # define JSON_DIAGNOSTICS 1
 #include <nlohmann/json.hpp>
 
+#include "limiter.h"
+#include "metrics.h"
+#include "projection.h"
+#include "retrier.h"
+
+#ifdef CO2CARPOOL_COROUTINES
+#include "coroutine.h"
+#endif
+
+#ifdef CO2CARPOOL_CH
+class chrouter;
+#endif
+
 class rest{
+    struct flight;
 public:
     rest(const nlohmann::json& config);
     ~rest(void);
-    nlohmann::json post(const std::string& url_ref, const char* options);
-    nlohmann::json get(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options);
+    // With fields only the projected part of the reply is parsed
+    nlohmann::json post(const std::string& url_ref, const char* options, const projection* fields = nullptr);
+    nlohmann::json get(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields = nullptr);
+    // Starts the request at once in the loop of the asynchronous transfers
+    std::shared_future<nlohmann::json> get_future(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields = nullptr);
+    // Asynchronous requests to the url waiting for the concurrency limit
+    std::size_t backlog(const std::string& url_ref);
+    // Car routes between all sources and all targets (lat, lon), row by row
+    struct matrix {
+        std::size_t sources;
+        std::size_t targets;
+        std::vector<double> seconds;
+        std::vector<double> metres;
+        // In g for the car class, empty without one
+        std::vector<double> co2;
+    };
+    // Only for urls answered by the embedded router, false for the others
+    bool table(const std::string& url_ref, const std::vector<std::pair<double, double> >& sources, const std::vector<std::pair<double, double> >& targets, const std::string& carClass, matrix& result);
+#ifdef CO2CARPOOL_COROUTINES
+    // Awaitable reply of an asynchronous request
+    class reply {
+    public:
+        bool await_ready(void) const noexcept;
+        void await_suspend(std::coroutine_handle<> waiting);
+        nlohmann::json await_resume(void);
+    private:
+        friend class rest;
+        reply(rest& api, const std::string& method, const std::string& url_ref, const std::string& request, const projection* fields);
+        // Follows a request already sent with get_future
+        reply(rest& api, const std::string& url_ref, std::shared_ptr<flight> sent);
+        void finish(CURLcode code, const std::string& response);
+        rest& api;
+        std::string method;
+        std::string url_ref;
+        std::string request;
+        std::string key;
+        const projection* fields;
+        std::shared_ptr<flight> current;
+        nlohmann::json result;
+        bool ready;
+        bool prefetched;
+        std::chrono::steady_clock::time_point start;
+    };
+    reply post_async(const std::string& url_ref, const std::string& options, const projection* fields = nullptr);
+    reply get_async(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields = nullptr);
+    // Starts the request at once like get_future, the reply can be awaited later or dropped
+    reply prefetch_async(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields = nullptr);
+    // Waiting coroutines are resumed through the executor, by default in the thread of the loop
+    void resumeWith(std::function<void(std::function<void(void)>)> executor);
+#endif
 private:
+    // Runs transfers with the curl multi interface in its own thread
+    class multiLoop {
+    public:
+        // Result of curl, HTTP status and body
+        typedef std::function<void(CURLcode, long, const std::string&)> completion;
+        multiLoop(void);
+        ~multiLoop(void);
+        // Takes over the easy handle
+        void add(CURL* easy, completion done);
+        void after(std::chrono::milliseconds delay, std::function<void(void)> callback);
+    private:
+        struct transfer {
+            CURL* easy;
+            std::string response;
+            completion done;
+        };
+        void run(void);
+        CURLM* multi;
+        std::mutex loopMutex;
+        std::vector<std::unique_ptr<transfer> > incoming;
+        std::map<CURL*, std::unique_ptr<transfer> > running;
+        std::multimap<std::chrono::steady_clock::time_point, std::function<void(void)> > timers;
+        std::atomic<bool> stopping;
+        std::thread thread;
+    };
+    multiLoop& loop(void);
+    std::string url(const std::string& url_ref) const;
+    CURL* easyHandle(const std::string& method, const std::string& url_ref, const std::string& request);
+    // Runs the transfer in the loop within the concurrency limit of the url, started is called when it leaves the queue
+    void send(const std::string& url_ref, CURL* easy, std::function<void(CURLcode, const std::string&)> done, std::function<void(void)> started = nullptr);
+    limiter& limiterFor(const std::string& url_ref);
+    // An asynchronous request with its retries and hedges, done is called once in the thread of the loop
+    struct call {
+        std::string method;
+        std::string url_ref;
+        std::string request;
+        std::function<void(CURLcode, const std::string&)> done;
+        unsigned int attempts;
+        unsigned int outstanding;
+        bool hedged;
+        // Read by curl to abort the transfer that lost
+        std::atomic<bool> finished;
+    };
+    void exchange(const std::string& method, const std::string& url_ref, const std::string& request, std::function<void(CURLcode, const std::string&)> done);
+    void attempt(std::shared_ptr<call> current, bool hedge);
+    retrier& retrierFor(const std::string& url_ref);
+    // Blocking transfer on the shared easy handle with timeout and retries, setup sets the request on the handle before each attempt
+    CURLcode perform(const std::string& url_ref, std::unique_lock<std::mutex>& lock, std::function<void(void)> setup, std::string& resultString);
+    std::once_flag loopStarted;
+    std::unique_ptr<multiLoop> multi;
+    std::function<void(std::function<void(void)>)> executor;
+    nlohmann::json parse(const std::string& url_ref, const std::string& resultString, const projection* fields);
+    nlohmann::json postOnce(const std::string& url_ref, const char* options, const projection* fields, const std::string& key);
+    nlohmann::json getOnce(const std::string& url_ref, const std::vector<std::pair<std::string, std::string> >& options, const projection* fields, const std::string& key);
+    // Identical requests in progress share one transfer and one parsed reply
+    struct flight {
+        flight(void) : result(promise.get_future().share()) {}
+        std::string key;
+        std::promise<nlohmann::json> promise;
+        std::shared_future<nlohmann::json> result;
+        std::vector<std::function<void(const nlohmann::json&)> > waiting;
+    };
+    std::shared_ptr<flight> join(const std::string& key, const projection* fields, bool& leader, std::function<void(const nlohmann::json&)> waiter = nullptr);
+    void land(const std::shared_ptr<flight>& current, const nlohmann::json& result);
+    // Calls waiter when the flight has landed, at once if it already has
+    void follow(const std::shared_ptr<flight>& current, std::function<void(const nlohmann::json&)> waiter);
+    std::shared_ptr<flight> prefetch(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields);
+    nlohmann::json coalesced(const std::string& key, const projection* fields, std::function<nlohmann::json(void)> request);
+    static std::string query(std::vector<std::pair<std::string, std::string> > options);
+    std::string requestKey(const std::string& method, const std::string& url_ref, const std::string& request) const;
+    void countError(const std::string& url_ref);
+    std::string archiveKey(const std::string& method, const std::string& url_ref, const std::string& request) const;
+    void loadArchive(void);
+    bool replay(const std::string& key, std::string& resultString);
+    bool replayArchived(const std::string& key, std::string& resultString);
+    void record(const std::string& key, const std::string& resultString);
+    // Reply of the embedded router, false if the url has none
+    bool answerLocally(const std::string& url_ref, const std::string& request, nlohmann::json& resultJson);
+    // Metrics of the requests to one url, the durations by method
+    struct requestTimers {
+        metrics::histogram* post;
+        metrics::histogram* get;
+        metrics::histogram* getFuture;
+        metrics::histogram* postAsync;
+        metrics::histogram* getAsync;
+        metrics::counter* bytesSent;
+        metrics::counter* bytesReceived;
+        metrics::histogram* responseBytes;
+        metrics::histogram* parseSeconds;
+        metrics::counter* errors;
+        metrics::counter* local;
+    };
+    static requestTimers lookupTimers(const std::string& url_ref);
+    // Looked up once for the configured urls, only for others in the registry
+    requestTimers timersFor(const std::string& url_ref) const;
     CURL* curl;
     CURLcode result;
     struct curl_slist *headers;
     struct cfg {
+        cfg() : mode("live"), archive("rest-archive.jsonl"), replay_latency_ms(0), concurrency(nlohmann::json::object()), endpoints(nlohmann::json::object()), local(nlohmann::json::object()){};
         std::map<std::string, std::string> urls;
+        std::string mode;
+        std::string archive;
+        unsigned int replay_latency_ms;
+        nlohmann::json concurrency;
+        nlohmann::json endpoints;
+        nlohmann::json local;
     } config;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE(cfg, urls);
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, urls, mode, archive, replay_latency_ms, concurrency, endpoints, local);
+#ifdef CO2CARPOOL_CH
+    std::map<std::string, std::unique_ptr<chrouter> > localRouters;
+#endif
+    // Filled in the constructor and only read afterwards
+    std::map<std::string, requestTimers> timers;
+    std::mutex archiveMutex;
+    std::unordered_map<std::string, std::string> archive;
+    std::mutex limiterMutex;
+    std::map<std::string, std::unique_ptr<limiter> > limiters;
+    std::mutex retrierMutex;
+    std::map<std::string, std::unique_ptr<retrier> > retriers;
+    std::mutex flightMutex;
+    std::unordered_map<std::string, std::shared_ptr<flight> > flights;
+    // The easy handle of the blocking requests
+    std::mutex curlMutex;
 };
 
 #endif
@@ -59,94 +253,819 @@ private:
 @{
 
 #include "rest.h"
+#include "logger.h"
+#include "metrics.h"
+#ifdef CO2CARPOOL_CH
+#include "chrouter.h"
+#endif
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <thread>
 
 rest::rest(const nlohmann::json& l_config):
     headers(NULL), config(l_config)
 {
-    std::cout << "Initializing CURL...";
+    for(const auto& entry: config.urls)
+        timers[entry.first] = lookupTimers(entry.first);
+    LOG_INFO("rest: initializing CURL");
     curl_global_init(CURL_GLOBAL_ALL);
     curl = curl_easy_init();
     if(!curl){
-        std::cout << " failed!\n";
+        LOG_ERROR("rest: initializing CURL failed");
     }
-    std::cout << " ok!\n";
-    std::cout << "Set headers to json...";
     headers = curl_slist_append(headers, "Accept: application/json");  
     headers = curl_slist_append(headers, "Content-Type: application/json");
     headers = curl_slist_append(headers, "charset: utf-8"); 
     result = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     if(result != CURLE_OK){
-        std::cout << " failed, error by curl is \"" << curl_easy_strerror(result) << "\"\n";
+        LOG_ERROR("rest: setting headers to json failed", "error", curl_easy_strerror(result));
         return;
     }
-    std::cout << " ok!\n";
+    if(config.mode == "replay")
+        loadArchive();
+    else if(config.mode == "record")
+        LOG_INFO("rest: recording requests", "archive", config.archive);
+    for(const auto& entry: config.local.items()){
+#ifdef CO2CARPOOL_CH
+        auto router = std::make_unique<chrouter>(entry.value());
+        if(router->good()){
+            LOG_INFO("rest: answering requests with the embedded router", "url", entry.key());
+            localRouters[entry.key()] = std::move(router);
+        }
+        else
+            LOG_ERROR("rest: embedded router not available, sending requests", "url", entry.key());
+#else
+        LOG_ERROR("rest: built without the embedded router, sending requests", "url", entry.key());
+#endif
+    }
 }
 
 rest::~rest(void){
-    std::cout << "Cleaning up CURL...\n";
+    LOG_INFO("rest: cleaning up CURL");
+    multi.reset();
     curl_easy_cleanup(curl);
     curl_global_cleanup();
 }
 
+rest::requestTimers rest::lookupTimers(const std::string& url_ref){
+    metrics& registry = metrics::instance();
+    auto histogram = [&registry, &url_ref](const char* method){
+        return &registry.getHistogram("co2carpool_rest_request_seconds", "Duration of rest requests including parsing", {{"method", method}, {"url", url_ref}});
+    };
+    return {histogram("post"), histogram("get"), histogram("get_future"), histogram("post_async"), histogram("get_async"),
+        &registry.getCounter("co2carpool_rest_bytes_sent_total", "Bytes sent to the rest endpoints", {{"url", url_ref}}),
+        &registry.getCounter("co2carpool_rest_bytes_received_total", "Bytes received from the rest endpoints", {{"url", url_ref}}),
+        &registry.getHistogram("co2carpool_rest_response_bytes", "Size of the replies of the rest endpoints", {{"url", url_ref}}, metrics::sizeBuckets),
+        &registry.getHistogram("co2carpool_json_parse_seconds", "Duration of parsing the json replies", {{"url", url_ref}}),
+        &registry.getCounter("co2carpool_rest_errors_total", "Failed rest requests", {{"url", url_ref}}),
+        &registry.getCounter("co2carpool_rest_local_requests_total", "Requests answered by the embedded router", {{"url", url_ref}})};
+}
+
+rest::requestTimers rest::timersFor(const std::string& url_ref) const{
+    auto known = timers.find(url_ref);
+    return known != timers.end() ? known->second : lookupTimers(url_ref);
+}
+
 size_t writeIntoStdString(void* ptr, size_t size, size_t nmemb, void* str) {
     std::string* stdString = static_cast<std::string*>(str);
-    stdString->erase(std::find(stdString->begin(), stdString->end(), '\0'), stdString->end());
-    stdString->erase(std::find(stdString->begin(), stdString->end(), '\r'), stdString->end());
-    std::copy((char*)ptr, (char*)ptr + (size + nmemb), std::back_inserter(*stdString));
+    stdString->append((char*)ptr, size * nmemb);
     return size * nmemb;
 }
 
-nlohmann::json rest::post(const std::string& url_ref, const char* options){
-    std::cout << "Send post request...";
-    //curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    //curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-    //curl_easy_setopt(curl, CURLOPT_URL, "http://localhost:8989");
-    result = curl_easy_setopt(curl, CURLOPT_URL, config.urls[url_ref].c_str());
-    if(result != CURLE_OK)
-        std::cout << "Error in curl_easy_setopt for CURLOPT_URL = \"" << config.urls[url_ref].c_str() << "\" error by curl is \"" << curl_easy_strerror(result) << "\"\n";
-    result = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, options);
-    if(result != CURLE_OK)
-        std::cout << "Error in curl_easy_setopt for CURLOPT_POSTFIELDS = \"" << options << "\" error by curl is \"" << curl_easy_strerror(result) << "\"\n";
-    result = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeIntoStdString); 
-    if(result != CURLE_OK)
-        std::cout << "Error in curl_easy_setopt for CURLOPT_WRITEFUNCTION = \"" << writeIntoStdString << "\" error by curl is \"" << curl_easy_strerror(result) << "\"\n";
+nlohmann::json rest::parse(const std::string& url_ref, const std::string& resultString, const projection* fields){
+    requestTimers urlMetrics = timersFor(url_ref);
+    urlMetrics.bytesReceived->add(resultString.size());
+    urlMetrics.responseBytes->observe(resultString.size());
+    metrics::scopedTimer timer(*urlMetrics.parseSeconds, "json::parse", "parse");
+    if(fields)
+        return fields->parse(resultString);
+    return nlohmann::json::parse(resultString);
+}
+
+void rest::countError(const std::string& url_ref){
+    timersFor(url_ref).errors->add();
+}
+@}
+
+\subsubsection{Coalescing identical requests}
+
+While planning many routes ask for the same thing at the same time, e.g. the public transport of passengers starting at the same station. A request that is identical to one still in progress does not go to the router again: it waits for the reply of the first one and gets a copy of the parsed json. Requests are identical if they have the same key as in the archive and are parsed with the same projection. The first request is the leader of a flight; the others join it, blocking requests and \verb|get_future| through the shared future, coroutines by a callback that resumes them. The flight is removed when the reply is there, so later requests are sent again. Coalesced requests are counted in \verb|co2carpool_rest_coalesced_total|.
+
+@O ../src/rest.cpp -d
+@{
+std::shared_ptr<rest::flight> rest::join(const std::string& key, const projection* fields, bool& leader, std::function<void(const nlohmann::json&)> waiter){
+    static metrics::counter& coalesced = metrics::instance().getCounter("co2carpool_rest_coalesced_total", "Requests answered by an identical request in progress");
+    std::string l_key = key + " " + std::to_string(reinterpret_cast<std::uintptr_t>(fields));
+    std::lock_guard<std::mutex> lock(flightMutex);
+    auto known = flights.find(l_key);
+    if(known != flights.end()){
+        leader = false;
+        if(waiter)
+            known->second->waiting.push_back(waiter);
+        coalesced.add();
+        return known->second;
+    }
+    leader = true;
+    std::shared_ptr<flight> current = std::make_shared<flight>();
+    current->key = l_key;
+    flights[l_key] = current;
+    return current;
+}
+
+void rest::land(const std::shared_ptr<flight>& current, const nlohmann::json& result){
+    std::vector<std::function<void(const nlohmann::json&)> > waiting;
+    {
+        std::lock_guard<std::mutex> lock(flightMutex);
+        auto known = flights.find(current->key);
+        if(known != flights.end() && known->second == current)
+            flights.erase(known);
+        waiting.swap(current->waiting);
+        current->promise.set_value(result);
+    }
+    for(auto& waiter: waiting)
+        waiter(result);
+}
+
+void rest::follow(const std::shared_ptr<flight>& current, std::function<void(const nlohmann::json&)> waiter){
+    {
+        std::lock_guard<std::mutex> lock(flightMutex);
+        if(current->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready){
+            current->waiting.push_back(waiter);
+            return;
+        }
+    }
+    waiter(current->result.get());
+}
+
+nlohmann::json rest::coalesced(const std::string& key, const projection* fields, std::function<nlohmann::json(void)> request){
+    bool leader = false;
+    std::shared_ptr<flight> current = join(key, fields, leader);
+    if(!leader)
+        return current->result.get();
+    nlohmann::json result;
+    try{
+        result = request();
+    } catch(...){
+        land(current, result);
+        throw;
+    }
+    land(current, result);
+    return result;
+}
+@}
+
+Recording and replaying of requests.
+
+@O ../src/rest.cpp -d
+@{
+std::string rest::archiveKey(const std::string& method, const std::string& url_ref, const std::string& request) const{
+    return method + " " + url_ref + " " + request;
+}
+
+std::string rest::requestKey(const std::string& method, const std::string& url_ref, const std::string& request) const{
+    if(method != "POST")
+        return archiveKey(method, url_ref, request);
+    try{
+        return archiveKey(method, url_ref, nlohmann::json::parse(request).dump());
+    } catch(const nlohmann::json::exception&){
+        return archiveKey(method, url_ref, request);
+    }
+}
+
+std::string rest::query(std::vector<std::pair<std::string, std::string> > options){
+    std::sort(options.begin(), options.end());
+    std::string result;
+    for(const auto& option: options)
+        result += (result.empty() ? "" : "&") + option.first + "=" + option.second;
+    return result;
+}
+
+void rest::loadArchive(void){
+    std::ifstream file(config.archive);
+    if(!file){
+        LOG_ERROR("rest: could not open archive for replay", "archive", config.archive);
+        return;
+    }
+    std::string line;
+    while(std::getline(file, line)){
+        if(line.empty()) continue;
+        nlohmann::json entry = nlohmann::json::parse(line);
+        archive[entry["key"].get<std::string>()] = entry["response"].get<std::string>();
+    }
+    LOG_INFO("rest: replaying requests", "archive", config.archive, "entries", archive.size(), "latency_ms", config.replay_latency_ms);
+}
+
+bool rest::replay(const std::string& key, std::string& resultString){
+    if(config.replay_latency_ms > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(config.replay_latency_ms));
+    return replayArchived(key, resultString);
+}
+
+bool rest::replayArchived(const std::string& key, std::string& resultString){
+    std::lock_guard<std::mutex> lock(archiveMutex);
+    auto entry = archive.find(key);
+    if(entry == archive.end()){
+        LOG_ERROR("rest: request not found in archive", "key", key);
+        return false;
+    }
+    resultString = entry->second;
+    return true;
+}
+
+void rest::record(const std::string& key, const std::string& resultString){
+    std::lock_guard<std::mutex> lock(archiveMutex);
+    std::ofstream file(config.archive, std::ios::app);
+    file << nlohmann::json{{"key", key}, {"response", resultString}}.dump() << "\n";
+    if(!file)
+        LOG_ERROR("rest: could not write archive", "archive", config.archive);
+}
+
+bool rest::answerLocally(const std::string& url_ref, const std::string& request, nlohmann::json& resultJson){
+#ifdef CO2CARPOOL_CH
+    auto router = localRouters.find(url_ref);
+    if(router == localRouters.end())
+        return false;
+    timersFor(url_ref).local->add();
+    try{
+        resultJson = router->second->route(nlohmann::json::parse(request));
+    } catch(const nlohmann::json::exception& error){
+        LOG_ERROR("rest: embedded router could not answer", "url", url_ref, "error", error.what());
+        countError(url_ref);
+        resultJson = nlohmann::json();
+    }
+    return true;
+#else
+    (void)url_ref;
+    (void)request;
+    (void)resultJson;
+    return false;
+#endif
+}
+
+bool rest::table(const std::string& url_ref, const std::vector<std::pair<double, double> >& sources, const std::vector<std::pair<double, double> >& targets, const std::string& carClass, matrix& result){
+#ifdef CO2CARPOOL_CH
+    auto router = localRouters.find(url_ref);
+    if(router == localRouters.end())
+        return false;
+    result.sources = sources.size();
+    result.targets = targets.size();
+    router->second->table(sources, targets, carClass, result.seconds, result.metres, result.co2);
+    return true;
+#else
+    (void)url_ref;
+    (void)sources;
+    (void)targets;
+    (void)carClass;
+    (void)result;
+    return false;
+#endif
+}
+
+nlohmann::json rest::post(const std::string& url_ref, const char* options, const projection* fields){
+    std::string key = requestKey("POST", url_ref, options);
+    return coalesced(key, fields, [&]{ return postOnce(url_ref, options, fields, key); });
+}
+
+nlohmann::json rest::postOnce(const std::string& url_ref, const char* options, const projection* fields, const std::string& key){
+    LOG_DEBUG("rest: send post request", "url", url_ref);
+    requestTimers urlMetrics = timersFor(url_ref);
+    metrics::scopedTimer timer(*urlMetrics.post, "rest::post", "rest");
+    nlohmann::json localJson;
+    if(answerLocally(url_ref, options, localJson))
+        return localJson;
+    urlMetrics.bytesSent->add(strlen(options));
+    if(config.mode == "replay"){
+        std::string resultString;
+        nlohmann::json resultJson;
+        if(!replay(key, resultString)){
+            countError(url_ref);
+            return resultJson;
+        }
+        try{
+            resultJson = parse(url_ref, resultString, fields);
+        } catch(...){
+            LOG_ERROR("rest: could not parse json", "url", url_ref);
+            countError(url_ref);
+        }
+        return resultJson;
+    }
+    std::unique_lock<std::mutex> lock(curlMutex);
+    auto setup = [this, &url_ref, options]{
+        //curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        //curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        //curl_easy_setopt(curl, CURLOPT_URL, "http://localhost:8989");
+        result = curl_easy_setopt(curl, CURLOPT_URL, config.urls[url_ref].c_str());
+        if(result != CURLE_OK)
+            LOG_ERROR("rest: curl_easy_setopt failed", "option", "CURLOPT_URL", "url", config.urls[url_ref], "error", curl_easy_strerror(result));
+        result = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, options);
+        if(result != CURLE_OK)
+            LOG_ERROR("rest: curl_easy_setopt failed", "option", "CURLOPT_POSTFIELDS", "error", curl_easy_strerror(result));
+    };
     std::string resultString;
-    result = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resultString);
-    if(result != CURLE_OK)
-        std::cout << "Error in curl_easy_setopt for CURLOPT_WRITEDATA = \"" << &resultString << "\" error by curl is \"" << curl_easy_strerror(result) << "\"\n";
-    result = curl_easy_perform(curl);
-    if(result != CURLE_OK)
-        std::cout << "Error in post request for url \"" << config.urls[url_ref].c_str() << "\", options \"" << options << "\", error by curl is \"" << curl_easy_strerror(result) << "\"\n";
-    nlohmann::json resultJson = nlohmann::json::parse(resultString);
-    std::cout << " ok!\n";
+    result = perform(url_ref, lock, setup, resultString);
+    nlohmann::json resultJson;
+    if(result != CURLE_OK){
+        LOG_ERROR("rest: post request failed", "url", config.urls[url_ref], "options", options, "error", curl_easy_strerror(result));
+        countError(url_ref);
+        return resultJson;
+    }
+    if(config.mode == "record")
+        record(key, resultString);
+    try{
+        resultJson = parse(url_ref, resultString, fields);
+    } catch(...){
+        LOG_ERROR("rest: could not parse json", "url", url_ref);
+        countError(url_ref);
+    }
+    LOG_DEBUG("rest: post request done", "url", url_ref, "bytes", resultString.size());
     return resultJson;
 }
 
-nlohmann::json rest::get(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options){
+nlohmann::json rest::get(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields){
+    std::string key = requestKey("GET", url_ref, query(options));
+    return coalesced(key, fields, [&]{ return getOnce(url_ref, options, fields, key); });
+}
+
+nlohmann::json rest::getOnce(const std::string& url_ref, const std::vector<std::pair<std::string, std::string> >& options, const projection* fields, const std::string& key){
     const char* l_url = config.urls[url_ref].c_str();
-    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    LOG_DEBUG("rest: send get request", "url", url_ref);
+    metrics::scopedTimer timer(*timersFor(url_ref).get, "rest::get", "rest");
+    if(config.mode == "replay"){
+        std::string resultString;
+        nlohmann::json resultJson;
+        if(!replay(key, resultString)){
+            countError(url_ref);
+            return resultJson;
+        }
+        try{
+            resultJson = parse(url_ref, resultString, fields);
+        } catch(...){
+            LOG_ERROR("rest: could not parse json", "url", url_ref);
+            countError(url_ref);
+        }
+        return resultJson;
+    }
+    std::unique_lock<std::mutex> lock(curlMutex);
     CURLU *url = curl_url();
     curl_url_set(url, CURLUPART_URL, l_url, 0);
     for(const auto& option: options)
         curl_url_set(url, CURLUPART_QUERY, (option.first + "=" + option.second).c_str(), CURLU_APPENDQUERY);
-    curl_easy_setopt(curl, CURLOPT_CURLU, url);
-    //curl_easy_setopt(curl, CURLOPT_GETFIELDS, options);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeIntoStdString); 
+    auto setup = [this, url]{
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_CURLU, url);
+        //curl_easy_setopt(curl, CURLOPT_GETFIELDS, options);
+    };
     std::string resultString;
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resultString);
-    result = curl_easy_perform(curl);
-    if(result != CURLE_OK)
-        std::cout << "Error in get request for url \"" << url << "\", error by curl is \"" << curl_easy_strerror(result) << "\"\n";
+    result = perform(url_ref, lock, setup, resultString);
+    curl_easy_setopt(curl, CURLOPT_CURLU, NULL);
+    curl_url_cleanup(url);
     nlohmann::json resultJson;
+    if(result != CURLE_OK){
+        LOG_ERROR("rest: get request failed", "url", l_url, "error", curl_easy_strerror(result));
+        countError(url_ref);
+        return resultJson;
+    }
+    if(config.mode == "record")
+        record(key, resultString);
     try{
-        resultJson = nlohmann::json::parse(resultString);
+        resultJson = parse(url_ref, resultString, fields);
     } catch(...){
-        std::cout << "Could not parse json\n";
+        LOG_ERROR("rest: could not parse json", "url", url_ref);
+        countError(url_ref);
     }
+    LOG_DEBUG("rest: get request done", "url", url_ref, "bytes", resultString.size());
     return resultJson;
 }
 
+CURLcode rest::perform(const std::string& url_ref, std::unique_lock<std::mutex>& lock, std::function<void(void)> setup, std::string& resultString){
+    retrier& policy = retrierFor(url_ref);
+    CURLcode code = CURLE_OK;
+    for(unsigned int attempt = 1; ; attempt++){
+        // Other requests may have used the handle during the backoff
+        setup();
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeIntoStdString);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resultString);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, policy.timeout());
+        resultString.clear();
+        auto start = std::chrono::steady_clock::now();
+        code = curl_easy_perform(curl);
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if(code == CURLE_OK && (status == 429 || status == 503))
+            code = CURLE_HTTP_RETURNED_ERROR;
+        if(code == CURLE_OK)
+            policy.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if(code == CURLE_OK || attempt > policy.retries())
+            return code;
+        LOG_DEBUG("rest: retrying request", "url", url_ref, "attempt", attempt, "error", curl_easy_strerror(code));
+        policy.retried.add();
+        lock.unlock();
+        std::this_thread::sleep_for(policy.backoff(attempt));
+        lock.lock();
+    }
+}
+
 
 @}
 
+\subsubsection{Asynchronous requests}
+
+For the coroutines the requests can also be sent asynchronously: \verb|co_await restApi->post_async(...)| suspends the coroutine until the reply is there and gives the parsed json, like \verb|post|. All asynchronous transfers run in one thread with the multi interface of curl, which reuses the connections to the routers. When a transfer is finished the waiting coroutine is resumed; by default directly in the thread of the loop, with \verb|resumeWith| it can be handed to the scheduler instead, so parsing the replies does not hold up the transfers. Recording and replaying works as for the blocking requests, the latency of a replay is simulated with a timer of the loop.
+
+@O ../src/rest.cpp -d
+@{
+std::string rest::url(const std::string& url_ref) const{
+    auto entry = config.urls.find(url_ref);
+    return entry != config.urls.end() ? entry->second : "";
+}
+
+CURL* rest::easyHandle(const std::string& method, const std::string& url_ref, const std::string& request){
+    CURL* easy = curl_easy_init();
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    if(method == "POST"){
+        curl_easy_setopt(easy, CURLOPT_URL, url(url_ref).c_str());
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(request.size()));
+        curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, request.c_str());
+    }
+    else{
+        std::string target = url(url_ref);
+        if(!request.empty())
+            target += (target.find('?') == std::string::npos ? "?" : "&") + request;
+        curl_easy_setopt(easy, CURLOPT_URL, target.c_str());
+        curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+    }
+    return easy;
+}
+
+limiter& rest::limiterFor(const std::string& url_ref){
+    std::lock_guard<std::mutex> lock(limiterMutex);
+    std::unique_ptr<limiter>& known = limiters[url_ref];
+    if(!known)
+        known.reset(new limiter(url_ref, config.concurrency));
+    return *known;
+}
+
+std::size_t rest::backlog(const std::string& url_ref){
+    return limiterFor(url_ref).queued();
+}
+
+void rest::send(const std::string& url_ref, CURL* easy, std::function<void(CURLcode, const std::string&)> done, std::function<void(void)> l_started){
+    limiter& limit = limiterFor(url_ref);
+    auto start = [this, easy, done, l_started, &limit]{
+        if(l_started)
+            l_started();
+        auto started = std::chrono::steady_clock::now();
+        loop().add(easy, [done, &limit, started](CURLcode code, long status, const std::string& response){
+            bool aborted = code == CURLE_ABORTED_BY_CALLBACK;
+            bool overloaded = (code != CURLE_OK && !aborted) || status == 429 || status == 503;
+            limit.release(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(), overloaded, !aborted);
+            if(code == CURLE_OK && overloaded)
+                LOG_ERROR("rest: router overloaded", "status", status);
+            done(code == CURLE_OK && overloaded ? CURLE_HTTP_RETURNED_ERROR : code, response);
+        });
+    };
+    if(limit.acquire(start))
+        return;
+    LOG_ERROR("rest: too many requests waiting for the router", "url", url_ref, "queued", limit.queued());
+    curl_easy_cleanup(easy);
+    // Not from within the caller, which may be suspending a coroutine
+    loop().after(std::chrono::milliseconds(0), [done]{ done(CURLE_AGAIN, ""); });
+}
+
+retrier& rest::retrierFor(const std::string& url_ref){
+    std::lock_guard<std::mutex> lock(retrierMutex);
+    std::unique_ptr<retrier>& known = retriers[url_ref];
+    if(!known){
+        nlohmann::json settings = config.endpoints.value("default", nlohmann::json::object());
+        settings.merge_patch(config.endpoints.value(url_ref, nlohmann::json::object()));
+        known.reset(new retrier(url_ref, settings));
+    }
+    return *known;
+}
+
+static int abortFinished(void* finished, curl_off_t, curl_off_t, curl_off_t, curl_off_t){
+    return static_cast<std::atomic<bool>*>(finished)->load() ? 1 : 0;
+}
+
+void rest::exchange(const std::string& method, const std::string& url_ref, const std::string& request, std::function<void(CURLcode, const std::string&)> done){
+    std::shared_ptr<call> current = std::make_shared<call>();
+    current->method = method;
+    current->url_ref = url_ref;
+    current->request = request;
+    current->done = done;
+    current->attempts = 0;
+    current->outstanding = 0;
+    current->hedged = false;
+    current->finished = false;
+    attempt(current, false);
+}
+@}
+
+An attempt may be started in the thread of the caller, everything after that runs in the thread of the loop. So the state of the call is changed before the transfer is handed to the loop and not afterwards; the timer of the hedge only reads it when it fires in the loop. The latency of an attempt and the delay of its hedge count from the moment the transfer leaves the queue of the limiter, otherwise a queue would look like a slow router. When the first reply is there the other transfer is aborted by its progress callback; its result is ignored, it does not count as overload for the limiter and its shortened latency is not taken as a sample. After a failure the request is only tried again when no other transfer of it is still running.
+
+@O ../src/rest.cpp -d
+@{
+void rest::attempt(std::shared_ptr<call> current, bool hedge){
+    retrier& policy = retrierFor(current->url_ref);
+    CURL* easy = easyHandle(current->method, current->url_ref, current->request);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, policy.timeout());
+    curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, abortFinished);
+    curl_easy_setopt(easy, CURLOPT_XFERINFODATA, &current->finished);
+    current->outstanding++;
+    if(!hedge)
+        current->attempts++;
+    unsigned int attempts = current->attempts;
+    // The latency and the delay of the hedge count from leaving the queue of the limiter
+    std::shared_ptr<std::chrono::steady_clock::time_point> started = std::make_shared<std::chrono::steady_clock::time_point>();
+    auto onStart = [this, current, hedge, attempts, started, &policy]{
+        *started = std::chrono::steady_clock::now();
+        std::chrono::milliseconds delay = policy.hedgeDelay();
+        if(hedge || current->hedged || delay.count() <= 0)
+            return;
+        loop().after(delay, [this, current, attempts, &policy]{
+            if(current->finished || current->hedged || current->attempts != attempts || current->outstanding != 1)
+                return;
+            // A busy router gets no extra requests
+            if(limiterFor(current->url_ref).queued() > 0)
+                return;
+            current->hedged = true;
+            policy.hedgesIssued.add();
+            LOG_DEBUG("rest: hedging slow request", "url", current->url_ref);
+            attempt(current, true);
+        });
+    };
+    send(current->url_ref, easy, [this, current, hedge, started, &policy](CURLcode code, const std::string& response){
+        current->outstanding--;
+        if(current->finished)
+            return;
+        if(code == CURLE_OK){
+            current->finished = true;
+            policy.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - *started).count());
+            if(hedge)
+                policy.hedgesWon.add();
+            current->done(code, response);
+            return;
+        }
+        if(current->outstanding > 0)
+            return;
+        if(code == CURLE_AGAIN || current->attempts > policy.retries()){
+            current->finished = true;
+            current->done(code, response);
+            return;
+        }
+        LOG_DEBUG("rest: retrying request", "url", current->url_ref, "attempt", current->attempts, "error", curl_easy_strerror(code));
+        policy.retried.add();
+        loop().after(policy.backoff(current->attempts), [this, current]{ attempt(current, false); });
+    }, onStart);
+}
+
+rest::multiLoop& rest::loop(void){
+    std::call_once(loopStarted, [this]{ multi.reset(new multiLoop()); });
+    return *multi;
+}
+
+rest::multiLoop::multiLoop(void):
+    multi(curl_multi_init()), stopping(false)
+{
+    thread = std::thread(&multiLoop::run, this);
+}
+
+rest::multiLoop::~multiLoop(void){
+    stopping = true;
+    curl_multi_wakeup(multi);
+    thread.join();
+    for(auto& active: running){
+        curl_multi_remove_handle(multi, active.first);
+        curl_easy_cleanup(active.first);
+    }
+    for(auto& waiting: incoming)
+        curl_easy_cleanup(waiting->easy);
+    curl_multi_cleanup(multi);
+}
+
+void rest::multiLoop::add(CURL* easy, completion done){
+    std::unique_ptr<transfer> next(new transfer{easy, "", done});
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, writeIntoStdString);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &next->response);
+    {
+        std::lock_guard<std::mutex> lock(loopMutex);
+        incoming.push_back(std::move(next));
+    }
+    curl_multi_wakeup(multi);
+}
+
+void rest::multiLoop::after(std::chrono::milliseconds delay, std::function<void(void)> callback){
+    {
+        std::lock_guard<std::mutex> lock(loopMutex);
+        timers.insert({std::chrono::steady_clock::now() + delay, callback});
+    }
+    curl_multi_wakeup(multi);
+}
+
+void rest::multiLoop::run(void){
+    static metrics::counter& transfers = metrics::instance().getCounter("co2carpool_rest_async_transfers_total", "Transfers run by the curl multi loop");
+    while(!stopping){
+        int timeout = 1000;
+        std::vector<std::function<void(void)> > due;
+        {
+            std::lock_guard<std::mutex> lock(loopMutex);
+            for(auto& next: incoming){
+                curl_multi_add_handle(multi, next->easy);
+                running[next->easy] = std::move(next);
+            }
+            incoming.clear();
+            auto now = std::chrono::steady_clock::now();
+            while(!timers.empty() && timers.begin()->first <= now){
+                due.push_back(timers.begin()->second);
+                timers.erase(timers.begin());
+            }
+            if(!timers.empty())
+                timeout = std::min<long long int>(timeout, std::chrono::duration_cast<std::chrono::milliseconds>(timers.begin()->first - now).count() + 1);
+        }
+        for(auto& callback: due)
+            callback();
+        int active = 0;
+        curl_multi_perform(multi, &active);
+        int left = 0;
+        while(CURLMsg* message = curl_multi_info_read(multi, &left)){
+            if(message->msg != CURLMSG_DONE)
+                continue;
+            CURL* easy = message->easy_handle;
+            CURLcode code = message->data.result;
+            long status = 0;
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+            curl_multi_remove_handle(multi, easy);
+            auto finished = running.find(easy);
+            std::unique_ptr<transfer> done = std::move(finished->second);
+            running.erase(finished);
+            curl_easy_cleanup(easy);
+            transfers.add();
+            done->done(code, status, done->response);
+        }
+        curl_multi_poll(multi, NULL, 0, timeout, NULL);
+    }
+}
+@}
+
+Without coroutines a request can be started in the loop as well, the reply is then delivered through a future. It is parsed in the thread of the loop, so this is meant for replies read with a projection. This lets a caller prefetch the next request while it still works on the last reply.
+
+@O ../src/rest.cpp -d
+@{
+std::shared_future<nlohmann::json> rest::get_future(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields){
+    return prefetch(url_ref, options, fields)->result;
+}
+
+std::shared_ptr<rest::flight> rest::prefetch(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields){
+    std::string l_query = query(options);
+    std::string key = requestKey("GET", url_ref, l_query);
+    bool leader = false;
+    std::shared_ptr<flight> current = join(key, fields, leader);
+    if(!leader)
+        return current;
+    LOG_DEBUG("rest: send prefetched get request", "url", url_ref);
+    auto start = std::chrono::steady_clock::now();
+    auto done = [this, current, url_ref, key, fields, start](CURLcode code, const std::string& response){
+        nlohmann::json resultJson;
+        if(code != CURLE_OK){
+            LOG_ERROR("rest: prefetched get request failed", "url", url_ref, "error", curl_easy_strerror(code));
+            countError(url_ref);
+        }
+        else{
+            if(config.mode == "record")
+                record(key, response);
+            try{
+                resultJson = parse(url_ref, response, fields);
+            } catch(const nlohmann::json::exception&){
+                LOG_ERROR("rest: could not parse json", "url", url_ref);
+                countError(url_ref);
+            }
+        }
+        timersFor(url_ref).getFuture->observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        land(current, resultJson);
+    };
+    if(config.mode == "replay"){
+        std::string resultString;
+        bool found = replayArchived(key, resultString);
+        loop().after(std::chrono::milliseconds(config.replay_latency_ms), [done, found, resultString]{
+            done(found ? CURLE_OK : CURLE_READ_ERROR, resultString);
+        });
+        return current;
+    }
+    exchange("GET", url_ref, l_query, done);
+    return current;
+}
+@}
+
+The asynchronous transfers to each url are limited by a limiter (see there) with the settings of \verb|concurrency| in the configuration. The blocking requests share one handle and run one after the other anyway. The handle is only held during a transfer; while a blocking request waits for its next attempt other requests can use it, so the request is set on the handle again before each attempt.
+
+Timeouts, retries and hedging are set per url in \verb|endpoints| with the url as key, settings under \verb|default| apply to all urls (see the retrier class). The blocking requests get the timeouts and retries but are not hedged, as they run one after the other on one handle. A request that still failed is logged and counted and gives an empty json, its empty reply is not parsed.
+
+The awaitable reply. In replay mode the reply is taken from the archive at once and the coroutine is only suspended to simulate the latency. A reply of \verb|prefetch_async| is sent at once through \verb|get_future| and the coroutine follows its flight when it awaits it; if it is never awaited the reply is simply dropped when it lands.
+
+@O ../src/rest.cpp -d
+@{
+#ifdef CO2CARPOOL_COROUTINES
+rest::reply::reply(rest& l_api, const std::string& l_method, const std::string& l_url_ref, const std::string& l_request, const projection* l_fields):
+    api(l_api), method(l_method), url_ref(l_url_ref), request(l_request), key(api.requestKey(method, url_ref, request)), fields(l_fields), ready(false), prefetched(false), start(std::chrono::steady_clock::now())
+{
+    if(method == "POST" && api.answerLocally(url_ref, request, result))
+        ready = true;
+    else if(api.config.mode == "replay"){
+        std::string resultString;
+        if(api.replayArchived(key, resultString))
+            finish(CURLE_OK, resultString);
+        else
+            finish(CURLE_READ_ERROR, "");
+        ready = api.config.replay_latency_ms == 0;
+    }
+}
+
+rest::reply::reply(rest& l_api, const std::string& l_url_ref, std::shared_ptr<flight> sent):
+    api(l_api), method("GET"), url_ref(l_url_ref), fields(nullptr), current(sent), ready(false), prefetched(true), start(std::chrono::steady_clock::now())
+{}
+
+bool rest::reply::await_ready(void) const noexcept{
+    if(prefetched)
+        return current->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    return ready;
+}
+
+void rest::reply::await_suspend(std::coroutine_handle<> waiting){
+    if(prefetched){
+        api.follow(current, [this, waiting](const nlohmann::json&){
+            if(api.executor) api.executor([waiting]{ waiting.resume(); });
+            else waiting.resume();
+        });
+        return;
+    }
+    if(api.config.mode == "replay"){
+        api.loop().after(std::chrono::milliseconds(api.config.replay_latency_ms), [this, waiting]{
+            if(api.executor) api.executor([waiting]{ waiting.resume(); });
+            else waiting.resume();
+        });
+        return;
+    }
+    bool leader = false;
+    current = api.join(key, fields, leader, [this, waiting](const nlohmann::json& shared){
+        result = shared;
+        if(api.executor) api.executor([waiting]{ waiting.resume(); });
+        else waiting.resume();
+    });
+    if(!leader)
+        return;
+    api.exchange(method, url_ref, request, [this, waiting](CURLcode code, const std::string& response){
+        finish(code, response);
+        api.land(current, result);
+        if(api.executor) api.executor([waiting]{ waiting.resume(); });
+        else waiting.resume();
+    });
+}
+
+void rest::reply::finish(CURLcode code, const std::string& response){
+    if(code != CURLE_OK){
+        LOG_ERROR("rest: asynchronous request failed", "method", method, "url", url_ref, "error", curl_easy_strerror(code));
+        api.countError(url_ref);
+        return;
+    }
+    if(api.config.mode == "record")
+        api.record(key, response);
+    try{
+        result = api.parse(url_ref, response, fields);
+    } catch(const nlohmann::json::exception&){
+        LOG_ERROR("rest: could not parse json", "url", url_ref);
+        api.countError(url_ref);
+    }
+    rest::requestTimers timers = api.timersFor(url_ref);
+    (method == "POST" ? timers.postAsync : timers.getAsync)->observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+nlohmann::json rest::reply::await_resume(void){
+    if(prefetched)
+        return current->result.get();
+    return std::move(result);
+}
+
+rest::reply rest::post_async(const std::string& url_ref, const std::string& options, const projection* fields){
+    LOG_DEBUG("rest: send asynchronous post request", "url", url_ref);
+    timersFor(url_ref).bytesSent->add(options.size());
+    return reply(*this, "POST", url_ref, options, fields);
+}
+
+rest::reply rest::get_async(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields){
+    LOG_DEBUG("rest: send asynchronous get request", "url", url_ref);
+    return reply(*this, "GET", url_ref, query(options), fields);
+}
+
+rest::reply rest::prefetch_async(const std::string& url_ref, std::vector<std::pair<std::string, std::string> > options, const projection* fields){
+    return reply(*this, url_ref, prefetch(url_ref, options, fields));
+}
+
+void rest::resumeWith(std::function<void(std::function<void(void)>)> l_executor){
+    executor = l_executor;
+}
+#endif
+@}
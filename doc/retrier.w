@@ -0,0 +1,141 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{retrier class}
+
+A single slow or failed reply of a router holds up the whole plan waiting for it. The retrier keeps the settings for the tail of the latency of one url of the rest class: every attempt has a timeout of \verb|timeout_ms|, a failed request is tried again up to \verb|retries| times and with \verb|hedge| a second, identical request is sent if the first one takes longer than the \verb|hedge_quantile| of the latencies seen recently, and the reply that comes first is taken.
+
+Failures are errors of curl including the timeout and the answers with status 429 and 503. The wait before a retry doubles with each attempt starting at \verb|backoff_ms| up to \verb|max_backoff_ms|, and a random part of it is left out (equal jitter), so the requests that failed together are not sent together again. A request that was rejected because too many requests wait for the router is not tried again, that would only make the queue longer.
+
+The quantile is taken from the last \verb|samples| successful attempts and updated every tenth of them. Until there are enough samples and never below \verb|hedge_min_ms| no request is hedged. Hedging only helps against latency that is not caused by the router being busy, so at the 95 \% quantile it costs about 5 \% more requests. While requests wait for the concurrency limit of the router nothing is hedged. Hedges are counted in \verb|co2carpool_rest_hedges_issued_total| and the ones whose reply came first in \verb|co2carpool_rest_hedges_won_total|, retries in \verb|co2carpool_rest_retries_total|.
+
+@O ../src/retrier.h -d
+@{
+#ifndef RETRIER_CLASS
+#define RETRIER_CLASS
+
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "metrics.h"
+
+class retrier {
+public:
+    retrier(const std::string& name, const nlohmann::json& config);
+    long timeout(void) const;
+    unsigned int retries(void) const;
+    // Wait before the given retry, counting from one
+    std::chrono::milliseconds backoff(unsigned int retry);
+    // Delay after which a request is hedged, zero if it is not
+    std::chrono::milliseconds hedgeDelay(void) const;
+    // Latency of a successful attempt
+    void observe(double seconds);
+    metrics::counter& retried;
+    metrics::counter& hedgesIssued;
+    metrics::counter& hedgesWon;
+private:
+    struct cfg {
+        cfg() : timeout_ms(30000), retries(2), backoff_ms(100), max_backoff_ms(2000), hedge(false), hedge_quantile(0.95), hedge_min_ms(10), samples(200){};
+        long timeout_ms;
+        unsigned int retries;
+        unsigned int backoff_ms;
+        unsigned int max_backoff_ms;
+        bool hedge;
+        double hedge_quantile;
+        unsigned int hedge_min_ms;
+        unsigned int samples;
+    } config;
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, timeout_ms, retries, backoff_ms, max_backoff_ms, hedge, hedge_quantile, hedge_min_ms, samples);
+    mutable std::mutex retrierMutex;
+    std::mt19937 random;
+    // Ring of the latest latencies
+    std::vector<double> latencies;
+    std::size_t next;
+    std::size_t sinceUpdate;
+    double quantileSeconds;
+};
+
+#endif
+@}
+
+@O ../src/retrier.cpp -d
+@{
+#include "retrier.h"
+#include "logger.h"
+
+#include <algorithm>
+
+retrier::retrier(const std::string& name, const nlohmann::json& l_config):
+    retried(metrics::instance().getCounter("co2carpool_rest_retries_total", "Requests sent again after a failure", {{"url", name}})),
+    hedgesIssued(metrics::instance().getCounter("co2carpool_rest_hedges_issued_total", "Second requests sent because the first one was slow", {{"url", name}})),
+    hedgesWon(metrics::instance().getCounter("co2carpool_rest_hedges_won_total", "Second requests answered before the first one", {{"url", name}})),
+    config(l_config), random(std::random_device()()), next(0), sinceUpdate(0), quantileSeconds(0)
+{
+    config.samples = std::max(20u, config.samples);
+    config.hedge_quantile = std::clamp(config.hedge_quantile, 0.5, 1.0);
+    latencies.reserve(config.samples);
+    LOG_INFO("retrier: tail latency settings", "url", name, "timeout_ms", config.timeout_ms, "retries", config.retries, "hedge", config.hedge);
+}
+
+long retrier::timeout(void) const{
+    return config.timeout_ms;
+}
+
+unsigned int retrier::retries(void) const{
+    return config.retries;
+}
+
+std::chrono::milliseconds retrier::backoff(unsigned int retry){
+    unsigned int shift = std::min(retry - 1, 16u);
+    unsigned int wait = static_cast<unsigned int>(std::min<unsigned long long>(config.max_backoff_ms, static_cast<unsigned long long>(config.backoff_ms) << shift));
+    std::lock_guard<std::mutex> lock(retrierMutex);
+    std::uniform_int_distribution<unsigned int> jitter(0, wait / 2);
+    return std::chrono::milliseconds(wait - wait / 2 + jitter(random));
+}
+
+std::chrono::milliseconds retrier::hedgeDelay(void) const{
+    if(!config.hedge)
+        return std::chrono::milliseconds(0);
+    std::lock_guard<std::mutex> lock(retrierMutex);
+    if(quantileSeconds <= 0)
+        return std::chrono::milliseconds(0);
+    return std::max(std::chrono::milliseconds(config.hedge_min_ms), std::chrono::milliseconds(static_cast<long long int>(quantileSeconds * 1000) + 1));
+}
+
+void retrier::observe(double seconds){
+    if(!config.hedge)
+        return;
+    std::lock_guard<std::mutex> lock(retrierMutex);
+    if(latencies.size() < config.samples)
+        latencies.push_back(seconds);
+    else
+        latencies[next] = seconds;
+    next = (next + 1) % config.samples;
+    if(latencies.size() < 20 || ++sinceUpdate < config.samples / 10)
+        return;
+    sinceUpdate = 0;
+    std::vector<double> sorted(latencies);
+    auto position = sorted.begin() + static_cast<std::size_t>(config.hedge_quantile * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), position, sorted.end());
+    quantileSeconds = *position;
+}
+@}
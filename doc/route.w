@@ -19,6 +19,12 @@
 
 This provides a wrapper for the rest calls of ``graphhopper'' for the route calculation. If needed the routing engine can be replaced here.
 
+For every route the $CO_2$ of the car and of the best public transport itinerary is kept, so the planner can compare the alternatives for each participant. The coordinates of the car route are kept as a compact path (see there), which needs about a quarter of the memory of a vector of coordinates.
+
+Of the motis reply only the fields for the $CO_2$ (see \verb|ptemission::fields|) and the few ones written to the log are parsed. The intermediate stops, the walking instructions and the debug output are skipped. The itineraries are read into compact structs in an arena of the thread.
+
+Later departures can have itineraries with less $CO_2$, so the following pages of the reply are read as well within the limits set in the ptemission class. The request for a page is sent as soon as the cursor of the previous page is known and runs in the loop of the asynchronous transfers while the previous page is read. Only the decision to stop needs the $CO_2$ of that page: when no better itinerary is possible after reading it, the page on its way is not waited for and its reply is dropped. The coroutines await the pages one after the other, they do not hold a thread while waiting and many routes are paged at the same time. Paging stops when no itinerary with less $CO_2$ is possible any more, when there are no more pages or when the budget of pages or time is used up.
+
 @i api-client-motis.w
 
 @O ../src/route.h -d
@@ -35,12 +41,15 @@ This provides a wrapper for the rest calls of ``graphhopper'' for the route calc
 #include "rest.h"
 #include "sumo/emissions/PollutantsInterface.h"
 #include "api-client-motis.h"
+#include "ptemission.h"
+#include "compactpath.h"
 
 class route : public task{
 public:
     struct coordinate {
         double lat;
         double lon;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE(coordinate, lat, lon);
     };
     struct instruction {
         double distance;
@@ -69,31 +78,70 @@ public:
         std::string fromPlace;
         std::string toPlace;
         std::string mode;
+        std::string pageCursor;
         std::vector<std::pair<std::string,std::string> > vec(){
-            return {
+            std::vector<std::pair<std::string,std::string> > options = {
                 {"fromPlace",fromPlace},
                 {"toPlace",toPlace},
                 {"mode",mode}
             };
+            if(!pageCursor.empty())
+                options.push_back({"pageCursor",pageCursor});
+            return options;
         }
     };
-    route(std::shared_ptr<rest> restApi, const coordinate& from, const coordinate& to);
+    route(std::shared_ptr<rest> restApi, const coordinate& from, const coordinate& to, std::shared_ptr<ptemission> ptEmission = std::make_shared<ptemission>());
+    route(std::shared_ptr<rest> restApi, const coordinate& from, const coordinate& via, const coordinate& to, std::shared_ptr<ptemission> ptEmission = std::make_shared<ptemission>());
 
     virtual bool isCompleted(void) const override;
     virtual unsigned int priority(void) const override;
     virtual void execute(void) override;
     void carRouting(void);
     void publicTransportRouting(void);
+#ifdef CO2CARPOOL_COROUTINES
+    // Same as execute, but waits for the routers without blocking a thread
+    coroutine<bool> executeAsync(bool car = true, bool publicTransport = true);
+#endif
     double co2(std::string carClass);
+    // CO2 in g for all instructions, also stored in each instruction
+    static double co2(SUMOEmissionClass emissionClass, std::vector<instruction>& instructions);
     void isoemission(void);
+    // CO2 in g of the car route and of the best public transport itinerary
+    double carCo2(void) const;
+    double publicTransportCo2(void) const;
+    // Coordinates of the car route
+    const compactPath<coordinate>& path(void) const;
+    // Points of the path where an instruction starts or ends
+    std::vector<std::size_t> instructionPoints(void) const;
+    // Replaces the path by the kept points of it, e.g. by a simplified one; the intervals of the instructions are moved along
+    void setPath(compactPath<coordinate> simplified, const std::vector<std::size_t>& kept);
 private:
+    car_request carRequest(void) const;
+    void readCarRoute(const nlohmann::json& result);
+    pt_request ptRequest(const std::string& pageCursor = "") const;
+    static const projection& ptFields(void);
+    // Bytes an arena for itineraries may hold before it is released
+    static const std::size_t arenaLimit = 16 * 1024 * 1024;
+    void readPublicTransport(const nlohmann::json& reply);
+    void readPublicTransportPages(nlohmann::json page);
+    void startPages(void);
+    // Cursor of the next page if the budget of pages and time allows it, otherwise empty
+    std::string nextPage(const nlohmann::json& page, unsigned int pages) const;
+    bool bestPossible(unsigned int pages) const;
     coordinate from;
     coordinate to;
+    std::vector<coordinate> via;
     bool routeCalculated;
     unsigned int prio;
     std::shared_ptr<rest> restApi;
-    std::vector<coordinate> routePath;
+    std::shared_ptr<ptemission> ptEmission;
+    compactPath<coordinate> routePath;
     std::vector<instruction> instructions;
+    double totalCarCo2;
+    double totalPtCo2;
+    std::chrono::steady_clock::time_point pageDeadline;
+    double ptBound;
+    std::vector<double> itineraryCo2;
 };
 
 #endif
@@ -103,12 +151,31 @@ private:
 @{
 
 #include "route.h"
+#include "geo.h"
+#include "itineraries.h"
 #include "locations.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <limits>
+#include <numeric>
+#include <optional>
+
+route::route(std::shared_ptr<rest> l_restApi, const coordinate& l_from, const coordinate& l_to, std::shared_ptr<ptemission> l_ptEmission):
+    from(l_from), to(l_to), routeCalculated(false), prio(1), restApi(l_restApi), ptEmission(l_ptEmission),
+    totalCarCo2(std::numeric_limits<double>::infinity()), totalPtCo2(std::numeric_limits<double>::infinity())
+{
+    LOG_DEBUG("route: init route");
+}
 
-route::route(std::shared_ptr<rest> l_restApi, const coordinate& l_from, const coordinate& l_to):
-    restApi(l_restApi), from(l_from), to(l_to), routeCalculated(false), prio(1)
+route::route(std::shared_ptr<rest> l_restApi, const coordinate& l_from, const coordinate& l_via, const coordinate& l_to, std::shared_ptr<ptemission> l_ptEmission):
+    from(l_from), to(l_to), via({l_via}), routeCalculated(false), prio(1), restApi(l_restApi), ptEmission(l_ptEmission),
+    totalCarCo2(std::numeric_limits<double>::infinity()), totalPtCo2(std::numeric_limits<double>::infinity())
 {
-    std::cout << "Init route\n";
+    LOG_DEBUG("route: init route with pickup");
 }
 
 bool route::isCompleted(void) const{
@@ -119,66 +186,243 @@ unsigned int route::priority(void) const{
     return prio;
 }
 
+double route::carCo2(void) const{
+    return totalCarCo2;
+}
+
+double route::publicTransportCo2(void) const{
+    return totalPtCo2;
+}
+
+const compactPath<route::coordinate>& route::path(void) const{
+    return routePath;
+}
+
+std::vector<std::size_t> route::instructionPoints(void) const{
+    std::vector<std::size_t> points;
+    for(const auto& step: instructions)
+        points.insert(points.end(), step.interval.begin(), step.interval.end());
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    return points;
+}
+
+void route::setPath(compactPath<coordinate> simplified, const std::vector<std::size_t>& kept){
+    routePath = std::move(simplified);
+    if(kept.empty())
+        return;
+    // A removed point is replaced by the kept point before it at the start of an interval and after it at the end
+    for(auto& step: instructions){
+        if(step.interval.size() != 2)
+            continue;
+        auto first = std::upper_bound(kept.begin(), kept.end(), step.interval[0]);
+        auto last = std::lower_bound(kept.begin(), kept.end(), step.interval[1]);
+        step.interval[0] = first == kept.begin() ? 0 : first - kept.begin() - 1;
+        step.interval[1] = last == kept.end() ? kept.size() - 1 : last - kept.begin();
+    }
+}
+
 void route::execute(void){
     carRouting();
-    publicTransportRouting();
-} 
+    // A route with a pickup is only driven by car
+    if(via.empty())
+        publicTransportRouting();
+    routeCalculated = true;
+}
+
+#ifdef CO2CARPOOL_COROUTINES
+coroutine<bool> route::executeAsync(bool car, bool publicTransport){
+    auto start = std::chrono::steady_clock::now();
+    if(car){
+        nlohmann::json carReply = co_await restApi->post_async("car_router", nlohmann::json(carRequest()).dump());
+        readCarRoute(carReply);
+    }
+    if(publicTransport && via.empty()){
+        startPages();
+        nlohmann::json pt = co_await restApi->get_async("pt_router", ptRequest().vec(), &ptFields());
+        for(unsigned int pages = 1; ; pages++){
+            std::string cursor = nextPage(pt, pages);
+            std::optional<rest::reply> next;
+            // The next page is already on its way while this one is read
+            if(!cursor.empty())
+                next.emplace(restApi->prefetch_async("pt_router", ptRequest(cursor).vec(), &ptFields()));
+            readPublicTransport(pt);
+            if(!next || bestPossible(pages))
+                break;
+            pt = co_await *next;
+        }
+    }
+    routeCalculated = true;
+    static metrics::histogram& seconds = metrics::instance().getHistogram("co2carpool_route_seconds", "Duration of the routing stages", {{"stage", "async"}});
+    seconds.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    co_return !car || !instructions.empty();
+}
+#endif
 @}
 
 @O ../src/route.cpp -d
 @{
 void route::carRouting(void) {
-    std::cout << "Car routing\n";
-    car_request request;
-    request.points = {{from.lon, from.lat}, {to.lon, to.lat}};
-    nlohmann::json j_request = request;
+    LOG_DEBUG("route: car routing");
+    static metrics::histogram& seconds = metrics::instance().getHistogram("co2carpool_route_seconds", "Duration of the routing stages", {{"stage", "car"}});
+    metrics::scopedTimer timer(seconds, "route::carRouting", "route");
+    nlohmann::json j_request = carRequest();
     nlohmann::json result;
     result = restApi->post("car_router", j_request.dump().c_str()); 
-    for(const auto& coordinate: result["paths"][0]["points"]["coordinates"]){
-        routePath.push_back({coordinate[1],coordinate[0]});
+    readCarRoute(result);
+}
+
+route::car_request route::carRequest(void) const{
+    car_request request;
+    request.points = {{from.lon, from.lat}};
+    for(const auto& pickup: via)
+        request.points.push_back({pickup.lon, pickup.lat});
+    request.points.push_back({to.lon, to.lat});
+    return request;
+}
+
+void route::readCarRoute(const nlohmann::json& result){
+    metrics& registry = metrics::instance();
+    static metrics::histogram& convertSeconds = registry.getHistogram("co2carpool_convert_seconds", "Duration of the conversion of json into structs", {{"type", "graphhopper"}});
+    static metrics::counter& coordinates = registry.getCounter("co2carpool_objects_total", "Number of objects created from replies", {{"type", "coordinate"}});
+    static metrics::counter& instructionCount = registry.getCounter("co2carpool_objects_total", "Number of objects created from replies", {{"type", "instruction"}});
+    static metrics::histogram& pathBytes = registry.getHistogram("co2carpool_route_path_bytes", "Memory of the compact paths of the car routes", {}, metrics::sizeBuckets);
+    try{
+        metrics::scopedTimer convertTimer(convertSeconds, "route::carRouting convert", "parse");
+        for(const auto& coordinate: result.at("paths").at(0).at("points").at("coordinates")){
+            routePath.push_back({coordinate[1],coordinate[0]});
+        }
+        routePath.shrink_to_fit();
+        instructions = result["paths"][0]["instructions"].get<std::vector<instruction> >();
+    } catch(const nlohmann::json::exception& error){
+        LOG_ERROR("route: no car route in reply", "error", error.what());
+        return;
     }
-    instructions = result["paths"][0]["instructions"].get<std::vector<instruction> >();
-    std::cout << "Read in " << routePath.size() << " coordinates and " << instructions.size() << " instructions \n";
-    co2("HBEFA4/PC_petrol_Euro-4");
+    coordinates.add(routePath.size());
+    instructionCount.add(instructions.size());
+    pathBytes.observe(routePath.bytes());
+    LOG_DEBUG("route: read car route", "coordinates", routePath.size(), "instructions", instructions.size());
+    totalCarCo2 = co2("HBEFA4/PC_petrol_Euro-4");
 }
 @}
 
 @O ../src/route.cpp -d
 @{
 void route::publicTransportRouting(void){
-    std::cout << "Public Transport routing\n";
+    LOG_DEBUG("route: public transport routing");
+    static metrics::histogram& seconds = metrics::instance().getHistogram("co2carpool_route_seconds", "Duration of the routing stages", {{"stage", "pt"}});
+    metrics::scopedTimer timer(seconds, "route::publicTransportRouting", "route");
+    startPages();
+    readPublicTransportPages(restApi->get("pt_router", ptRequest().vec(), &ptFields()));
+}
+
+route::pt_request route::ptRequest(const std::string& pageCursor) const{
     pt_request request;
+    request.pageCursor = pageCursor;
     request.fromPlace = std::to_string(from.lat) + "," + std::to_string(from.lon);
     request.toPlace = std::to_string(to.lat) + "," + std::to_string(to.lon);
+    return request;
+}
+
+const projection& route::ptFields(void){
+    static const projection fields = projection(ptemission::fields()).add({"itineraries.duration", "itineraries.transfers",
+            "itineraries.legs.duration", "itineraries.legs.headsign", "itineraries.legs.routeShortName",
+            "itineraries.legs.from.name", "itineraries.legs.to.name", "nextPageCursor"});
+    return fields;
+}
+
+void route::startPages(void){
+    pageDeadline = std::chrono::steady_clock::now() + ptEmission->pageBudget();
+    ptBound = ptEmission->minimum(geo::haversine(from, to));
+    itineraryCo2.clear();
+}
+
+std::string route::nextPage(const nlohmann::json& page, unsigned int pages) const{
+    static metrics::counter& late = metrics::instance().getCounter("co2carpool_pt_pages_total", "Pages of itineraries read from motis", {{"result", "over_budget"}});
+    std::string cursor = page.is_object() ? page.value("nextPageCursor", "") : "";
+    if(cursor.empty() || pages >= ptEmission->maxPages())
+        return "";
+    if(std::chrono::steady_clock::now() >= pageDeadline){
+        late.add();
+        return "";
+    }
+    return cursor;
+}
+
+bool route::bestPossible(unsigned int pages) const{
+    static metrics::counter& early = metrics::instance().getCounter("co2carpool_pt_pages_total", "Pages of itineraries read from motis", {{"result", "not_needed"}});
+    if(totalPtCo2 > ptBound)
+        return false;
+    LOG_DEBUG("route: no better itinerary possible", "pages", pages, "co2_g", totalPtCo2, "bound_g", ptBound);
+    early.add();
+    return true;
+}
+
+void route::readPublicTransportPages(nlohmann::json page){
+    static metrics::counter& late = metrics::instance().getCounter("co2carpool_pt_pages_total", "Pages of itineraries read from motis", {{"result", "over_budget"}});
+    for(unsigned int pages = 1; ; pages++){
+        std::string cursor = nextPage(page, pages);
+        std::shared_future<nlohmann::json> next;
+        // The next page is already on its way while this one is read
+        if(!cursor.empty())
+            next = restApi->get_future("pt_router", ptRequest(cursor).vec(), &ptFields());
+        readPublicTransport(page);
+        if(!next.valid() || bestPossible(pages))
+            break;
+        if(next.wait_until(pageDeadline) != std::future_status::ready){
+            LOG_DEBUG("route: page budget exhausted", "pages", pages);
+            late.add();
+            break;
+        }
+        page = next.get();
+    }
+}
+
+void route::readPublicTransport(const nlohmann::json& reply){
+    metrics& registry = metrics::instance();
+    static metrics::counter& pagesRead = registry.getCounter("co2carpool_pt_pages_total", "Pages of itineraries read from motis", {{"result", "read"}});
+    static metrics::histogram& convertSeconds = registry.getHistogram("co2carpool_convert_seconds", "Duration of the conversion of json into structs", {{"type", "motis"}});
+    static metrics::counter& itineraryCount = registry.getCounter("co2carpool_objects_total", "Number of objects created from replies", {{"type", "itinerary"}});
+    static metrics::counter& legCount = registry.getCounter("co2carpool_objects_total", "Number of objects created from replies", {{"type", "leg"}});
+    static metrics::counter& stopCount = registry.getCounter("co2carpool_objects_total", "Number of objects created from replies", {{"type", "stop"}});
+    pagesRead.add();
     try{
-        motis::planReply result = restApi->get("pt_router", request.vec());
-        std::cout << "  Got " << result.itineraries.size() << " itineraries:\n"; 
-        for(const auto& itinerary: result.itineraries){
-            static int i=0;
+        // Each thread reads into its own arena, released after a batch of queries
+        thread_local motis::arena memory;
+        if(memory.bytes() > arenaLimit){
+            LOG_DEBUG("route: releasing itinerary arena", "bytes", memory.bytes(), "strings", memory.strings());
+            memory.release();
+        }
+        std::pmr::vector<motis::compactItinerary> itineraries(&memory);
+        {
+            metrics::scopedTimer convertTimer(convertSeconds, "route::publicTransportRouting convert", "parse");
+            itineraries = motis::itineraries(reply, memory);
+        }
+        unsigned long int legs = 0, stops = 0;
+        for(const auto& itinerary: itineraries){
+            legs += itinerary.legs.size();
+            for(const auto& leg: itinerary.legs)
+                stops += leg.intermediateStops.size();
+        }
+        itineraryCount.add(itineraries.size());
+        legCount.add(legs);
+        stopCount.add(stops);
+        LOG_DEBUG("route: got itineraries", "count", itineraries.size());
+        int i=0;
+        for(const auto& itinerary: itineraries){
             i++;
-            std::cout << "  " << i << " duration: " << itinerary.duration / (60.0*60.0)<< " hours\n";  
-            std::cout << "  " << i << " transfers: " << itinerary.transfers << "\n";  
-            std::cout << "  " << i << " number of legs: " << itinerary.legs.size() << "\n";  
+            itineraryCo2.push_back(ptEmission->co2(itinerary));
+            totalPtCo2 = std::min(totalPtCo2, itineraryCo2.back());
+            LOG_DEBUG("route: itinerary", "itinerary", i, "duration_h", itinerary.duration / (60.0*60.0), "co2_kg", itineraryCo2.back() / 1000.0, "transfers", itinerary.transfers, "legs", itinerary.legs.size());
             int i_leg=0;
             for(const auto& leg: itinerary.legs){
                 i_leg++;
-                std::cout << "  " << i << " " << i_leg << " mode: " << leg.mode  << "\n";
-                std::cout << "  " << i << " " << i_leg << " " << leg.from.name  << "->" << leg.to.name <<  "\n";
-                std::cout << "  " << i << " " << i_leg << " headsign: " << leg.headsign  << "\n";
-                std::cout << "  " << i << " " << i_leg << " duration: " << leg.duration / 60.0 << " minutes\n";
-                std::cout << "  " << i << " " << i_leg << " " << leg.routeShortName << " " << leg.agencyName << "\n";
-                std::cout << "  " << i << " " << i_leg << " number of intermediateStops: " << leg.intermediateStops.size() << "\n"; 
-                int i_stop = 0;
-                for(const auto& intermediateStop: leg.intermediateStops){
-                    i_stop++;
-                    std::cout << "  " << i << " " << i_leg << " " << i_stop << " " << intermediateStop.name << "\n"; 
-                }
+                LOG_DEBUG("route: leg", "itinerary", i, "leg", i_leg, "mode", leg.mode, "from", leg.from.name, "to", leg.to.name, "headsign", leg.headsign, "duration_min", leg.duration / 60.0, "route", leg.routeShortName, "agency", leg.agencyName, "co2_g", ptEmission->co2(leg), "factor", ptEmission->factor(leg), "stops", leg.intermediateStops.size());
             }
         }
     }
     catch (const nlohmann::json::exception& e){
-        std::cout << "Could not read back json result from motis:\n  ";
-        std::cout << e.what() << "\n";
+        LOG_ERROR("route: could not read back json result from motis", "error", e.what());
     }
 
 }
@@ -191,10 +435,16 @@ void route::isoemission(void) {
 }
     
 double route::co2(std::string carClass){
-    SUMOEmissionClass emissionClass = PollutantsInterface::getClassByName(carClass);
+    static metrics::histogram& co2Seconds = metrics::instance().getHistogram("co2carpool_route_seconds", "Duration of the routing stages", {{"stage", "co2"}});
+    metrics::scopedTimer timer(co2Seconds, "route::co2", "co2");
+    double total_co2 = co2(PollutantsInterface::getClassByName(carClass), instructions);
+    LOG_DEBUG("route: car emission", "co2_kg", total_co2/1000.0, "distance_km", std::accumulate(instructions.begin(), instructions.end(), 0.0, [](double sum, const instruction& step){ return sum + step.distance; })/1000.0);
+    return total_co2;
+}
+
+double route::co2(SUMOEmissionClass emissionClass, std::vector<instruction>& l_instructions){
     double total_co2 = 0;
-    double total_distance = 0;
-    for(auto& instruction: instructions){
+    for(auto& instruction: l_instructions){
         if(instruction.time == 0) continue;
         // distance is in m, time in msec
         // speed in km/h
@@ -203,12 +453,8 @@ double route::co2(std::string carClass){
         // compute gives CO2 in mg/s
         instruction.co2 = (PollutantsInterface::compute(emissionClass,PollutantsInterface::EmissionType::CO2 , speed, 0, 0) / 1000.0) * ((double)instruction.time / 1000.0);
         total_co2 += instruction.co2;
-        total_distance += instruction.distance;
     }
-    std::cout << "Total CO2: " << total_co2/1000.0 << "kg\n";
-    std::cout << "Total distance: " << total_distance/1000.0 << "km\n";
     return total_co2;
-
 }
 @}
 
@@ -0,0 +1,412 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{server class}
+
+In daemon mode the program keeps running and answers planning requests over HTTP with json, so the database connections, curl, the emission classes and the routes calculated so far stay warm and a request only pays for its own work.
+
+The server is a small HTTP/1.1 server with one event loop thread. It accepts the connections, reads the requests and writes the replies without blocking, all sockets are waited on with \verb|poll|. The handlers run as tasks on the scheduler. At most \verb|max_pending| requests are handled at the same time; when more arrive they are answered with \verb|503| immediately instead of queueing up without bound. Connections are kept alive unless the client asks to close them.
+
+\begin{lstlisting}
+"server": { "enabled": false, "address": "127.0.0.1", "port": 8088, "max_pending": 64, "max_body_bytes": 1048576 }
+\end{lstlisting}
+
+@O ../src/server.h -d
+@{
+#ifndef SERVER_CLASS
+#define SERVER_CLASS
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "scheduler.h"
+
+class server {
+public:
+    struct request {
+        std::string method;
+        std::string path;
+        std::map<std::string, std::string> query;
+        std::string body;
+    };
+    // Returns the HTTP status and fills the json reply
+    typedef std::function<int(const request&, nlohmann::json& reply)> handler;
+    server(const nlohmann::json& config, scheduler& workers);
+    ~server(void);
+    bool enabled(void) const;
+    void handle(const std::string& method, const std::string& path, handler endpoint);
+    // Starts the event loop thread, false if the port can not be opened
+    bool start(void);
+    void stop(void);
+private:
+    struct connection {
+        int fd;
+        std::string in;
+        std::string out;
+        bool busy;
+        bool close;
+    };
+    void run(void);
+    void accept(void);
+    bool read(connection& client);
+    bool write(connection& client);
+    void dispatch(unsigned long long int id, connection& client, request& parsed);
+    void reply(unsigned long long int id, int status, const std::string& body, bool close);
+    void wake(void);
+    static bool parse(std::string& buffer, request& parsed, bool& close, size_t maxBody, int& error);
+    static std::string response(int status, const std::string& body, bool close);
+    struct cfg {
+        cfg() : enabled(false), address("127.0.0.1"), port(8088), max_pending(64), max_body_bytes(1048576){};
+        bool enabled;
+        std::string address;
+        unsigned int port;
+        unsigned int max_pending;
+        unsigned int max_body_bytes;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, enabled, address, port, max_pending, max_body_bytes);
+    } config;
+    scheduler& workers;
+    std::map<std::pair<std::string, std::string>, handler> endpoints;
+    std::map<unsigned long long int, connection> connections;
+    unsigned long long int nextId;
+    int listenFd;
+    int wakeFds[2];
+    std::atomic<bool> stopping;
+    std::atomic<unsigned int> pending;
+    std::mutex repliesMutex;
+    std::vector<std::pair<unsigned long long int, std::string> > replies;
+    std::thread loop;
+};
+
+#endif
+@}
+
+@O ../src/server.cpp -d
+@{
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "server.h"
+#include "logger.h"
+#include "metrics.h"
+
+static bool nonBlocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+server::server(const nlohmann::json& l_config, scheduler& l_workers):
+    config(l_config), workers(l_workers), nextId(1), listenFd(-1), stopping(false), pending(0)
+{
+    wakeFds[0] = wakeFds[1] = -1;
+}
+
+server::~server(void){
+    stop();
+    for(auto& client: connections)
+        ::close(client.second.fd);
+    for(int fd: {listenFd, wakeFds[0], wakeFds[1]})
+        if(fd >= 0)
+            ::close(fd);
+}
+
+bool server::enabled(void) const{
+    return config.enabled;
+}
+
+void server::handle(const std::string& method, const std::string& path, handler endpoint){
+    endpoints[{method, path}] = endpoint;
+}
+
+bool server::start(void){
+    if(::pipe(wakeFds) != 0 || !nonBlocking(wakeFds[0]) || !nonBlocking(wakeFds[1])){
+        LOG_ERROR("server: creating wake up pipe failed");
+        return false;
+    }
+    listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(config.port);
+    if(listenFd < 0 || inet_pton(AF_INET, config.address.c_str(), &address.sin_addr) != 1
+            || ::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listenFd, 128) != 0 || !nonBlocking(listenFd)){
+        LOG_ERROR("server: can not listen", "address", config.address, "port", config.port, "error", std::strerror(errno));
+        return false;
+    }
+    LOG_INFO("server: listening", "address", config.address, "port", config.port, "max_pending", config.max_pending);
+    loop = std::thread(&server::run, this);
+    return true;
+}
+
+void server::stop(void){
+    stopping = true;
+    if(loop.joinable()){
+        wake();
+        loop.join();
+    }
+}
+
+void server::wake(void){
+    char byte = 0;
+    ssize_t written = ::write(wakeFds[1], &byte, 1);
+    (void)written;
+}
+@}
+
+The event loop. Replies of the handlers are handed over from the workers through a list and the wake up pipe. A connection is only read again after the reply to its last request is written, so the replies are in the order of the requests.
+
+@O ../src/server.cpp -d
+@{
+void server::run(void){
+    std::vector<pollfd> fds;
+    std::vector<unsigned long long int> ids;
+    while(!stopping){
+        fds.clear();
+        ids.clear();
+        fds.push_back({listenFd, POLLIN, 0});
+        fds.push_back({wakeFds[0], POLLIN, 0});
+        for(auto& client: connections){
+            short events = 0;
+            if(!client.second.out.empty())
+                events |= POLLOUT;
+            else if(!client.second.busy)
+                events |= POLLIN;
+            fds.push_back({client.second.fd, events, 0});
+            ids.push_back(client.first);
+        }
+        if(::poll(fds.data(), fds.size(), -1) < 0)
+            continue;
+        if(fds[1].revents & POLLIN){
+            char buffer[64];
+            while(::read(wakeFds[0], buffer, sizeof(buffer)) > 0){}
+            std::lock_guard<std::mutex> lock(repliesMutex);
+            for(auto& finished: replies){
+                auto client = connections.find(finished.first);
+                if(client == connections.end())
+                    continue;
+                client->second.out += finished.second;
+                client->second.busy = false;
+            }
+            replies.clear();
+        }
+        if(fds[0].revents & POLLIN)
+            accept();
+        for(unsigned int i=0; i<ids.size(); i++){
+            auto client = connections.find(ids[i]);
+            short revents = fds[i + 2].revents;
+            bool open = true;
+            if(revents & (POLLERR | POLLHUP | POLLNVAL))
+                open = (revents & POLLIN) && read(client->second);
+            else if(revents & POLLOUT)
+                open = write(client->second);
+            else if(revents & POLLIN)
+                open = read(client->second);
+            if(open && !client->second.busy && client->second.out.empty() && !client->second.in.empty()){
+                request parsed;
+                int error = 0;
+                if(parse(client->second.in, parsed, client->second.close, config.max_body_bytes, error))
+                    dispatch(ids[i], client->second, parsed);
+                else if(error != 0){
+                    client->second.out = response(error, nlohmann::json{{"error", "bad request"}}.dump(), true);
+                    client->second.close = true;
+                }
+            }
+            if(!open){
+                ::close(client->second.fd);
+                connections.erase(client);
+            }
+        }
+    }
+}
+
+void server::accept(void){
+    for(;;){
+        int fd = ::accept(listenFd, NULL, NULL);
+        if(fd < 0)
+            return;
+        nonBlocking(fd);
+        connections[nextId++] = {fd, "", "", false, false};
+    }
+}
+
+bool server::read(connection& client){
+    char buffer[16384];
+    for(;;){
+        ssize_t count = ::recv(client.fd, buffer, sizeof(buffer), 0);
+        if(count > 0){
+            client.in.append(buffer, count);
+            continue;
+        }
+        if(count == 0)
+            return false;
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+
+bool server::write(connection& client){
+    while(!client.out.empty()){
+        ssize_t count = ::send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+        if(count < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        client.out.erase(0, count);
+    }
+    return !client.close;
+}
+@}
+
+Parsing of the requests. Only what is needed for json requests is supported: the request line, \verb|Content-Length| and \verb|Connection: close|. The query of the target is split into its parameters, percent encoding is not decoded as our parameters are numbers.
+
+@O ../src/server.cpp -d
+@{
+bool server::parse(std::string& buffer, request& parsed, bool& close, size_t maxBody, int& error){
+    size_t headerEnd = buffer.find("\r\n\r\n");
+    if(headerEnd == std::string::npos){
+        if(buffer.size() > 65536)
+            error = 431;
+        return false;
+    }
+    size_t lineEnd = buffer.find("\r\n");
+    std::string line = buffer.substr(0, lineEnd);
+    size_t first = line.find(' ');
+    size_t second = line.find(' ', first + 1);
+    if(first == std::string::npos || second == std::string::npos){
+        error = 400;
+        return false;
+    }
+    parsed.method = line.substr(0, first);
+    std::string target = line.substr(first + 1, second - first - 1);
+    close = line.compare(second + 1, std::string::npos, "HTTP/1.0") == 0;
+    size_t contentLength = 0;
+    size_t position = lineEnd + 2;
+    while(position < headerEnd){
+        size_t end = buffer.find("\r\n", position);
+        std::string header = buffer.substr(position, end - position);
+        position = end + 2;
+        size_t colon = header.find(':');
+        if(colon == std::string::npos)
+            continue;
+        std::string name = header.substr(0, colon);
+        std::string value = header.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        if(name == "content-length")
+            contentLength = std::strtoul(value.c_str(), NULL, 10);
+        else if(name == "connection")
+            close = value == "close";
+    }
+    if(contentLength > maxBody){
+        error = 413;
+        return false;
+    }
+    if(buffer.size() < headerEnd + 4 + contentLength)
+        return false;
+    parsed.body = buffer.substr(headerEnd + 4, contentLength);
+    buffer.erase(0, headerEnd + 4 + contentLength);
+    size_t questionMark = target.find('?');
+    parsed.path = target.substr(0, questionMark);
+    if(questionMark != std::string::npos){
+        std::string query = target.substr(questionMark + 1);
+        size_t start = 0;
+        while(start < query.size()){
+            size_t end = query.find('&', start);
+            if(end == std::string::npos) end = query.size();
+            std::string parameter = query.substr(start, end - start);
+            size_t equals = parameter.find('=');
+            parsed.query[parameter.substr(0, equals)] = equals == std::string::npos ? "" : parameter.substr(equals + 1);
+            start = end + 1;
+        }
+    }
+    return true;
+}
+
+std::string server::response(int status, const std::string& body, bool close){
+    static const std::map<int, const char*> reasons = {
+        {200, "OK"}, {400, "Bad Request"}, {404, "Not Found"}, {413, "Payload Too Large"},
+        {431, "Request Header Fields Too Large"}, {500, "Internal Server Error"}, {503, "Service Unavailable"}
+    };
+    auto reason = reasons.find(status);
+    return "HTTP/1.1 " + std::to_string(status) + " " + (reason != reasons.end() ? reason->second : "Unknown") + "\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        + (close ? "Connection: close\r\n" : "") + "\r\n" + body;
+}
+@}
+
+A request is handed to the scheduler if there is a free place, otherwise it is refused at once.
+
+@O ../src/server.cpp -d
+@{
+void server::dispatch(unsigned long long int id, connection& client, request& parsed){
+    metrics& registry = metrics::instance();
+    auto endpoint = endpoints.find({parsed.method, parsed.path});
+    if(endpoint == endpoints.end()){
+        client.out = response(404, nlohmann::json{{"error", "unknown endpoint"}}.dump(), client.close);
+        return;
+    }
+    if(pending >= config.max_pending){
+        registry.getCounter("co2carpool_http_rejected_total", "Requests refused because all places were taken").add();
+        client.out = response(503, nlohmann::json{{"error", "busy"}}.dump(), client.close);
+        return;
+    }
+    pending++;
+    client.busy = true;
+    metrics::histogram& seconds = registry.getHistogram("co2carpool_http_request_seconds", "Duration of handling the http requests", {{"path", parsed.path}});
+    bool close = client.close;
+    workers.submit([this, id, close, parsed, endpoint = endpoint->second, &seconds]{
+        metrics::scopedTimer timer(seconds, "server request", "server");
+        nlohmann::json answer;
+        int status;
+        try{
+            status = endpoint(parsed, answer);
+        } catch(const nlohmann::json::exception& error){
+            status = 400;
+            answer = {{"error", error.what()}};
+        } catch(const std::exception& error){
+            status = 500;
+            answer = {{"error", error.what()}};
+        }
+        reply(id, status, answer.dump(), close);
+    });
+}
+
+void server::reply(unsigned long long int id, int status, const std::string& body, bool close){
+    {
+        std::lock_guard<std::mutex> lock(repliesMutex);
+        replies.push_back({id, response(status, body, close)});
+    }
+    pending--;
+    wake();
+}
+@}
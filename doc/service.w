@@ -0,0 +1,186 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{service class}
+
+The service keeps the state of the daemon: the participants, the destination and the planner with its routes. It is used by the endpoints of the server and by the listener, so all changes are serialised with a mutex. The endpoints are
+
+\begin{description}
+\item[POST /plan] plans again for all participants and returns the pickups. The body can give new \verb|participants| and a new \verb|destination|, otherwise the current ones are used.
+\item[POST /participants] adds or changes one participant (json as in the participants file) and plans only the pairs with this participant again.
+\item[GET /zone?driver=id] returns the isoemission zone of a driver as polygon and the passengers inside it.
+\item[GET /pickups] returns the current pickups without planning.
+\end{description}
+
+@O ../src/service.h -d
+@{
+#ifndef SERVICE_CLASS
+#define SERVICE_CLASS
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "database.h"
+#include "participant.h"
+#include "planner.h"
+#include "route.h"
+#include "server.h"
+
+class service {
+public:
+    // db may be null if the participants are not stored in a database
+    service(planner& eventPlanner, std::shared_ptr<database> db, const std::vector<participant>& participants, const route::coordinate& destination);
+    void serve(server& api);
+    // Participants changed in the database, an empty list means all
+    void changed(const std::vector<unsigned int>& ids);
+    int plan(const server::request& query, nlohmann::json& reply);
+    int addParticipant(const server::request& query, nlohmann::json& reply);
+    int zone(const server::request& query, nlohmann::json& reply);
+    int pickups(const server::request& query, nlohmann::json& reply);
+private:
+    nlohmann::json pickupsJson(void) const;
+    planner& eventPlanner;
+    std::shared_ptr<database> db;
+    std::vector<participant> participants;
+    route::coordinate destination;
+    std::mutex stateMutex;
+};
+
+#endif
+@}
+
+@O ../src/service.cpp -d
+@{
+#include <algorithm>
+#include <map>
+
+#include "service.h"
+#include "logger.h"
+
+service::service(planner& l_eventPlanner, std::shared_ptr<database> l_db, const std::vector<participant>& l_participants, const route::coordinate& l_destination):
+    eventPlanner(l_eventPlanner), db(l_db), participants(l_participants), destination(l_destination)
+{
+}
+
+void service::serve(server& api){
+    api.handle("POST", "/plan", [this](const server::request& query, nlohmann::json& reply){ return plan(query, reply); });
+    api.handle("POST", "/participants", [this](const server::request& query, nlohmann::json& reply){ return addParticipant(query, reply); });
+    api.handle("GET", "/zone", [this](const server::request& query, nlohmann::json& reply){ return zone(query, reply); });
+    api.handle("GET", "/pickups", [this](const server::request& query, nlohmann::json& reply){ return pickups(query, reply); });
+}
+
+nlohmann::json service::pickupsJson(void) const{
+    nlohmann::json result = nlohmann::json::array();
+    for(const auto& pickup: eventPlanner.pickups())
+        result.push_back({
+            {"driver", participants[pickup.driver].id},
+            {"passenger", participants[pickup.passenger].id},
+            {"co2_saving", pickup.co2Saving}
+        });
+    return result;
+}
+
+void service::changed(const std::vector<unsigned int>& ids){
+    std::lock_guard<std::mutex> lock(stateMutex);
+    if(!db)
+        return;
+    if(ids.empty()){
+        participants = db->participants();
+        eventPlanner.plan(participants, destination);
+        return;
+    }
+    std::map<unsigned int, participant> current;
+    for(const auto& traveller: participants)
+        current[traveller.id] = traveller;
+    for(unsigned int id: ids)
+        current.erase(id);
+    for(const auto& traveller: db->participants(ids))
+        current[traveller.id] = traveller;
+    participants.clear();
+    for(const auto& traveller: current)
+        participants.push_back(traveller.second);
+    eventPlanner.update(participants, ids, destination);
+}
+
+int service::plan(const server::request& query, nlohmann::json& reply){
+    nlohmann::json body = query.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(query.body);
+    std::lock_guard<std::mutex> lock(stateMutex);
+    if(body.contains("participants")){
+        participants = body["participants"].get<std::vector<participant> >();
+        if(db && !db->insertParticipants(participants)){
+            reply = {{"error", "storing participants failed"}};
+            return 500;
+        }
+    }
+    if(body.contains("destination"))
+        destination = body["destination"].get<route::coordinate>();
+    eventPlanner.plan(participants, destination);
+    reply = {{"pickups", pickupsJson()}};
+    return 200;
+}
+
+int service::addParticipant(const server::request& query, nlohmann::json& reply){
+    participant traveller = nlohmann::json::parse(query.body).get<participant>();
+    std::lock_guard<std::mutex> lock(stateMutex);
+    if(db && !db->insertParticipants({traveller})){
+        reply = {{"error", "storing participant failed"}};
+        return 500;
+    }
+    auto known = std::find_if(participants.begin(), participants.end(), [&traveller](const participant& other){ return other.id == traveller.id; });
+    if(known != participants.end())
+        *known = traveller;
+    else
+        participants.push_back(traveller);
+    eventPlanner.update(participants, {traveller.id}, destination);
+    reply = {{"pickups", pickupsJson()}};
+    return 200;
+}
+
+int service::zone(const server::request& query, nlohmann::json& reply){
+    auto driverParameter = query.query.find("driver");
+    if(driverParameter == query.query.end()){
+        reply = {{"error", "parameter driver missing"}};
+        return 400;
+    }
+    unsigned int driverId = std::strtoul(driverParameter->second.c_str(), NULL, 10);
+    std::lock_guard<std::mutex> lock(stateMutex);
+    auto driver = std::find_if(participants.begin(), participants.end(), [driverId](const participant& other){ return other.id == driverId && other.driver; });
+    if(driver == participants.end()){
+        reply = {{"error", "unknown driver"}};
+        return 404;
+    }
+    std::vector<route::coordinate> polygon = eventPlanner.zone(*driver, destination);
+    std::vector<unsigned int> passengers;
+    if(db)
+        passengers = db->participantsInZone(driver->id, driver->capacity);
+    else
+        for(const auto& pickup: eventPlanner.pickups())
+            if(participants[pickup.driver].id == driverId)
+                passengers.push_back(participants[pickup.passenger].id);
+    reply = {{"driver", driverId}, {"zone", polygon}, {"passengers", passengers}};
+    return 200;
+}
+
+int service::pickups(const server::request&, nlohmann::json& reply){
+    std::lock_guard<std::mutex> lock(stateMutex);
+    reply = {{"pickups", pickupsJson()}};
+    return 200;
+}
+@}
@@ -0,0 +1,267 @@
+% Copyright 2024 Florian Pesth
+%
+% This file is part of co2carpool.
+%
+% co2carpool is free software: you can redistribute it and/or modify
+% it under the terms of the GNU Affero General Public License as
+% published by the Free Software Foundation version 3 of the
+% License.
+%
+% co2carpool is distributed in the hope that it will be useful,
+% but WITHOUT ANY WARRANTY; without even the implied warranty of
+% MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+% GNU Affero General Public License for more details.
+%
+% You should have received a copy of the GNU Affero General Public License
+% along with this program.  If not, see <http://www.gnu.org/licenses/>.
+\subsection{simplifier class}
+
+Graphhopper gives a point every few metres of a route, but storing the route segments in PostGIS, building corridors around them and testing points against polygons do not need that detail and cost time with every point. The simplifier removes points of a path so that no removed point is further than \verb|tolerance_m| metres from the simplified path. The first and the last point are always kept.
+
+Two methods can be chosen with \verb|method|. Douglas-Peucker (\verb|douglas_peucker|, the default) keeps the point furthest from the segment between the first and the last point if it is further than the tolerance and continues with both halves. Visvalingam-Whyatt (\verb|visvalingam|) removes the point with the smallest triangle with its neighbours again and again; it keeps the shape of curves better. The triangles alone do not bound the error, so a point is only removed if all points removed so far between its neighbours stay within the tolerance of the new segment.
+
+Distances are measured in a plane tangent to the earth at the point which is tested, like the haversine distance this is exact enough for segments of some km. The simplification of a path does not depend on other paths, so the paths of many routes are simplified in parallel: the calling thread shares them with the workers of the scheduler in up to \verb|threads| parts (0 for one per worker and one for the caller), without a scheduler the caller simplifies them alone.
+
+The points where an instruction of graphhopper starts or ends are kept and the path is simplified between them, so the intervals of the instructions still refer to the same points of the simplified path. The number of points before and after is counted in \verb|co2carpool_simplify_points_total|.
+
+@O ../src/simplifier.h -d
+@{
+#ifndef SIMPLIFIER_CLASS
+#define SIMPLIFIER_CLASS
+
+#include <memory>
+#include <string>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "route.h"
+#include "scheduler.h"
+
+class simplifier {
+public:
+    simplifier(const nlohmann::json& config = nlohmann::json::object());
+    // Indices of the points to keep, in order
+    std::vector<std::size_t> keep(const std::vector<route::coordinate>& path) const;
+    // Same, but the fixed points are kept as well, sorted indices
+    std::vector<std::size_t> keep(const std::vector<route::coordinate>& path, const std::vector<std::size_t>& fixed) const;
+    std::vector<route::coordinate> simplify(const std::vector<route::coordinate>& path) const;
+    // Simplifies the car paths of the routes, in parallel with workers
+    void simplify(const std::vector<std::shared_ptr<route> >& routes, scheduler* workers = nullptr) const;
+    double tolerance(void) const;
+    // Distance of point from the segment from a to b in m
+    static double deviation(const route::coordinate& point, const route::coordinate& a, const route::coordinate& b);
+private:
+    std::vector<std::size_t> douglasPeucker(const std::vector<route::coordinate>& path) const;
+    std::vector<std::size_t> visvalingam(const std::vector<route::coordinate>& path) const;
+    struct cfg {
+        cfg() : tolerance_m(5.0), method("douglas_peucker"), threads(0){};
+        double tolerance_m;
+        std::string method;
+        unsigned int threads;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, tolerance_m, method, threads);
+    } config;
+};
+
+#endif
+@}
+
+@O ../src/simplifier.cpp -d
+@{
+#include "simplifier.h"
+#include "geo.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <tuple>
+
+simplifier::simplifier(const nlohmann::json& l_config):
+    config(l_config)
+{
+    if(config.method != "douglas_peucker" && config.method != "visvalingam"){
+        LOG_ERROR("simplifier: unknown method, using douglas_peucker", "method", config.method);
+        config.method = "douglas_peucker";
+    }
+}
+
+double simplifier::tolerance(void) const{
+    return config.tolerance_m;
+}
+
+double simplifier::deviation(const route::coordinate& point, const route::coordinate& a, const route::coordinate& b){
+    // Plane tangent at point, in m
+    const double metres = geo::radians(1.0) * geo::earthRadius * 1000.0;
+    double scale = std::cos(geo::radians(point.lat));
+    double ax = std::remainder(a.lon - point.lon, 360.0) * scale * metres, ay = (a.lat - point.lat) * metres;
+    double bx = std::remainder(b.lon - point.lon, 360.0) * scale * metres, by = (b.lat - point.lat) * metres;
+    double dx = bx - ax, dy = by - ay;
+    double squared = dx * dx + dy * dy;
+    double t = squared > 0 ? std::clamp(-(ax * dx + ay * dy) / squared, 0.0, 1.0) : 0.0;
+    return std::hypot(ax + t * dx, ay + t * dy);
+}
+
+std::vector<std::size_t> simplifier::keep(const std::vector<route::coordinate>& path) const{
+    if(path.size() < 3 || config.tolerance_m <= 0){
+        std::vector<std::size_t> all(path.size());
+        for(std::size_t i=0; i<all.size(); i++)
+            all[i] = i;
+        return all;
+    }
+    return config.method == "visvalingam" ? visvalingam(path) : douglasPeucker(path);
+}
+
+std::vector<std::size_t> simplifier::keep(const std::vector<route::coordinate>& path, const std::vector<std::size_t>& fixed) const{
+    std::vector<std::size_t> result;
+    std::size_t first = 0;
+    for(std::size_t i=0; first + 1 < path.size(); i++){
+        std::size_t last = i < fixed.size() ? std::min(fixed[i], path.size() - 1) : path.size() - 1;
+        if(last <= first)
+            continue;
+        std::vector<route::coordinate> part(path.begin() + first, path.begin() + last + 1);
+        for(std::size_t index: keep(part))
+            if(result.empty() || first + index != result.back())
+                result.push_back(first + index);
+        first = last;
+    }
+    if(result.empty() && !path.empty())
+        result.push_back(0);
+    return result;
+}
+
+std::vector<route::coordinate> simplifier::simplify(const std::vector<route::coordinate>& path) const{
+    std::vector<route::coordinate> simplified;
+    for(std::size_t i: keep(path))
+        simplified.push_back(path[i]);
+    return simplified;
+}
+@}
+
+Douglas-Peucker with a stack of ranges instead of recursion, as long routes would go deep.
+
+@O ../src/simplifier.cpp -d
+@{
+std::vector<std::size_t> simplifier::douglasPeucker(const std::vector<route::coordinate>& path) const{
+    std::vector<bool> kept(path.size(), false);
+    kept.front() = kept.back() = true;
+    std::vector<std::pair<std::size_t, std::size_t> > ranges = {{0, path.size() - 1}};
+    while(!ranges.empty()){
+        auto [first, last] = ranges.back();
+        ranges.pop_back();
+        double furthest = 0;
+        std::size_t index = first;
+        for(std::size_t i=first+1; i<last; i++){
+            double distance = deviation(path[i], path[first], path[last]);
+            if(distance > furthest){
+                furthest = distance;
+                index = i;
+            }
+        }
+        if(furthest <= config.tolerance_m)
+            continue;
+        kept[index] = true;
+        ranges.push_back({first, index});
+        ranges.push_back({index, last});
+    }
+    std::vector<std::size_t> result;
+    for(std::size_t i=0; i<path.size(); i++)
+        if(kept[i])
+            result.push_back(i);
+    return result;
+}
+@}
+
+For Visvalingam-Whyatt the points are linked to their neighbours and kept in a heap by the area of their triangle. Entries in the heap which are outdated because a neighbour was removed are skipped. A point which may not be removed because of the tolerance stays until one of its neighbours is removed and its triangle is computed again.
+
+@O ../src/simplifier.cpp -d
+@{
+std::vector<std::size_t> simplifier::visvalingam(const std::vector<route::coordinate>& path) const{
+    const double metres = geo::radians(1.0) * geo::earthRadius * 1000.0;
+    std::size_t size = path.size();
+    std::vector<std::size_t> previous(size), next(size);
+    std::vector<unsigned int> version(size, 0);
+    std::vector<bool> removed(size, false);
+    for(std::size_t i=0; i<size; i++){
+        previous[i] = i - 1;
+        next[i] = i + 1;
+    }
+    auto area = [&](std::size_t i){
+        const route::coordinate& a = path[previous[i]];
+        const route::coordinate& b = path[i];
+        const route::coordinate& c = path[next[i]];
+        double scale = std::cos(geo::radians(b.lat)) * metres;
+        double abx = (a.lon - b.lon) * scale, aby = (a.lat - b.lat) * metres;
+        double cbx = (c.lon - b.lon) * scale, cby = (c.lat - b.lat) * metres;
+        return std::fabs(abx * cby - aby * cbx) / 2;
+    };
+    typedef std::tuple<double, std::size_t, unsigned int> entry;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > heap;
+    for(std::size_t i=1; i+1<size; i++)
+        heap.push({area(i), i, 0});
+    while(!heap.empty()){
+        auto [triangle, i, seen] = heap.top();
+        heap.pop();
+        if(removed[i] || seen != version[i])
+            continue;
+        std::size_t before = previous[i], after = next[i];
+        bool within = true;
+        for(std::size_t k=before+1; k<after && within; k++)
+            within = deviation(path[k], path[before], path[after]) <= config.tolerance_m;
+        if(!within)
+            continue;
+        removed[i] = true;
+        next[before] = after;
+        previous[after] = before;
+        for(std::size_t neighbour: {before, after}){
+            if(neighbour == 0 || neighbour + 1 == size)
+                continue;
+            version[neighbour]++;
+            heap.push({area(neighbour), neighbour, version[neighbour]});
+        }
+    }
+    std::vector<std::size_t> result;
+    for(std::size_t i=0; i<size; i=next[i])
+        result.push_back(i);
+    return result;
+}
+@}
+
+The routes are handed out to the parts one by one, so a part with long routes does not hold up the others.
+
+@O ../src/simplifier.cpp -d
+@{
+void simplifier::simplify(const std::vector<std::shared_ptr<route> >& routes, scheduler* workers) const{
+    static metrics::counter& pointsIn = metrics::instance().getCounter("co2carpool_simplify_points_total", "Points of the paths before and after simplification", {{"stage", "input"}});
+    static metrics::counter& pointsOut = metrics::instance().getCounter("co2carpool_simplify_points_total", "Points of the paths before and after simplification", {{"stage", "output"}});
+    metrics::scopedTimer timer(metrics::instance().getHistogram("co2carpool_simplify_seconds", "Duration of the simplification of the paths"), "simplifier::simplify", "simplify");
+    std::atomic<std::size_t> nextRoute(0);
+    std::atomic<unsigned long long int> before(0), after(0);
+    auto work = [&](unsigned int){
+        for(std::size_t i = nextRoute++; i < routes.size(); i = nextRoute++){
+            std::vector<route::coordinate> path = routes[i]->path().vector();
+            std::vector<std::size_t> kept = keep(path, routes[i]->instructionPoints());
+            std::vector<route::coordinate> simplified;
+            for(std::size_t index: kept)
+                simplified.push_back(path[index]);
+            before += path.size();
+            after += simplified.size();
+            routes[i]->setPath(compactPath<route::coordinate>(simplified), kept);
+        }
+    };
+    if(workers){
+        unsigned int parts = config.threads > 0 ? config.threads : workers->workers() + 1;
+        workers->share(std::min<std::size_t>(parts, routes.size()), work);
+    }
+    else
+        work(0);
+    pointsIn.add(before);
+    pointsOut.add(after);
+    LOG_INFO("simplifier: simplified paths", "routes", routes.size(), "points_before", before.load(), "points_after", after.load(),
+        "reduction", before > 0 ? 1.0 - static_cast<double>(after) / before : 0.0, "tolerance_m", config.tolerance_m, "method", config.method);
+}
+@}
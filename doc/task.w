@@ -30,8 +30,202 @@ public:
     virtual bool isCompleted(void) const = 0;
     virtual unsigned int priority(void) const = 0;
     virtual void execute(void) = 0;
+    virtual ~task(void) = default;
 };
 #endif // TASK_CLASS
 @}
 
+\subsection{scheduler class}
+
+The scheduler runs tasks on a fixed number of worker threads. Tasks with a higher priority are started first, tasks with the same priority in the order they were submitted. A task is only executed once; if it is already completed when a worker picks it up it is skipped. For small jobs a function can be submitted directly, it is wrapped into a task. The number of workers is set in the configuration, 0 uses one worker per hardware thread:
+
+\begin{lstlisting}
+"scheduler": { "workers": 0 }
+\end{lstlisting}
+
+Other parts of the program size their resources to the workers, for example the database opens one connection per worker.
+
+A job split into parts can be shared with the workers by \verb|share|: the caller works on the first part and the others are submitted. The parts take their work from a common counter, so the caller does all of it if the workers are busy. It then only waits for the parts which were started before it was done, a part starting later returns at once. So \verb|share| can be called from a worker without waiting for tasks queued behind it.
+
+@O ../src/scheduler.h -d
+@{
+#ifndef SCHEDULER_CLASS
+#define SCHEDULER_CLASS
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+# define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
+#include "task.h"
+
+class scheduler
+{
+public:
+    scheduler(const nlohmann::json& config = nlohmann::json::object());
+    ~scheduler(void);
+    void submit(std::shared_ptr<task> job);
+    void submit(std::function<void(void)> job, unsigned int priority = 0);
+    // Blocks until all submitted tasks are done
+    void wait(void);
+    // Runs work(0) in the calling thread and work(1) up to work(parts - 1) on the workers, waits only for the parts already started
+    void share(unsigned int parts, const std::function<void(unsigned int)>& work);
+    unsigned int workers(void) const;
+private:
+    void work(void);
+    struct entry {
+        std::shared_ptr<task> job;
+        unsigned long long int sequence;
+        bool operator<(const entry& other) const;
+    };
+    struct cfg {
+        cfg() : workers(0){};
+        unsigned int workers;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(cfg, workers);
+    } config;
+    std::priority_queue<entry> queue;
+    unsigned long long int submitted;
+    unsigned int running;
+    bool stopping;
+    std::mutex queueMutex;
+    std::condition_variable wakeUp;
+    std::condition_variable done;
+    std::vector<std::thread> threads;
+};
+#endif // SCHEDULER_CLASS
+@}
+
+@O ../src/scheduler.cpp -d
+@{
+#include <algorithm>
+
+#include "scheduler.h"
+#include "logger.h"
+#include "metrics.h"
+
+class functionTask : public task
+{
+public:
+    functionTask(std::function<void(void)> l_job, unsigned int l_priority):
+        job(l_job), jobPriority(l_priority), completed(false){}
+    bool isCompleted(void) const { return completed; }
+    unsigned int priority(void) const { return jobPriority; }
+    void execute(void){ job(); completed = true; }
+private:
+    std::function<void(void)> job;
+    unsigned int jobPriority;
+    bool completed;
+};
+
+bool scheduler::entry::operator<(const entry& other) const{
+    if(job->priority() != other.job->priority())
+        return job->priority() < other.job->priority();
+    return sequence > other.sequence;
+}
+
+scheduler::scheduler(const nlohmann::json& l_config):
+    config(l_config), submitted(0), running(0), stopping(false)
+{
+    unsigned int count = config.workers;
+    if(count == 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+    LOG_INFO("scheduler: starting workers", "workers", count);
+    for(unsigned int i=0; i<count; i++)
+        threads.emplace_back(&scheduler::work, this);
+}
+
+scheduler::~scheduler(void){
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for(std::thread& thread: threads)
+        thread.join();
+}
+
+unsigned int scheduler::workers(void) const{
+    return threads.size();
+}
+
+void scheduler::submit(std::shared_ptr<task> job){
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push({job, submitted++});
+    }
+    wakeUp.notify_one();
+}
+
+void scheduler::submit(std::function<void(void)> job, unsigned int priority){
+    submit(std::make_shared<functionTask>(job, priority));
+}
+
+void scheduler::wait(void){
+    std::unique_lock<std::mutex> lock(queueMutex);
+    done.wait(lock, [this]{ return queue.empty() && running == 0; });
+}
+
+void scheduler::share(unsigned int parts, const std::function<void(unsigned int)>& work){
+    struct progress {
+        std::mutex mutex;
+        std::condition_variable done;
+        unsigned int running = 0;
+        bool closed = false;
+    };
+    auto state = std::make_shared<progress>();
+    for(unsigned int part=1; part<parts; part++)
+        submit([state, &work, part]{
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if(state->closed)
+                    return;
+                state->running++;
+            }
+            work(part);
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if(--state->running == 0)
+                state->done.notify_all();
+        });
+    work(0);
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->closed = true;
+    state->done.wait(lock, [&state]{ return state->running == 0; });
+}
+
+void scheduler::work(void){
+    static metrics::counter& executed = metrics::instance().getCounter("co2carpool_tasks_total", "Tasks executed by the scheduler");
+    for(;;){
+        std::shared_ptr<task> job;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            wakeUp.wait(lock, [this]{ return stopping || !queue.empty(); });
+            if(queue.empty())
+                return;
+            job = queue.top().job;
+            queue.pop();
+            running++;
+        }
+        if(!job->isCompleted()){
+            try{
+                job->execute();
+            } catch(const std::exception& error){
+                LOG_ERROR("scheduler: task failed", "error", error.what());
+            }
+            executed.add();
+        }
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            running--;
+        }
+        done.notify_all();
+    }
+}
+@}
+
 